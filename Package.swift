@@ -21,7 +21,18 @@ let package = Package(
       dependencies: [],
       path: "Sources/llamaObjCxx",
       exclude: [
-        "cpp/quantize.cpp"
+        "cpp/quantize.cpp",
+        "cpp/convert.cpp",
+        "cpp/footprint.cpp",
+        "cpp/bench-sessions.mm",
+        "cpp/bench-hugepages.cpp",
+        "cpp/bench-tokenize.cpp",
+        "cpp/bench-split.cpp",
+        "cpp/bench-sample.cpp",
+        "cpp/bench-topk.cpp",
+        "cpp/bench-grammar.cpp",
+        "cpp/bench-speculative.cpp",
+        "cpp/bench.h"
       ],
       publicHeadersPath: "headers",
       cxxSettings: [
@@ -0,0 +1,542 @@
+#include "ggml.h"
+
+#include "bench.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+// the regexes that the generations are constrained to, besides JSON
+static const char * bench_regexes[] = {
+    "(yes|no|maybe)",
+    "[0-9]{3}-[0-9]{3}-[0-9]{4}",
+    "\\d{4}-\\d{2}-\\d{2}T\\d{2}:\\d{2}(:\\d{2})?Z",
+    "[a-z0-9._]+@[a-z0-9]+\\.(com|org|net)",
+    "[A-Z][a-z]+( [A-Z][a-z]+){0,3}\\.",
+    "\"([^\"\\\\\\n]|\\\\[\"\\\\n])*\"",
+};
+
+// a strict JSON parser, to check the generations against something other than the grammar
+struct bench_json {
+    const std::string & text;
+    size_t pos = 0;
+
+    explicit bench_json(const std::string & text) : text(text) {}
+
+    int peek() const {
+        return pos < text.size() ? (uint8_t) text[pos] : -1;
+    }
+
+    void ws() {
+        while (peek() == ' ' || peek() == '\t' || peek() == '\n' || peek() == '\r') {
+            ++pos;
+        }
+    }
+
+    bool digits() {
+        const size_t start = pos;
+        while (peek() >= '0' && peek() <= '9') {
+            ++pos;
+        }
+        return pos > start;
+    }
+
+    bool string() {
+        ++pos;
+        while (true) {
+            const int c = peek();
+            if (c < 0x20) {
+                return false;
+            }
+            ++pos;
+            if (c == '"') {
+                return true;
+            }
+            if (c == '\\') {
+                const int e = peek();
+                ++pos;
+                if (e == 'u') {
+                    for (int i = 0; i < 4; ++i, ++pos) {
+                        if (!isxdigit(peek())) {
+                            return false;
+                        }
+                    }
+                } else if (e < 0 || !strchr("\"\\/bfnrt", e)) {
+                    return false;
+                }
+            } else if (c >= 0x80) {
+                // the code point, which must take as few bytes as it can and be neither a surrogate nor past U+10FFFF
+                const int n = c >= 0xc0 && c <= 0xdf ? 1 : c >= 0xe0 && c <= 0xef ? 2 : c >= 0xf0 && c <= 0xf7 ? 3 : -1;
+                if (n < 0) {
+                    return false;
+                }
+                uint32_t cp = c & (0x3f >> n);
+                for (int i = 0; i < n; ++i, ++pos) {
+                    if ((peek() & 0xc0) != 0x80) {
+                        return false;
+                    }
+                    cp = cp << 6 | (peek() & 0x3f);
+                }
+                static const uint32_t cp_min[] = { 0x80, 0x800, 0x10000 };
+                if (cp < cp_min[n - 1] || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    bool value(int depth) {
+        ws();
+        const int c = peek();
+        if (c == '{' || c == '[') {
+            if (depth == 0) {
+                return false;
+            }
+            ++pos;
+            ws();
+            if (peek() == (c == '{' ? '}' : ']')) {
+                ++pos;
+                return true;
+            }
+            while (true) {
+                if (c == '{') {
+                    ws();
+                    if (peek() != '"' || !string()) {
+                        return false;
+                    }
+                    ws();
+                    if (peek() != ':') {
+                        return false;
+                    }
+                    ++pos;
+                }
+                if (!value(depth - 1)) {
+                    return false;
+                }
+                ws();
+                if (peek() == ',') {
+                    ++pos;
+                    continue;
+                }
+                if (peek() != (c == '{' ? '}' : ']')) {
+                    return false;
+                }
+                ++pos;
+                return true;
+            }
+        }
+        if (c == '"') {
+            return string();
+        }
+        for (const char * lit : { "true", "false", "null" }) {
+            if (text.compare(pos, strlen(lit), lit) == 0) {
+                pos += strlen(lit);
+                return true;
+            }
+        }
+        if (c == '-') {
+            ++pos;
+        }
+        if (peek() == '0') {
+            ++pos;
+        } else if (!digits()) {
+            return false;
+        }
+        if (peek() == '.') {
+            ++pos;
+            if (!digits()) {
+                return false;
+            }
+        }
+        if (peek() == 'e' || peek() == 'E') {
+            ++pos;
+            if (peek() == '+' || peek() == '-') {
+                ++pos;
+            }
+            if (!digits()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool valid(const std::string & text, int max_depth) {
+        bench_json json(text);
+        if (!json.value(max_depth)) {
+            return false;
+        }
+        json.ws();
+        return json.pos == text.size();
+    }
+};
+
+// strings at the edges of UTF-8, which the grammar of JSON must agree on with the parser: the last of the overlong
+// forms, of the code points before and after the surrogates and of those up to U+10FFFF
+static const struct {
+    const char * text;
+    bool valid;
+} bench_json_utf8[] = {
+    { "\"\xc3\xa9\"",         true  }, { "\"\xc1\xbf\"",         false },
+    { "\"\xe0\xa0\x80\"",     true  }, { "\"\xe0\x80\x80\"",     false }, { "\"\xe0\x9f\xbf\"",     false },
+    { "\"\xed\x9f\xbf\"",     true  }, { "\"\xed\xa0\x80\"",     false }, { "\"\xed\xbf\xbf\"",     false },
+    { "\"\xee\x80\x80\"",     true  },
+    { "\"\xf0\x90\x80\x80\"", true  }, { "\"\xf0\x80\x80\x80\"", false }, { "\"\xf0\x8f\xbf\xbf\"", false },
+    { "\"\xf4\x8f\xbf\xbf\"", true  }, { "\"\xf4\x90\x80\x80\"", false }, { "\"\xf4\xbf\xbf\xbf\"", false },
+    { "\"\xf5\x80\x80\x80\"", false }, { "\"\xe2\x82\"",         false },
+};
+
+// whether the grammar matches the whole text
+static bool bench_matches(const llama_grammar & grammar, const std::string & text) {
+    int state = 0;
+    for (size_t i = 0; i < text.size() && state >= 0; ++i) {
+        state = llama_grammar_step(grammar, state, text[i]);
+    }
+    return state >= 0 && grammar.accepting[state];
+}
+
+// the results of constrained generations from a grammar
+struct bench_result {
+    int n_texts  = 0;
+    int n_ended  = 0; // on EOS, within the budget of tokens
+    int n_tokens = 0;
+
+    std::vector<std::string> texts; // those that ended
+
+    std::vector<std::pair<int, gpt_vocab::id>> steps; // the states the sampler masked the logits in, and the tokens it sampled in them
+};
+
+// generate n_texts texts of up to n_predict tokens from random logits that favour EOS and the tokens that end the
+// strings, objects and arrays of JSON, as a model asked for a short answer would
+static bool bench_generate(llama_grammar & grammar, const gpt_vocab & vocab, int n_texts, int n_predict, std::mt19937 & rng, bench_result & result) {
+    const int n_vocab = vocab.size();
+
+    std::vector<float> bias(n_vocab, 0.0f);
+    for (int i = 0; i < n_vocab; ++i) {
+        const auto text = vocab.text(i);
+        for (size_t j = 0; j < text.size; ++j) {
+            if (strchr("\"{}[],:", text.data[j]) && text.data[j] != '\0') {
+                bias[i] = 3.0f;
+            }
+        }
+    }
+    bias[LLAMA_TOKEN_EOS] = 8.0f;
+
+    llama_sampler sampler;
+    llama_sampler_init(sampler, n_vocab, 64);
+    llama_sampler_set_stages(sampler, { { LLAMA_SAMPLER_GRAMMAR }, { LLAMA_SAMPLER_REPETITION_PENALTY, 1.30f },
+                                        { LLAMA_SAMPLER_TEMPERATURE, 0.80f }, { LLAMA_SAMPLER_TOP_K, 0.0f, 0.0f, 40 } });
+
+    std::normal_distribution<float> dist(0.0f, 2.0f);
+    std::vector<float> logits(n_vocab);
+
+    for (int i = 0; i < n_texts; ++i) {
+        llama_sampler_set_grammar(sampler, &grammar);
+
+        std::string text;
+        for (int j = 0; j < n_predict; ++j) {
+            for (int k = 0; k < n_vocab; ++k) {
+                logits[k] = dist(rng) + bias[k];
+            }
+
+            const int state = sampler.grammar_state;
+
+            const gpt_vocab::id id = llama_sampler_run(sampler, logits.data(), rng);
+            llama_sampler_accept(sampler, id);
+            llama_sampler_advance(sampler, id);
+
+            result.steps.push_back({ state, id });
+            result.n_tokens++;
+
+            if (sampler.grammar_state < 0) {
+                fprintf(stderr, "%s: sampled token %d '%s', which the grammar does not allow after '%s'\n", __func__,
+                        id, vocab.text(id).str().c_str(), text.c_str());
+                return false;
+            }
+
+            if (id == LLAMA_TOKEN_EOS) {
+                if (!grammar.accepting[state]) {
+                    fprintf(stderr, "%s: sampled EOS where the text cannot end, after '%s'\n", __func__, text.c_str());
+                    return false;
+                }
+                result.n_ended++;
+                result.texts.push_back(text);
+                break;
+            }
+
+            text += vocab.text(id).str();
+        }
+
+        result.n_texts++;
+    }
+
+    return true;
+}
+
+// the tokens that a state allows, from the DFA alone for every token of the vocab
+static void bench_mask_scan(const llama_grammar & grammar, int state, std::vector<uint64_t> & mask) {
+    const int n_vocab = grammar.vocab->size();
+
+    mask.assign(grammar.n_words, 0);
+    for (gpt_vocab::id id = 0; id < n_vocab; ++id) {
+        if (id != LLAMA_TOKEN_EOS && llama_grammar_advance(grammar, state, id) >= 0) {
+            mask[id >> 6] |= 1ull << (id & 63);
+        }
+    }
+
+    bool any = false;
+    for (auto w : mask) {
+        any = any || w != 0;
+    }
+    if (grammar.accepting[state] || !any) {
+        mask[LLAMA_TOKEN_EOS >> 6] |= 1ull << (LLAMA_TOKEN_EOS & 63);
+    }
+}
+
+// random edits of the texts: a byte of another text inserted, a byte dropped or replaced
+static std::string bench_mutate(std::mt19937 & rng, const std::vector<std::string> & texts) {
+    std::string text = texts[rng() % texts.size()];
+    const std::string & other = texts[rng() % texts.size()];
+
+    const int n_edits = 1 + rng() % 3;
+    for (int i = 0; i < n_edits; ++i) {
+        const size_t pos = text.empty() ? 0 : rng() % (text.size() + 1);
+        const char c = other.empty() ? ' ' : other[rng() % other.size()];
+        switch (rng() % 3) {
+            case 0: text.insert(text.begin() + pos, c); break;
+            case 1: if (pos < text.size()) text.erase(pos, 1); break;
+            case 2: if (pos < text.size()) text[pos] = c; break;
+        }
+    }
+
+    return text;
+}
+
+// usage:
+//  ./bench-grammar models/7B/ggml-model-q4_0.bin [max_depth]
+//
+// compiles the grammar of JSON nested up to max_depth deep (8 by default) and a few regexes for the vocab of the
+// model file, and samples short texts from each with the grammar stage in front of the sampler, on random logits -
+// every text that ends is checked to be valid JSON or to match its regex. then reports, for the states the sampler
+// went through:
+//
+//   - mask:  the time to compute the tokens a state allows through the trie, the first time the state is reached,
+//            against that of running the DFA over every token of the vocab, which must give the same tokens
+//   - stage: the time of the grammar stage with the tokens cached, which masks the logits of the vocab
+//   - step:  the time to move the DFA past a sampled token
+//
+// and checks the DFAs against the JSON parser and std::regex on random edits of the texts
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin [max_depth]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+    const int max_depth = argc > 2 ? atoi(argv[2]) : LLAMA_GRAMMAR_JSON_DEPTH;
+
+    gpt_vocab vocab;
+
+    {
+        auto fin = std::ifstream(fname, std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        llama_hparams hparams;
+        bool single_file = false;
+
+        std::string error;
+        if (!llama_read_header(fin, fname, hparams, single_file, &vocab, error)) {
+            fprintf(stderr, "%s: %s\n", __func__, error.c_str());
+            return 1;
+        }
+
+        printf("%s: vocab size = %d, trie nodes = %zu\n", __func__, vocab.size(), vocab.trie.nodes.size());
+    }
+
+    if (vocab.size() <= LLAMA_TOKEN_EOS) {
+        fprintf(stderr, "%s: the vocab has no EOS token\n", __func__);
+        return 1;
+    }
+
+    std::mt19937 rng(0);
+
+    const int n_texts   = 100;
+    const int n_predict = 128;
+
+    std::vector<std::string> names = { "json" };
+    for (const char * regex : bench_regexes) {
+        names.push_back(regex);
+    }
+
+    for (size_t g = 0; g < names.size(); ++g) {
+        const bool json = g == 0;
+
+        llama_grammar grammar;
+
+        const int64_t t_start_us = ggml_time_us();
+
+        std::string error;
+        const bool ok = json ? llama_grammar_json(grammar, vocab, max_depth, error)
+                             : llama_grammar_regex(grammar, vocab, names[g], error);
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", __func__, error.c_str());
+            return 1;
+        }
+
+        const int64_t t_compile_us = ggml_time_us() - t_start_us;
+
+        if (json) {
+            printf("\n%s: grammar json, %d deep\n", __func__, max_depth);
+        } else {
+            printf("\n%s: grammar %s\n", __func__, names[g].c_str());
+        }
+        printf("%s:   %6d states, %3d byte classes, compiled in %8.2f ms\n", __func__, grammar.n_states, grammar.n_classes, t_compile_us/1000.0);
+
+        bench_result result;
+        if (!bench_generate(grammar, vocab, n_texts, n_predict, rng, result)) {
+            return 1;
+        }
+
+        for (const auto & text : result.texts) {
+            const bool valid = json ? bench_json::valid(text, max_depth) : std::regex_match(text, std::regex(names[g]));
+            if (!valid) {
+                fprintf(stderr, "%s: the generation '%s' does not follow the grammar\n", __func__, text.c_str());
+                return 1;
+            }
+        }
+
+        // the longest of the texts that fit on a line, as an example
+        std::string example;
+        for (const auto & text : result.texts) {
+            if (text.size() > example.size() && text.size() <= 80 && text.find('\n') == std::string::npos) {
+                example = text;
+            }
+        }
+
+        printf("%s:   %d of %d texts ended within %d tokens, %d tokens in all, the ended texts all %s, e.g. %s\n", __func__,
+                result.n_ended, result.n_texts, n_predict, result.n_tokens, json ? "parse" : "match", example.c_str());
+
+        // the distinct states, with the tokens computed afresh in a copy of the grammar
+        std::vector<int> states;
+        for (const auto & step : result.steps) {
+            states.push_back(step.first);
+        }
+        std::sort(states.begin(), states.end());
+        states.erase(std::unique(states.begin(), states.end()), states.end());
+
+        double t_trie_us = 0.0;
+        double t_scan_us = 0.0;
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            llama_grammar cold = grammar;
+            cold.mask_index.assign(cold.n_states, -1);
+            cold.masks.clear();
+            for (int state : states) {
+                llama_grammar_mask(cold, state);
+            }
+
+            t_trie_us = (double) (ggml_time_us() - t_start_us)/states.size();
+        }
+        {
+            std::vector<uint64_t> mask;
+
+            const int64_t t_start_us = ggml_time_us();
+
+            for (int state : states) {
+                bench_mask_scan(grammar, state, mask);
+                if (memcmp(mask.data(), llama_grammar_mask(grammar, state), grammar.n_words*sizeof(uint64_t)) != 0) {
+                    fprintf(stderr, "%s: the trie and the scan of the vocab disagree on the tokens of state %d\n", __func__, state);
+                    return 1;
+                }
+            }
+
+            t_scan_us = (double) (ggml_time_us() - t_start_us)/states.size();
+        }
+
+        printf("%s:   mask:  %5zu states, trie %8.3f ms/state, scan of the vocab %8.3f ms/state, %6.1fx\n", __func__,
+                states.size(), t_trie_us/1000.0, t_scan_us/1000.0, t_scan_us/t_trie_us);
+
+        // the grammar stage over the states of the first hundred tokens of the generations, so that a run stays short
+        {
+            std::vector<float> logits(vocab.size(), 0.0f);
+
+            llama_sampler sampler;
+            llama_sampler_init(sampler, vocab.size(), 0);
+
+            const int n_runs = std::min<int>(100, result.steps.size());
+
+            const double t_stage_us = bench_time_us([&]() {
+                for (int i = 0; i < n_runs; ++i) {
+                    llama_sample_begin(sampler, logits.data());
+                    llama_sample_grammar(sampler, grammar, result.steps[i].first);
+                }
+            })/n_runs;
+
+            // the copy of the logits into the candidates, which every sampled token pays for anyway
+            const double t_begin_us = bench_time_us([&]() {
+                for (int i = 0; i < n_runs; ++i) {
+                    llama_sample_begin(sampler, logits.data());
+                }
+            })/n_runs;
+
+            // the steps are too short to time alone: all of them, a few times over
+            volatile int sink = 0;
+            const double t_step_us = bench_time_us([&]() {
+                for (int k = 0; k < 10; ++k) {
+                    for (const auto & step : result.steps) {
+                        sink = llama_grammar_advance(grammar, step.first, step.second);
+                    }
+                }
+            })/(10*result.steps.size());
+
+            printf("%s:   stage: %8.3f us/token (+ %.3f us to set up the candidates), step: %8.3f us/token\n", __func__,
+                    t_stage_us - t_begin_us, t_begin_us, t_step_us);
+        }
+
+        if (json) {
+            for (const auto & test : bench_json_utf8) {
+                const std::string text = test.text;
+                if (bench_json::valid(text, max_depth) != test.valid || bench_matches(grammar, text) != test.valid) {
+                    fprintf(stderr, "%s: the parser or the grammar %s the UTF-8 of '%s'\n", __func__, test.valid ? "rejects" : "accepts", text.c_str());
+                    return 1;
+                }
+            }
+
+            printf("%s:   the grammar and the parser agree on %zu strings at the edges of UTF-8\n", __func__, sizeof(bench_json_utf8)/sizeof(bench_json_utf8[0]));
+        }
+
+        // random edits of the texts, where the edge cases are dense
+        if (!result.texts.empty()) {
+            const int n_edits = 20000;
+
+            std::regex re(json ? "" : names[g]);
+
+            for (int i = 0; i < n_edits; ++i) {
+                const std::string text = bench_mutate(rng, result.texts);
+
+                const bool expected = json ? bench_json::valid(text, max_depth) : std::regex_match(text, re);
+                if (bench_matches(grammar, text) != expected) {
+                    fprintf(stderr, "%s: the grammar %s '%s', the %s does not\n", __func__, expected ? "rejects" : "matches", text.c_str(), json ? "parser" : "regex");
+                    return 1;
+                }
+            }
+
+            printf("%s:   the grammar and the %s agree on %d random edits of the texts\n", __func__, json ? "parser" : "regex", n_edits);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,292 @@
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined (__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// LLaMA 7B dimensions
+static const int n_vocab = 32000;
+static const int n_embd  = 4096;
+static const int n_ff    = 11008;
+
+struct bench_layer {
+    struct ggml_tensor * wq;
+    struct ggml_tensor * wk;
+    struct ggml_tensor * wv;
+    struct ggml_tensor * wo;
+
+    struct ggml_tensor * w1;
+    struct ggml_tensor * w2;
+    struct ggml_tensor * w3;
+};
+
+// counts the data TLB misses of this thread and of the threads it creates while counting, where supported
+struct bench_tlb_counter {
+    int fd = -1;
+
+    bench_tlb_counter() {
+#if defined (__linux__)
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        attr.size     = sizeof(attr);
+        attr.type     = PERF_TYPE_HW_CACHE;
+        attr.config   = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.inherit  = 1; // ggml_graph_compute() starts its worker threads on every call
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~bench_tlb_counter() {
+#if defined (__linux__)
+        if (fd != -1) {
+            close(fd);
+        }
+#endif
+    }
+
+    bool available() const {
+        return fd != -1;
+    }
+
+    void start() {
+#if defined (__linux__)
+        if (fd != -1) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    uint64_t stop() {
+        uint64_t count = 0;
+#if defined (__linux__)
+        if (fd != -1) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+};
+
+// anonymous memory of this process that is backed by transparent huge pages, in bytes, or 0 if unknown
+static size_t bench_anon_huge_pages() {
+    std::ifstream fin("/proc/self/smaps_rollup");
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        size_t kb = 0;
+        if (sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb) == 1) {
+            return kb*1024;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_fill(struct ggml_tensor * tensor, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-0.02f, 0.02f);
+
+    ggml_fp16_t * data = (ggml_fp16_t *) tensor->data;
+    for (int i = 0; i < ggml_nelements(tensor); ++i) {
+        data[i] = ggml_fp32_to_fp16(dist(rng));
+    }
+}
+
+// one run of the benchmark: the weights of n_layer decoder layers and a compute buffer are allocated with or
+// without huge pages, then n_tokens random tokens are looked up in the embeddings and sent through the layers
+static bool bench_run(bool use_huge_pages, int n_layer, int n_threads, int n_tokens) {
+    const size_t thp_before = bench_anon_huge_pages();
+
+    llama_buffer buf_weights;
+    llama_buffer buf_compute;
+
+    // weights
+    size_t weights_size = 0;
+    {
+        const int ne_emb[2] = { n_embd, n_vocab };
+        const int ne_att[2] = { n_embd, n_embd  };
+        const int ne_up [2] = { n_embd, n_ff    };
+        const int ne_dn [2] = { n_ff,   n_embd  };
+
+        weights_size += ggml_tensor_mem_size(GGML_TYPE_F16, 2, ne_emb);
+        weights_size += n_layer*4*ggml_tensor_mem_size(GGML_TYPE_F16, 2, ne_att);
+        weights_size += n_layer*2*ggml_tensor_mem_size(GGML_TYPE_F16, 2, ne_up);
+        weights_size += n_layer*1*ggml_tensor_mem_size(GGML_TYPE_F16, 2, ne_dn);
+    }
+
+    if (!llama_buffer_alloc(buf_weights, weights_size, use_huge_pages)) {
+        fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, weights_size);
+        return false;
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf_weights.size,
+        /*.mem_buffer =*/ buf_weights.data,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(0);
+
+    struct ggml_tensor * tok_embeddings = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_vocab);
+    bench_fill(tok_embeddings, rng);
+
+    std::vector<bench_layer> layers(n_layer);
+    for (auto & layer : layers) {
+        layer.wq = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_embd);
+        layer.wk = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_embd);
+        layer.wv = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_embd);
+        layer.wo = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_embd);
+        layer.w1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_ff);
+        layer.w2 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_ff,   n_embd);
+        layer.w3 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_embd, n_ff);
+
+        for (auto tensor : { layer.wq, layer.wk, layer.wv, layer.wo, layer.w1, layer.w2, layer.w3 }) {
+            bench_fill(tensor, rng);
+        }
+    }
+
+    // compute buffer, far larger than one token needs
+    const size_t compute_size = 64u*1024*1024;
+
+    if (!llama_buffer_alloc(buf_compute, compute_size, use_huge_pages)) {
+        fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, compute_size);
+        ggml_free(ctx);
+        return false;
+    }
+
+    const size_t thp_after = bench_anon_huge_pages();
+    const size_t thp_size  = thp_after > thp_before ? thp_after - thp_before : 0;
+
+    // evaluate a single token
+    auto eval = [&](int token) {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ buf_compute.size,
+            /*.mem_buffer =*/ buf_compute.data,
+        };
+
+        struct ggml_context * ctx0 = ggml_init(params);
+        ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
+
+        struct ggml_tensor * embd = ggml_new_i32(ctx0, token);
+
+        struct ggml_tensor * inpL = ggml_get_rows(ctx0, tok_embeddings, embd);
+
+        for (const auto & layer : layers) {
+            struct ggml_tensor * cur = ggml_norm(ctx0, inpL);
+
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, layer.wq, cur);
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, layer.wk, cur);
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, layer.wv, cur);
+
+            // stands in for the attention, which does not touch the weights
+            cur = ggml_add(ctx0, ggml_add(ctx0, Qcur, Kcur), Vcur);
+            cur = ggml_mul_mat(ctx0, layer.wo, cur);
+
+            struct ggml_tensor * inpFF = ggml_add(ctx0, cur, inpL);
+
+            cur = ggml_norm(ctx0, inpFF);
+
+            struct ggml_tensor * tmp = ggml_mul_mat(ctx0, layer.w3, cur);
+
+            cur = ggml_mul_mat(ctx0, layer.w1, cur);
+            cur = ggml_silu(ctx0, cur);
+            cur = ggml_mul(ctx0, cur, tmp);
+            cur = ggml_mul_mat(ctx0, layer.w2, cur);
+
+            inpL = ggml_add(ctx0, cur, inpFF);
+        }
+
+        ggml_build_forward_expand(&gf, inpL);
+        ggml_graph_compute       (ctx0, &gf);
+
+        ggml_free(ctx0);
+    };
+
+    std::uniform_int_distribution<int> dist_token(0, n_vocab - 1);
+
+    // warm up
+    eval(dist_token(rng));
+
+    bench_tlb_counter tlb;
+
+    tlb.start();
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; i < n_tokens; ++i) {
+        eval(dist_token(rng));
+    }
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+    const uint64_t tlb_misses = tlb.stop();
+
+    printf("%s: %-22s: weights = %8.2f MB, %4d tokens in %8.2f ms, %7.2f tokens/s, ",
+            __func__, llama_buffer_type_name(buf_weights.type), buf_weights.size/1024.0/1024.0, n_tokens, t_us/1000.0, 1e6*n_tokens/t_us);
+
+    if (tlb.available()) {
+        printf("dTLB misses = %10.0f per token", (double) tlb_misses/n_tokens);
+    } else {
+        printf("dTLB misses = n/a");
+    }
+
+    if (buf_weights.type == LLAMA_BUFFER_THP) {
+        printf(", %8.2f MB in transparent huge pages", thp_size/1024.0/1024.0);
+    }
+
+    printf("\n");
+
+    ggml_free(ctx);
+
+    return true;
+}
+
+// usage:
+//  ./bench-hugepages [n_layer] [n_threads] [n_tokens]
+//
+// runs the weight-bound part of the LLaMA 7B forward pass on random F16 weights of n_layer layers, first with the
+// weights and the compute buffer in regular pages and then in 2 MB pages, and reports the throughput together
+// with the data TLB misses (Linux only, from the hardware counters)
+//
+// explicit huge pages must be reserved beforehand, e.g. with 'sysctl vm.nr_hugepages=1024' for 2 GB; without
+// them transparent huge pages are used if enabled in /sys/kernel/mm/transparent_hugepage/enabled
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    const int n_layer   = argc > 1 ? atoi(argv[1]) : 4;
+    const int n_threads = argc > 2 ? atoi(argv[2]) : std::max(1, std::min(8, (int) std::thread::hardware_concurrency()));
+    const int n_tokens  = argc > 3 ? atoi(argv[3]) : 32;
+
+    printf("%s: n_layer = %d, n_threads = %d, n_tokens = %d\n", __func__, n_layer, n_threads, n_tokens);
+
+    for (bool use_huge_pages : { false, true }) {
+        if (!bench_run(use_huge_pages, n_layer, n_threads, n_tokens)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
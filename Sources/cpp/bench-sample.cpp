@@ -0,0 +1,276 @@
+#include "ggml.h"
+
+#include "bench.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int bench_repeat_last_n[] = { 16, 64, 256, 1024, 4096 };
+
+// heap allocations made through operator new, to check that llama_sampler_sample() makes none
+static size_t bench_n_allocs = 0;
+
+void * operator new(size_t size) {
+    bench_n_allocs++;
+    if (void * ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+// the scaled and penalized logits as llama_sample_top_p_top_k() computed them before llama_apply_repeat_penalty():
+// last_n_tokens is searched for every id of the vocab
+static void bench_penalize_search(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, const std::vector<float> & logits, const std::vector<gpt_vocab::id> & last_n_tokens, double repeat_penalty, double temp) {
+    const int n_logits = logits.size();
+
+    logits_id.clear();
+
+    const double scale = 1.0/temp;
+    for (int i = 0; i < n_logits; ++i) {
+        if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
+            if (logits[i] < 0.0) {
+                logits_id.push_back(std::make_pair(logits[i]*scale*repeat_penalty, i));
+            } else {
+                logits_id.push_back(std::make_pair(logits[i]*scale/repeat_penalty, i));
+            }
+        } else {
+            logits_id.push_back(std::make_pair(logits[i]*scale, i));
+        }
+    }
+}
+
+// the same with llama_apply_repeat_penalty()
+static void bench_penalize(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, const std::vector<float> & logits, const std::vector<gpt_vocab::id> & last_n_tokens, double repeat_penalty, double temp) {
+    const int n_logits = logits.size();
+
+    logits_id.clear();
+
+    const double scale = 1.0/temp;
+    for (int i = 0; i < n_logits; ++i) {
+        logits_id.push_back(std::make_pair(logits[i]*scale, i));
+    }
+
+    llama_apply_repeat_penalty(logits_id, last_n_tokens, repeat_penalty);
+}
+
+// usage:
+//  ./bench-sample [n_vocab]
+//
+// applies the repetition penalty to the logits of a vocab of n_vocab tokens (32000 by default) for recent-token
+// windows of 16 to 4096 tokens, with llama_apply_repeat_penalty() and with the search of the window for every id that
+// it replaced, checks that both give the same logits and reports the time per sampled token of each - together with
+// that of the whole of llama_sample_top_p_top_k() and of llama_sampler_sample(), which is checked to allocate nothing
+// and to draw the tokens with the same frequencies - then times pipelines of the other stages of the sampler
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    const int n_vocab = argc > 1 ? atoi(argv[1]) : 32000;
+    if (n_vocab <= 0) {
+        fprintf(stderr, "usage: %s [n_vocab]\n", argv[0]);
+        return 1;
+    }
+
+    // the sampler only needs the size of the vocab
+    gpt_vocab vocab;
+    for (int i = 0; i < n_vocab; ++i) {
+        gpt_vocab_add(vocab, "", 0);
+    }
+
+    std::mt19937 rng(0);
+
+    std::vector<float> logits(n_vocab);
+    {
+        std::normal_distribution<float> dist(0.0f, 4.0f);
+        for (auto & l : logits) {
+            l = dist(rng);
+        }
+    }
+
+    const double repeat_penalty = 1.30;
+    const double temp           = 0.80;
+
+    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
+    std::vector<std::pair<double, gpt_vocab::id>> expected;
+    logits_id.reserve(n_vocab);
+    expected.reserve(n_vocab);
+
+    printf("%s: n_vocab = %d, repeat_penalty = %.2f, temp = %.2f\n", __func__, n_vocab, repeat_penalty, temp);
+
+    for (int repeat_last_n : bench_repeat_last_n) {
+        // a window of recent tokens, a quarter of which repeat an earlier one as text does
+        std::vector<gpt_vocab::id> last_n_tokens;
+        for (int i = 0; i < repeat_last_n; ++i) {
+            if (i > 0 && rng() % 4 == 0) {
+                last_n_tokens.push_back(last_n_tokens[rng() % i]);
+            } else {
+                last_n_tokens.push_back(rng() % n_vocab);
+            }
+        }
+
+        const double t_search_us = bench_time_us([&]() {
+            bench_penalize_search(expected, logits, last_n_tokens, repeat_penalty, temp);
+        });
+
+        const double t_penalize_us = bench_time_us([&]() {
+            bench_penalize(logits_id, logits, last_n_tokens, repeat_penalty, temp);
+        });
+
+        if (logits_id != expected) {
+            fprintf(stderr, "%s: the penalized logits differ for repeat_last_n = %d\n", __func__, repeat_last_n);
+            return 1;
+        }
+
+        std::mt19937 rng_sample(0);
+
+        const double t_sample_us = bench_time_us([&]() {
+            llama_sample_top_p_top_k(vocab, logits.data(), last_n_tokens, repeat_penalty, 40, 0.95, temp, rng_sample);
+        });
+
+        // the sampler object, with the same recent tokens
+        llama_sampler sampler;
+        llama_sampler_init(sampler, n_vocab, repeat_last_n);
+        for (auto id : last_n_tokens) {
+            llama_sampler_accept(sampler, id);
+        }
+
+        size_t n_allocs = 0;
+        int n_samples = 0;
+
+        const double t_sampler_us = bench_time_us([&]() {
+            const size_t n_allocs_start = bench_n_allocs;
+            const gpt_vocab::id id = llama_sampler_sample(sampler, logits.data(), repeat_penalty, 40, 0.95f, temp, rng_sample);
+            llama_sampler_accept(sampler, last_n_tokens[n_samples++ % repeat_last_n]);
+            n_allocs += bench_n_allocs - n_allocs_start;
+            (void) id;
+        });
+
+        printf("%s: repeat_last_n = %4d: search %10.3f ms, penalty %8.3f ms, %8.1fx - sample %8.3f ms/token, sampler %8.3f ms/token, %zu allocations\n", __func__,
+                repeat_last_n, t_search_us/1000.0, t_penalize_us/1000.0, t_search_us/t_penalize_us, t_sample_us/1000.0, t_sampler_us/1000.0, n_allocs);
+
+        if (n_allocs != 0) {
+            fprintf(stderr, "%s: llama_sampler_sample() allocated\n", __func__);
+            return 1;
+        }
+    }
+
+    // both samplers draw the tokens of softer logits with the same frequencies, with the best ones penalized
+    {
+        const int n_draws = 200000;
+        const int top_k   = 40;
+
+        std::vector<float> soft(n_vocab);
+        for (int i = 0; i < n_vocab; ++i) {
+            soft[i] = 0.25f*logits[i];
+        }
+
+        std::vector<gpt_vocab::id> last_n_tokens(n_vocab);
+        for (int i = 0; i < n_vocab; ++i) {
+            last_n_tokens[i] = i;
+        }
+        std::partial_sort(last_n_tokens.begin(), last_n_tokens.begin() + 3, last_n_tokens.end(), [&](gpt_vocab::id a, gpt_vocab::id b) {
+            return soft[a] > soft[b];
+        });
+        last_n_tokens.resize(3);
+
+        llama_sampler sampler;
+        llama_sampler_init(sampler, n_vocab, last_n_tokens.size());
+        for (auto id : last_n_tokens) {
+            llama_sampler_accept(sampler, id);
+        }
+
+        std::vector<int> counts(n_vocab), counts_sampler(n_vocab);
+
+        std::mt19937 rng_sample(1);
+        for (int i = 0; i < n_draws; ++i) {
+            counts[llama_sample_top_p_top_k(vocab, soft.data(), last_n_tokens, repeat_penalty, top_k, 0.90, temp, rng_sample)]++;
+            counts_sampler[llama_sampler_sample(sampler, soft.data(), repeat_penalty, top_k, 0.90f, temp, rng_sample)]++;
+        }
+
+        double tv = 0.0;
+        for (int i = 0; i < n_vocab; ++i) {
+            tv += fabs(counts[i] - counts_sampler[i])/(2.0*n_draws);
+        }
+
+        printf("%s: %d draws: total variation distance between the samplers = %.4f\n", __func__, n_draws, tv);
+
+        if (tv > 0.02) {
+            fprintf(stderr, "%s: the samplers draw different tokens\n", __func__);
+            return 1;
+        }
+    }
+
+    // pipelines of the stages, with a window of 64 recent tokens
+    {
+        gpt_params params;
+
+        struct pipeline {
+            const char * name;
+            std::vector<llama_sampler_stage> stages;
+        };
+
+        std::vector<pipeline> pipelines = {
+            { "default",                         llama_sampler_stages(params) },
+            { "greedy",                          { { LLAMA_SAMPLER_REPETITION_PENALTY, 1.30f }, { LLAMA_SAMPLER_GREEDY } } },
+            { "penalties + top-k",               { { LLAMA_SAMPLER_REPETITION_PENALTY, 1.30f }, { LLAMA_SAMPLER_FREQUENCY_PENALTY, 0.5f, 0.5f },
+                                                   { LLAMA_SAMPLER_TEMPERATURE, 0.80f }, { LLAMA_SAMPLER_TOP_K, 0.0f, 0.0f, 40 } } },
+            { "top-k + tail free + typical",     { { LLAMA_SAMPLER_TEMPERATURE, 0.80f }, { LLAMA_SAMPLER_TOP_K, 0.0f, 0.0f, 40 },
+                                                   { LLAMA_SAMPLER_TAIL_FREE, 0.95f }, { LLAMA_SAMPLER_TYPICAL, 0.90f } } },
+            { "top-p (whole vocab)",             { { LLAMA_SAMPLER_TEMPERATURE, 0.80f }, { LLAMA_SAMPLER_TOP_P, 0.95f } } },
+            { "mirostat",                        { { LLAMA_SAMPLER_TEMPERATURE, 0.80f }, { LLAMA_SAMPLER_MIROSTAT, 5.0f, 0.1f, 100 } } },
+            { "mirostat 2.0",                    { { LLAMA_SAMPLER_TEMPERATURE, 0.80f }, { LLAMA_SAMPLER_MIROSTAT_V2, 5.0f, 0.1f } } },
+        };
+
+        const int repeat_last_n = 64;
+
+        std::vector<gpt_vocab::id> last_n_tokens;
+        for (int i = 0; i < repeat_last_n; ++i) {
+            last_n_tokens.push_back(rng() % n_vocab);
+        }
+
+        for (const auto & p : pipelines) {
+            llama_sampler sampler;
+            llama_sampler_init(sampler, n_vocab, repeat_last_n);
+            llama_sampler_set_stages(sampler, p.stages);
+            for (auto id : last_n_tokens) {
+                llama_sampler_accept(sampler, id);
+            }
+
+            std::mt19937 rng_sample(0);
+
+            size_t n_allocs = 0;
+            gpt_vocab::id id = 0;
+
+            const double t_us = bench_time_us([&]() {
+                const size_t n_allocs_start = bench_n_allocs;
+                id = llama_sampler_run(sampler, logits.data(), rng_sample);
+                llama_sampler_accept(sampler, id);
+                n_allocs += bench_n_allocs - n_allocs_start;
+            });
+
+            printf("%s: pipeline %-28s %8.3f ms/token, %zu allocations", __func__, p.name, t_us/1000.0, n_allocs);
+            if (p.stages.back().type == LLAMA_SAMPLER_MIROSTAT || p.stages.back().type == LLAMA_SAMPLER_MIROSTAT_V2) {
+                printf(", mu = %.2f", sampler.mirostat_mu);
+            }
+            printf("\n");
+
+            if (n_allocs != 0) {
+                fprintf(stderr, "%s: the pipeline %s allocated\n", __func__, p.name);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
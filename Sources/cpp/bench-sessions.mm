@@ -0,0 +1,139 @@
+#import <Foundation/Foundation.h>
+
+#import "LlamaModel.hh"
+
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// generate n_tokens greedily in a session, starting from a short prompt
+static bool bench_session(const llama_model & model, llama_session & session, int n_tokens) {
+    NSError *error = nil;
+
+    std::vector<gpt_vocab::id> embd = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    for (int i = 0; i < n_tokens; ++i) {
+        if (!llama_eval(model, session, embd, &error)) {
+            fprintf(stderr, "%s: %s\n", __func__, error.localizedDescription.UTF8String);
+            return false;
+        }
+
+        const float * logits = session.logits.row(session.logits.n_rows - 1);
+
+        embd = { (gpt_vocab::id) (std::max_element(logits, logits + session.logits.n_vocab) - logits) };
+    }
+
+    return true;
+}
+
+// usage:
+//  ./bench-sessions models/7B/ggml-model-q4_0.bin [n_threads] [n_tokens]
+//
+// runs 1, 2, 4 and 8 sessions concurrently against one loaded model, each session on its own thread, and
+// reports the memory held by the weights and by the sessions together with the generation throughput
+//
+int main(int argc, char ** argv) {
+    @autoreleasepool {
+        ggml_time_init();
+
+        if (argc < 2) {
+            fprintf(stderr, "usage: %s model.bin [n_threads] [n_tokens]\n", argv[0]);
+            return 1;
+        }
+
+        const std::string fname = argv[1];
+
+        const int n_threads = argc > 2 ? atoi(argv[2]) : std::max(1, (int) std::thread::hardware_concurrency());
+        const int n_tokens  = argc > 3 ? atoi(argv[3]) : 32;
+
+        // what the scheduler would admit the job with, computed before anything is loaded
+        {
+            llama_memory_footprint footprint;
+
+            NSError *error = nil;
+            if (!llama_model_footprint(fname, 512, 8, n_threads, true, 0, footprint, &error)) {
+                fprintf(stderr, "%s: failed to read model header from '%s': %s\n", __func__, fname.c_str(), error.localizedDescription.UTF8String);
+                return 1;
+            }
+
+            printf("%s: footprint: weights = %8.2f MB, mapped = %8.2f MB, kv = %8.2f MB, compute = %8.2f MB per session\n", __func__,
+                    footprint.weights/1024.0/1024.0, footprint.mapped/1024.0/1024.0, footprint.kv/1024.0/1024.0, footprint.compute/1024.0/1024.0);
+        }
+
+        llama_model model;
+        gpt_vocab vocab;
+
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            NSError *error = nil;
+            if (!llama_model_load(fname, model, vocab, true, false, LLAMA_NUMA_NONE, 0, n_threads, nullptr, &error)) {
+                fprintf(stderr, "%s: failed to load model from '%s': %s\n", __func__, fname.c_str(), error.localizedDescription.UTF8String);
+                return 1;
+            }
+
+            printf("%s: loaded '%s' in %8.2f ms\n", __func__, fname.c_str(), (ggml_time_us() - t_start_us)/1000.0f);
+        }
+
+        size_t weights_size = 0;
+        for (const auto & kv : model.tensors) {
+            weights_size += ggml_nbytes(kv.second);
+        }
+
+        for (int n_sessions : { 1, 2, 4, 8 }) {
+            // the threads are divided between the sessions
+            const int n_session_threads = std::max(1, n_threads/n_sessions);
+
+            std::vector<std::unique_ptr<llama_session>> sessions;
+            for (int i = 0; i < n_sessions; ++i) {
+                sessions.emplace_back(new llama_session());
+
+                NSError *error = nil;
+                if (!llama_session_init(*sessions.back(), model, 512, 8, n_session_threads, false, 64, i, &error)) {
+                    fprintf(stderr, "%s: failed to create session: %s\n", __func__, error.localizedDescription.UTF8String);
+                    return 1;
+                }
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+
+            std::vector<std::thread> workers;
+            std::vector<char> ok(n_sessions, 0);
+            for (int i = 0; i < n_sessions; ++i) {
+                workers.emplace_back([&, i]() {
+                    ok[i] = bench_session(model, *sessions[i], n_tokens);
+                });
+            }
+            for (auto & w : workers) {
+                w.join();
+            }
+
+            const int64_t t_us = ggml_time_us() - t_start_us;
+
+            if (std::count(ok.begin(), ok.end(), 0) > 0) {
+                return 1;
+            }
+
+            size_t sessions_size = 0;
+            for (const auto & session : sessions) {
+                sessions_size += llama_session_memory_size(*session);
+            }
+
+            printf("%s: %d sessions x %2d threads: weights = %8.2f MB, sessions = %8.2f MB (%8.2f MB each), total = %8.2f MB, %7.2f tokens/s\n",
+                    __func__, n_sessions, n_session_threads,
+                    weights_size/1024.0/1024.0, sessions_size/1024.0/1024.0, sessions_size/1024.0/1024.0/n_sessions,
+                    (weights_size + sessions_size)/1024.0/1024.0, 1e6*n_sessions*n_tokens/t_us);
+        }
+
+        llama_model_free(model);
+    }
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include "ggml.h"
+
+#include "bench.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// the spread of the logits of the draft model around those of the model
+static const float bench_noise[] = { 0.0f, 0.5f, 1.0f, 2.0f, 4.0f };
+
+static std::vector<float> bench_logits(std::mt19937 & rng, int n_vocab, float sigma) {
+    std::normal_distribution<float> dist(0.0f, sigma);
+
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) {
+        l = dist(rng);
+    }
+
+    return logits;
+}
+
+// the logits of a draft model: those of the model with noise of the given spread
+static std::vector<float> bench_draft_logits(std::mt19937 & rng, const std::vector<float> & logits, float noise) {
+    std::vector<float> draft = bench_logits(rng, logits.size(), noise);
+    for (size_t i = 0; i < logits.size(); ++i) {
+        draft[i] += logits[i];
+    }
+
+    return draft;
+}
+
+// usage:
+//  ./bench-speculative [n_vocab]
+//
+// draws tokens by speculative sampling - a token drawn from the logits of a draft model, checked against the logits of
+// the model with llama_sampler_verify() - for draft logits of increasing distance from those of the model, with the
+// default stages and with the greedy one, and checks that the tokens are distributed as llama_sampler_probs() gives
+// them for the model; reports the acceptance rate, the tokens per round that it gives with 4 proposals a round, and
+// the time that drafting and checking a token take on a vocab of n_vocab tokens (32000 by default)
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    const int n_vocab = argc > 1 ? atoi(argv[1]) : 32000;
+    if (n_vocab <= 0) {
+        fprintf(stderr, "usage: %s [n_vocab]\n", argv[0]);
+        return 1;
+    }
+
+    std::mt19937 rng(0);
+
+    gpt_params params;
+
+    struct pipeline {
+        const char * name;
+        std::vector<llama_sampler_stage> stages;
+    };
+
+    gpt_params params_greedy;
+    params_greedy.temp = 0.0f;
+
+    const std::vector<pipeline> pipelines = {
+        { "default", llama_sampler_stages(params) },
+        { "greedy",  llama_sampler_stages(params_greedy) },
+    };
+
+    const int repeat_last_n = 64;
+    const int n_draft       = 4;
+
+    // the distributions are checked on a vocab small enough for the draws to be quick, with logits soft enough for
+    // many candidates to be drawn
+    const int n_vocab_check = std::min(n_vocab, 1000);
+    const int n_draws       = 100000;
+
+    printf("%s: n_vocab = %d, %d draws on a vocab of %d tokens\n", __func__, n_vocab, n_draws, n_vocab_check);
+
+    for (const auto & p : pipelines) {
+        for (float noise : bench_noise) {
+            const std::vector<float> logits = bench_logits(rng, n_vocab_check, 1.0f);
+            const std::vector<float> draft_logits = bench_draft_logits(rng, logits, noise);
+
+            llama_sampler sampler;
+            llama_sampler_init(sampler, n_vocab_check, repeat_last_n);
+            llama_sampler_set_stages(sampler, p.stages);
+            for (int i = 0; i < repeat_last_n; ++i) {
+                llama_sampler_accept(sampler, rng() % n_vocab_check);
+            }
+
+            llama_sampler draft_sampler;
+            llama_sampler_init(draft_sampler, n_vocab_check, repeat_last_n);
+            llama_sampler_set_stages(draft_sampler, p.stages);
+            llama_sampler_sync(draft_sampler, sampler);
+
+            // the distribution of the model
+            std::vector<double> expected(n_vocab_check);
+            llama_sampler_probs(sampler, logits.data());
+            for (int i = 0; i < sampler.n_candidates; ++i) {
+                expected[sampler.ids[i]] = sampler.probs[i];
+            }
+
+            std::vector<int> counts(n_vocab_check);
+            int n_accepted = 0;
+
+            llama_draft draft;
+
+            std::mt19937 rng_draft(1);
+            std::mt19937 rng_verify(2);
+            for (int i = 0; i < n_draws; ++i) {
+                llama_sampler_draft(draft_sampler, draft_logits.data(), draft, rng_draft);
+
+                bool accepted = false;
+                counts[llama_sampler_verify(sampler, logits.data(), draft, accepted, rng_verify)]++;
+                n_accepted += accepted;
+            }
+
+            double tv = 0.0;
+            for (int i = 0; i < n_vocab_check; ++i) {
+                tv += fabs((double) counts[i]/n_draws - expected[i])/2.0;
+            }
+
+            // the proposals are accepted independently of each other with probability alpha, until the first one
+            // rejected - and every round gives a token of the model besides
+            const double alpha = (double) n_accepted/n_draws;
+            const double n_tokens = alpha < 1.0 ? (1.0 - pow(alpha, n_draft + 1))/(1.0 - alpha) : n_draft + 1;
+
+            printf("%s: %-8s noise %.1f: acceptance %5.1f%%, %.2f tokens per round of %d proposals, total variation distance from the model = %.4f\n", __func__,
+                    p.name, noise, 100.0*alpha, n_tokens, n_draft, tv);
+
+            if (tv > 0.02) {
+                fprintf(stderr, "%s: the tokens of speculative sampling are not distributed as those of the model\n", __func__);
+                return 1;
+            }
+
+            if (noise == 0.0f && n_accepted != n_draws) {
+                fprintf(stderr, "%s: a draft model equal to the model had tokens rejected\n", __func__);
+                return 1;
+            }
+        }
+    }
+
+    // the time to draft and check a token, against that of sampling it
+    {
+        const std::vector<float> logits = bench_logits(rng, n_vocab, 4.0f);
+        const std::vector<float> draft_logits = bench_draft_logits(rng, logits, 1.0f);
+
+        llama_sampler sampler;
+        llama_sampler_init(sampler, n_vocab, repeat_last_n);
+        llama_sampler_set_stages(sampler, llama_sampler_stages(params));
+
+        llama_sampler draft_sampler;
+        llama_sampler_init(draft_sampler, n_vocab, repeat_last_n);
+        llama_sampler_set_stages(draft_sampler, sampler.stages);
+
+        llama_draft draft;
+
+        std::mt19937 rng_sample(0);
+
+        const double t_sample_us = bench_time_us([&]() {
+            llama_sampler_run(sampler, logits.data(), rng_sample);
+        });
+
+        const double t_draft_us = bench_time_us([&]() {
+            llama_sampler_draft(draft_sampler, draft_logits.data(), draft, rng_sample);
+        });
+
+        const double t_verify_us = bench_time_us([&]() {
+            bool accepted = false;
+            llama_sampler_verify(sampler, logits.data(), draft, accepted, rng_sample);
+        });
+
+        const double t_sync_us = bench_time_us([&]() {
+            llama_sampler_sync(draft_sampler, sampler);
+        });
+
+        printf("%s: n_vocab = %d: sample %8.3f ms, draft %8.3f ms, verify %8.3f ms, sync %8.3f ms\n", __func__,
+                n_vocab, t_sample_us/1000.0, t_draft_us/1000.0, t_verify_us/1000.0, t_sync_us/1000.0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+// the split of gpt_tokenize() before the scanner, with the regex
+static std::vector<std::string> bench_split_regex(const std::string & text) {
+    std::vector<std::string> words;
+
+    std::string str = text;
+    std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+    std::regex re(pat);
+    std::smatch m;
+
+    while (std::regex_search(str, m, re)) {
+        for (auto x : m) {
+            words.push_back(x);
+        }
+        str = m.suffix();
+    }
+
+    return words;
+}
+
+// random text made of the pieces that the alternatives of the pattern care about
+static std::string bench_random_text(std::mt19937 & rng, size_t size) {
+    static const char * pieces[] = {
+        "'s", "'t", "'re", "'ve", "'m", "'ll", "'d", "'S", "'x", "''", "'",
+        "a", "word", "Hello", "x1", "42", "3.14", "007",
+        " ", "  ", "   ", "\t", "\n", "\r\n", "\v", "\f", " \t",
+        "!", "?!", "...", "-", "(", ")", "\"", "#", "\\",
+        "\xc3\xa9", "\xe6\x97\xa5\xe6\x9c\xac", "\xf0\x9f\xa6\x99", "\xc2\xa0",
+    };
+
+    std::uniform_int_distribution<int> dist(0, sizeof(pieces)/sizeof(pieces[0]) - 1);
+
+    std::string text;
+    while (text.size() < size) {
+        text += pieces[dist(rng)];
+    }
+
+    return text;
+}
+
+// usage:
+//  ./bench-split [text.txt]
+//
+// splits inputs of 1 to 64 KB, cut from the text file or from random text, into the words of gpt_tokenize() with
+// gpt_split_words() and with the regex it replaced, checks that both give the same words and reports their
+// throughput - then checks that they agree on many short random texts
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    std::mt19937 rng(0);
+
+    std::string source;
+    if (argc > 1) {
+        auto fin = std::ifstream(argv[1], std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, argv[1]);
+            return 1;
+        }
+        source.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    }
+    if (source.empty()) {
+        source = bench_random_text(rng, 64u << 10);
+    }
+
+    std::vector<std::pair<size_t, size_t>> words;
+
+    for (size_t size : { 1u << 10, 4u << 10, 16u << 10, 64u << 10 }) {
+        std::string text;
+        while (text.size() < size) {
+            text += source;
+        }
+        text.resize(size);
+
+        // the scanner, repeated for at least 100 ms
+        int n_runs = 0;
+
+        const int64_t t_start_us = ggml_time_us();
+        int64_t t_us = 0;
+        do {
+            gpt_split_words(text, words);
+            n_runs++;
+            t_us = ggml_time_us() - t_start_us;
+        } while (t_us < 100000);
+
+        const double mbps = (double) size*n_runs/t_us;
+
+        printf("%s: %3zu KB: %6zu words, scanner %8.3f ms (%8.2f MB/s)", __func__, size >> 10, words.size(), (double) t_us/n_runs/1000.0, mbps);
+
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            const auto expected = bench_split_regex(text);
+
+            const int64_t t_us = ggml_time_us() - t_start_us;
+
+            printf(", regex %10.3f ms (%8.4f MB/s), %8.1fx\n", t_us/1000.0, (double) size/t_us, mbps*t_us/size);
+
+            bool ok = expected.size() == words.size();
+            for (size_t i = 0; ok && i < words.size(); ++i) {
+                ok = text.compare(words[i].first, words[i].second, expected[i]) == 0;
+            }
+
+            if (!ok) {
+                fprintf(stderr, "%s: the scanner and the regex disagree on %zu KB of text\n", __func__, size >> 10);
+                return 1;
+            }
+        }
+    }
+
+    // short random texts, where the edge cases are dense
+    const int n_texts = 20000;
+
+    for (int i = 0; i < n_texts; ++i) {
+        const std::string text = bench_random_text(rng, rng() % 24);
+
+        gpt_split_words(text, words);
+
+        const auto expected = bench_split_regex(text);
+
+        bool ok = expected.size() == words.size();
+        for (size_t j = 0; ok && j < words.size(); ++j) {
+            ok = text.compare(words[j].first, words[j].second, expected[j]) == 0;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s: the scanner and the regex disagree on random text %d\n", __func__, i);
+            return 1;
+        }
+    }
+
+    printf("%s: the scanner and the regex agree on %d random texts\n", __func__, n_texts);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// filler for the inputs when no text file is given
+static const char * bench_text =
+    "Building a website can be done in 10 simple steps. The first step is to decide what the website is for: a "
+    "personal blog, a shop or the homepage of a small business all need different things. Next, pick a domain name "
+    "that is short, easy to spell and easy to remember, and register it with a provider of your choice. Then choose "
+    "where to host the site - shared hosting is cheap and fine for most sites, while a virtual server gives you more "
+    "control at a higher price. Once that is done, install a content management system, or write the HTML, CSS and "
+    "JavaScript yourself if you prefer. Don't forget to test on phones and tablets as well as on desktops!\n";
+
+// the tokenization that llama_tokenize() did before the trie: at every position, the whole vocab is scanned for the
+// longest token that matches the text
+static std::vector<gpt_vocab::id> bench_tokenize_scan(const gpt_vocab & vocab, const std::string & text) {
+    std::vector<gpt_vocab::id> res;
+
+    size_t pos = 0;
+    while (true) {
+        size_t l = 0;
+        int    t = 0;
+        for (int i = 0; i < vocab.size(); ++i) {
+            const std::string token = vocab.text(i).str();
+            if (token.size() < l) continue;
+            if (token.size() > text.size() - pos) continue;
+            if (text.substr(pos, token.size()) == token) {
+                l = token.size();
+                t = i;
+            }
+        }
+
+        if (l == 0) {
+            break;
+        }
+
+        res.push_back(t);
+        pos += l;
+    }
+
+    return res;
+}
+
+// tokenize the text with llama_tokenize() for at least 100 ms, returns the tokens and the time per run in us
+static std::vector<gpt_vocab::id> bench_tokenize(const gpt_vocab & vocab, const std::string & text, double & t_run_us) {
+    std::vector<gpt_vocab::id> tokens;
+
+    int n_runs = 0;
+
+    const int64_t t_start_us = ggml_time_us();
+    int64_t t_us = 0;
+    do {
+        tokens = llama_tokenize(vocab, text, false);
+        n_runs++;
+        t_us = ggml_time_us() - t_start_us;
+    } while (t_us < 100000);
+
+    t_run_us = (double) t_us/n_runs;
+
+    return tokens;
+}
+
+// usage:
+//  ./bench-tokenize models/7B/ggml-model-q4_0.bin [text.txt]
+//
+// tokenizes inputs of 1 to 64 KB, cut from the text file or from a filler paragraph, with llama_tokenize() and
+// reports its throughput:
+//
+//   - greedy: the longest-match split through the trie, which is checked against the vocab scan it replaced - the
+//     scan is only timed up to 16 KB, beyond which it takes too long - and turned back into text
+//   - bpe:    the merges by score, if the model file has scores, with the number of tokens it saves
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin [text.txt]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    gpt_vocab vocab;
+
+    {
+        auto fin = std::ifstream(fname, std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        llama_hparams hparams;
+        bool single_file = false;
+
+        const int64_t t_start_us = ggml_time_us();
+
+        std::string error;
+        if (!llama_read_header(fin, fname, hparams, single_file, &vocab, error)) {
+            fprintf(stderr, "%s: %s\n", __func__, error.c_str());
+            return 1;
+        }
+
+        printf("%s: vocab size = %d, trie nodes = %zu, read + built in %8.2f ms\n", __func__,
+                vocab.size(), vocab.trie.nodes.size(), (ggml_time_us() - t_start_us)/1000.0);
+    }
+
+    gpt_vocab vocab_greedy = vocab;
+    vocab_greedy.scores.clear();
+
+    std::string source;
+    if (argc > 2) {
+        auto fin = std::ifstream(argv[2], std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, argv[2]);
+            return 1;
+        }
+        source.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    }
+    if (source.empty()) {
+        source = bench_text;
+    }
+
+    for (size_t size : { 1u << 10, 4u << 10, 16u << 10, 64u << 10 }) {
+        std::string text;
+        while (text.size() < size) {
+            text += source;
+        }
+        text.resize(size);
+
+        // the greedy split, for which the scores are left out
+        double t_greedy_us = 0.0;
+
+        const auto tokens = bench_tokenize(vocab_greedy, text, t_greedy_us);
+
+        printf("%s: %3zu KB: greedy %6zu tokens, %8.3f ms (%8.2f MB/s)", __func__, size >> 10, tokens.size(), t_greedy_us/1000.0, size/t_greedy_us);
+
+        // and back to text
+        {
+            std::string detok;
+
+            int n_runs = 0;
+
+            const int64_t t_start_us = ggml_time_us();
+            int64_t t_us = 0;
+            do {
+                detok.clear();
+                for (auto id : tokens) {
+                    const auto token = vocab.text(id);
+                    detok.append(token.data, token.size);
+                }
+                n_runs++;
+                t_us = ggml_time_us() - t_start_us;
+            } while (t_us < 100000);
+
+            printf(", detokenized in %8.3f ms (%8.2f MB/s)", (double) t_us/n_runs/1000.0, (double) size*n_runs/t_us);
+
+            if (detok != text.substr(0, detok.size())) {
+                printf("\n");
+                fprintf(stderr, "%s: the tokens of %zu KB of text do not add up to it\n", __func__, size >> 10);
+                return 1;
+            }
+        }
+
+        if (!vocab.scores.empty()) {
+            double t_bpe_us = 0.0;
+
+            const auto tokens_bpe = bench_tokenize(vocab, text, t_bpe_us);
+
+            printf(", bpe %6zu tokens, %8.3f ms (%8.2f MB/s)", tokens_bpe.size(), t_bpe_us/1000.0, size/t_bpe_us);
+        }
+
+        if (size <= (16u << 10)) {
+            const int64_t t_start_us = ggml_time_us();
+
+            const auto expected = bench_tokenize_scan(vocab, text);
+
+            const int64_t t_us = ggml_time_us() - t_start_us;
+
+            printf(", scan %10.3f ms (%8.4f MB/s)", t_us/1000.0, (double) size/t_us);
+
+            if (tokens != expected) {
+                printf("\n");
+                fprintf(stderr, "%s: the trie and the scan disagree on %zu KB of text\n", __func__, size >> 10);
+                return 1;
+            }
+        }
+
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "ggml.h"
+
+#include "bench.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int bench_top_k[] = { 1, 40, 100, 1000 };
+
+// the k best ids by a full sort, the lowest id first on ties
+static std::vector<gpt_vocab::id> bench_top_k_sort(const std::vector<float> & scores, int k) {
+    std::vector<gpt_vocab::id> ids(scores.size());
+    for (int i = 0; i < (int) ids.size(); ++i) {
+        ids[i] = i;
+    }
+
+    std::stable_sort(ids.begin(), ids.end(), [&](gpt_vocab::id a, gpt_vocab::id b) {
+        return scores[a] > scores[b];
+    });
+
+    ids.resize(std::min(k, (int) ids.size()));
+
+    return ids;
+}
+
+// logits of the shapes the sampler sees: spread out, with ties, or with most of the vocab masked out
+static std::vector<float> bench_scores(std::mt19937 & rng, int n, int shape) {
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    std::vector<float> scores(n);
+    for (auto & s : scores) {
+        s = dist(rng);
+        if (shape == 1) {
+            s = roundf(s);
+        }
+        if (shape == 2 && rng() % 4 != 0) {
+            s = -INFINITY;
+        }
+    }
+
+    return scores;
+}
+
+// usage:
+//  ./bench-topk [n_vocab]
+//
+// selects the top K of the logits of a vocab of n_vocab tokens (32000 by default) for K of 1, 40, 100 and 1000 with
+// llama_select_top_k() and with sample_top_k(), the partial sort of (double, id) pairs that the sampler used before,
+// checks that both give the same scores and reports the time of each, without that of building the pairs - then
+// checks llama_select_top_k() against a full sort on many random logits, with ties and masked tokens
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    const int n_vocab = argc > 1 ? atoi(argv[1]) : 32000;
+    if (n_vocab <= 0) {
+        fprintf(stderr, "usage: %s [n_vocab]\n", argv[0]);
+        return 1;
+    }
+
+    std::mt19937 rng(0);
+
+    const std::vector<float> scores = bench_scores(rng, n_vocab, 0);
+
+    std::vector<gpt_vocab::id> ids(n_vocab);
+
+    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
+    logits_id.reserve(n_vocab);
+
+    printf("%s: n_vocab = %d\n", __func__, n_vocab);
+
+    for (int top_k : bench_top_k) {
+        if (top_k > n_vocab) {
+            continue;
+        }
+
+        // the pairs are rebuilt for every run, as the partial sort reorders them - the time of the rebuild alone is
+        // taken off
+        const auto build = [&]() {
+            logits_id.clear();
+            for (int i = 0; i < n_vocab; ++i) {
+                logits_id.push_back(std::make_pair((double) scores[i], i));
+            }
+        };
+
+        const double t_build_us = bench_time_us(build);
+
+        const double t_sort_us = bench_time_us([&]() {
+            build();
+            sample_top_k(logits_id, top_k);
+        }) - t_build_us;
+
+        int n = 0;
+
+        const double t_select_us = bench_time_us([&]() {
+            n = llama_select_top_k(scores.data(), n_vocab, top_k, ids.data());
+        });
+
+        bool ok = n == (int) logits_id.size();
+        for (int i = 0; ok && i < n; ++i) {
+            ok = scores[ids[i]] == logits_id[i].first;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s: llama_select_top_k() and sample_top_k() disagree for top_k = %d\n", __func__, top_k);
+            return 1;
+        }
+
+        printf("%s: top_k = %4d: partial sort %8.3f ms, select %8.3f ms, %6.1fx\n", __func__,
+                top_k, t_sort_us/1000.0, t_select_us/1000.0, t_sort_us/t_select_us);
+    }
+
+    // random logits, where the edge cases are dense
+    const int n_tests = 2000;
+
+    for (int i = 0; i < n_tests; ++i) {
+        const int n     = 1 + rng() % (i < n_tests/2 ? 64 : 65536);
+        const int shape = rng() % 3;
+        const int top_k = 1 + rng() % (n + 2);
+
+        const std::vector<float> test = bench_scores(rng, n, shape);
+        const std::vector<gpt_vocab::id> expected = bench_top_k_sort(test, top_k);
+
+        std::vector<gpt_vocab::id> selected(n);
+        selected.resize(llama_select_top_k(test.data(), n, top_k, selected.data()));
+
+        if (selected != expected) {
+            fprintf(stderr, "%s: llama_select_top_k() and the full sort disagree on random logits %d\n", __func__, i);
+            return 1;
+        }
+    }
+
+    printf("%s: llama_select_top_k() and the full sort agree on %d random logits\n", __func__, n_tests);
+
+    return 0;
+}
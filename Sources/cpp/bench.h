@@ -0,0 +1,26 @@
+// Helpers shared by the benchmarks
+
+#pragma once
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// run f for at least 100 ms, returns the time of the fastest run in us - the runs are short enough for the noise of
+// the machine to swamp their mean
+template <typename F>
+static double bench_time_us(F f) {
+    int64_t t_min_us = INT64_MAX;
+
+    const int64_t t_start_us = ggml_time_us();
+    int64_t t_end_us = t_start_us;
+    do {
+        f();
+        const int64_t t_us = ggml_time_us();
+        t_min_us = std::min(t_min_us, t_us - t_end_us);
+        t_end_us = t_us;
+    } while (t_end_us - t_start_us < 100000);
+
+    return (double) t_min_us;
+}
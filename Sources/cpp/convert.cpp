@@ -0,0 +1,329 @@
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+static size_t align_offset(size_t offset) {
+    return ((offset + LLAMA_FILE_ALIGN - 1)/LLAMA_FILE_ALIGN)*LLAMA_FILE_ALIGN;
+}
+
+// convert a (possibly multi-part) 'ggml' model into a single file with aligned tensor data
+bool llama_model_convert(const std::string & fname_inp, const std::string & fname_out) {
+    printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
+
+    auto finp = std::ifstream(fname_inp, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    // verify magic and version - the scores of the tokens are carried over if the model has them
+    bool has_scores = false;
+    {
+        uint32_t magic;
+        finp.read((char *) &magic, sizeof(magic));
+        if (magic != LLAMA_FILE_MAGIC && magic != LLAMA_FILE_MAGIC_SCORES) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
+            return false;
+        }
+
+        has_scores = magic == LLAMA_FILE_MAGIC_SCORES;
+
+        if (has_scores) {
+            uint32_t version;
+            finp.read((char *) &version, sizeof(version));
+            if (version != LLAMA_FILE_VERSION) {
+                fprintf(stderr, "%s: invalid model file '%s' (unsupported version %u)\n", __func__, fname_inp.c_str(), version);
+                return false;
+            }
+        }
+    }
+
+    llama_hparams hparams;
+
+    // load hparams
+    {
+        finp.read((char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
+        finp.read((char *) &hparams.n_embd,  sizeof(hparams.n_embd));
+        finp.read((char *) &hparams.n_mult,  sizeof(hparams.n_mult));
+        finp.read((char *) &hparams.n_head,  sizeof(hparams.n_head));
+        finp.read((char *) &hparams.n_layer, sizeof(hparams.n_layer));
+        finp.read((char *) &hparams.n_rot,   sizeof(hparams.n_rot));
+        finp.read((char *) &hparams.f16,     sizeof(hparams.f16));
+
+        printf("%s: n_vocab = %d\n", __func__, hparams.n_vocab);
+        printf("%s: n_embd  = %d\n", __func__, hparams.n_embd);
+        printf("%s: n_mult  = %d\n", __func__, hparams.n_mult);
+        printf("%s: n_head  = %d\n", __func__, hparams.n_head);
+        printf("%s: n_layer = %d\n", __func__, hparams.n_layer);
+        printf("%s: f16     = %d\n", __func__, hparams.f16);
+    }
+
+    const int n_parts = llama_n_parts(hparams.n_embd);
+    if (n_parts == 0) {
+        fprintf(stderr, "%s: unsupported model dimension %d\n", __func__, hparams.n_embd);
+        return false;
+    }
+
+    printf("%s: n_parts = %d\n", __func__, n_parts);
+
+    // load vocab, it is copied as-is
+    std::vector<std::string> vocab(hparams.n_vocab);
+    std::vector<float> scores(has_scores ? hparams.n_vocab : 0);
+    {
+        for (int i = 0; i < hparams.n_vocab; ++i) {
+            uint32_t len;
+            finp.read((char *) &len, sizeof(len));
+
+            vocab[i].resize(len);
+            finp.read((char *) vocab[i].data(), len);
+
+            if (has_scores) {
+                finp.read((char *) &scores[i], sizeof(float));
+            }
+        }
+    }
+
+    if (!finp) {
+        fprintf(stderr, "%s: invalid model file '%s' (truncated header)\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    const size_t file_offset = finp.tellg();
+
+    finp.close();
+
+    // index the tensors of every part
+    std::vector<std::vector<llama_tensor_info>> parts(n_parts);
+    for (int i = 0; i < n_parts; ++i) {
+        std::string fname_part = fname_inp;
+        if (i > 0) {
+            fname_part += "." + std::to_string(i);
+        }
+
+        auto fpart = std::ifstream(fname_part, std::ios::binary);
+        if (!fpart) {
+            fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_part.c_str());
+            return false;
+        }
+
+        fpart.seekg(file_offset);
+
+        if (!llama_scan_tensors(fpart, parts[i])) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad tensor header)\n", __func__, fname_part.c_str());
+            return false;
+        }
+
+        if (parts[i].size() != parts[0].size()) {
+            fprintf(stderr, "%s: model part '%s' has %zu tensors, expected %zu\n", __func__, fname_part.c_str(), parts[i].size(), parts[0].size());
+            return false;
+        }
+    }
+
+    // the tensors of the output file, whole
+    std::vector<llama_tensor_info> tensors = parts[0];
+
+    for (size_t t = 0; t < tensors.size(); ++t) {
+        auto & info = tensors[t];
+
+        for (int i = 1; i < n_parts; ++i) {
+            const auto & info_part = parts[i][t];
+            if (info_part.name != info.name || info_part.ftype != info.ftype ||
+                info_part.ne[0] != info.ne[0] || info_part.ne[1] != info.ne[1]) {
+                fprintf(stderr, "%s: tensor '%s' does not match across the model parts\n", __func__, info.name.c_str());
+                return false;
+            }
+        }
+
+        if (info.n_dims == 2 && n_parts > 1) {
+            if (llama_split_type(info.name) == 0) {
+                info.ne[0] *= n_parts;
+            } else {
+                info.ne[1] *= n_parts;
+            }
+        }
+
+        info.size = llama_ftype_nbytes(info.ftype, info.ne[0]*info.ne[1]);
+    }
+
+    // lay out the file: header, index, then the tensor data, each aligned to LLAMA_FILE_ALIGN
+    {
+        size_t offset = 3*sizeof(uint32_t) + 7*sizeof(int32_t);
+        for (const auto & word : vocab) {
+            offset += sizeof(uint32_t) + word.size();
+        }
+        offset += scores.size()*sizeof(float);
+        offset += llama_tensor_index_size(tensors);
+
+        for (auto & info : tensors) {
+            offset = align_offset(offset);
+            info.offset = offset;
+            offset += info.size;
+        }
+    }
+
+    printf("%s: writing model to '%s'\n", __func__, fname_out.c_str());
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    // write header
+    {
+        const uint32_t magic   = LLAMA_FILE_MAGIC_SINGLE;
+        const uint32_t version = has_scores ? LLAMA_FILE_VERSION_SINGLE : 1;
+        const uint32_t align   = LLAMA_FILE_ALIGN;
+
+        fout.write((char *) &magic,   sizeof(magic));
+        fout.write((char *) &version, sizeof(version));
+        fout.write((char *) &align,   sizeof(align));
+
+        fout.write((char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
+        fout.write((char *) &hparams.n_embd,  sizeof(hparams.n_embd));
+        fout.write((char *) &hparams.n_mult,  sizeof(hparams.n_mult));
+        fout.write((char *) &hparams.n_head,  sizeof(hparams.n_head));
+        fout.write((char *) &hparams.n_layer, sizeof(hparams.n_layer));
+        fout.write((char *) &hparams.n_rot,   sizeof(hparams.n_rot));
+        fout.write((char *) &hparams.f16,     sizeof(hparams.f16));
+
+        for (int i = 0; i < hparams.n_vocab; ++i) {
+            const uint32_t len = vocab[i].size();
+            fout.write((char *) &len, sizeof(len));
+            fout.write(vocab[i].data(), len);
+
+            if (has_scores) {
+                fout.write((char *) &scores[i], sizeof(float));
+            }
+        }
+
+        llama_write_tensor_index(fout, tensors);
+    }
+
+    // write the tensor data, reassembling the split tensors
+    {
+        std::vector<std::ifstream> fparts(n_parts);
+        for (int i = 0; i < n_parts; ++i) {
+            std::string fname_part = fname_inp;
+            if (i > 0) {
+                fname_part += "." + std::to_string(i);
+            }
+            fparts[i] = std::ifstream(fname_part, std::ios::binary);
+        }
+
+        std::vector<char> data;
+        const std::vector<char> padding(LLAMA_FILE_ALIGN, 0);
+
+        size_t total_size = 0;
+
+        for (size_t t = 0; t < tensors.size(); ++t) {
+            const auto & info = tensors[t];
+
+            data.resize(info.size);
+
+            if (info.n_dims == 1 || n_parts == 1) {
+                // not split, the first part holds the whole tensor
+                fparts[0].seekg(parts[0][t].offset);
+                fparts[0].read(data.data(), info.size);
+            } else if (llama_split_type(info.name) == 0) {
+                const size_t row_size  = llama_ftype_nbytes(info.ftype, info.ne[0]);
+                const size_t part_size = row_size/n_parts;
+
+                for (int i = 0; i < n_parts; ++i) {
+                    fparts[i].seekg(parts[i][t].offset);
+                    for (int i1 = 0; i1 < info.ne[1]; ++i1) {
+                        fparts[i].read(data.data() + i1*row_size + i*part_size, part_size);
+                    }
+                }
+            } else {
+                const size_t part_size = info.size/n_parts;
+
+                for (int i = 0; i < n_parts; ++i) {
+                    fparts[i].seekg(parts[i][t].offset);
+                    fparts[i].read(data.data() + i*part_size, part_size);
+                }
+            }
+
+            for (int i = 0; i < n_parts; ++i) {
+                if (!fparts[i]) {
+                    fprintf(stderr, "%s: failed to read tensor '%s' from model part %d\n", __func__, info.name.c_str(), i);
+                    return false;
+                }
+            }
+
+            const size_t pos = fout.tellp();
+            assert(pos <= info.offset && info.offset - pos < LLAMA_FILE_ALIGN);
+            fout.write(padding.data(), info.offset - pos);
+            fout.write(data.data(), info.size);
+
+            {
+                static const char * ftype_str[] = { "f32", "f16", "q4_0", "q4_1", };
+                printf("%48s - [%5d, %5d], type = %6s, size = %8.3f MB\n", info.name.c_str(), info.ne[0], info.ne[1], ftype_str[info.ftype], info.size/1024.0/1024.0);
+            }
+
+            total_size += info.size;
+        }
+
+        printf("%s: model size  = %8.2f MB\n", __func__, total_size/1024.0/1024.0);
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    fout.close();
+
+    return true;
+}
+
+// usage:
+//  ./convert models/llama/ggml-model.bin models/llama/ggml-model-single.bin
+//
+// the additional parts of a multi-part model (ggml-model.bin.1, ...) are picked up automatically
+//
+int main(int argc, char ** argv) {
+    ggml_time_init();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s model.bin model-single.bin\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname_inp = argv[1];
+    const std::string fname_out = argv[2];
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    int64_t t_convert_us = 0;
+
+    // convert the model
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!llama_model_convert(fname_inp, fname_out)) {
+            fprintf(stderr, "%s: failed to convert model from '%s'\n", __func__, fname_inp.c_str());
+            return 1;
+        }
+
+        t_convert_us = ggml_time_us() - t_start_us;
+    }
+
+    // report timing
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        printf("\n");
+        printf("%s: convert time = %8.2f ms\n", __func__, t_convert_us/1000.0f);
+        printf("%s:   total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int footprint_n_ctx  [] = { 256, 512, 1024, 2048 };
+static const int footprint_n_batch[] = { 1, 8, 32, 64, 128, 512 };
+
+static double footprint_mb(size_t size) {
+    return size/1024.0/1024.0;
+}
+
+// bytes of the data of n elements of the given type
+static size_t footprint_nbytes(enum ggml_type type, size_t n) {
+    return n*ggml_type_size(type)/ggml_blck_size(type);
+}
+
+// usage:
+//  ./footprint models/7B/ggml-model-q4_0.bin [n_threads] [n_stream_layers]
+//
+// reads the header of a model file and prints the memory that loading it and running a session on it takes - the
+// weights when read, mapped or streamed, the key + value memory and the compute buffer for a range of context and
+// batch sizes - together with the bytes that the evaluation of one token moves
+//
+// these are the sizes that llama_model_load() and llama_session_init() allocate, nothing is allocated here
+//
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin [n_threads] [n_stream_layers]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    const int n_threads       = argc > 2 ? atoi(argv[2]) : std::max(1, (int) std::thread::hardware_concurrency());
+    const int n_stream_layers = argc > 3 ? atoi(argv[3]) : 2;
+
+    llama_hparams hparams;
+
+    {
+        auto fin = std::ifstream(fname, std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        bool single_file = false;
+
+        std::string error;
+        if (!llama_read_header(fin, fname, hparams, single_file, nullptr, error)) {
+            fprintf(stderr, "%s: %s\n", __func__, error.c_str());
+            return 1;
+        }
+
+        printf("%s: model   = %s (%s)\n", __func__, fname.c_str(), single_file ? "single file" : "ggml");
+    }
+
+    const ggml_type wtype = llama_ftype_to_ggml_type(hparams.f16);
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_vocab = hparams.n_vocab;
+    const int n_ff    = llama_n_ff(hparams);
+
+    printf("%s: n_vocab = %d\n", __func__, n_vocab);
+    printf("%s: n_embd  = %d\n", __func__, n_embd);
+    printf("%s: n_mult  = %d\n", __func__, hparams.n_mult);
+    printf("%s: n_head  = %d\n", __func__, hparams.n_head);
+    printf("%s: n_layer = %d\n", __func__, n_layer);
+    printf("%s: n_rot   = %d\n", __func__, hparams.n_rot);
+    printf("%s: n_ff    = %d\n", __func__, n_ff);
+    printf("%s: type    = %s\n", __func__, wtype == GGML_TYPE_F32 ? "f32" : wtype == GGML_TYPE_F16 ? "f16" : wtype == GGML_TYPE_Q4_0 ? "q4_0" : "q4_1");
+    printf("%s: threads = %d\n", __func__, n_threads);
+    printf("\n");
+
+    // weights
+    printf("weights:\n");
+    {
+        struct mode {
+            const char * name;
+            bool use_mmap;
+            int  n_stream_layers;
+        };
+
+        const mode modes[] = {
+            { "read",     false, 0               },
+            { "mapped",   true,  0               },
+            { "streamed", false, n_stream_layers },
+        };
+
+        for (const auto & m : modes) {
+            if (m.n_stream_layers > 0 && llama_stream_slots(hparams, m.n_stream_layers) == 0) {
+                printf("  %-8s: not streamed, %d layers hold all of the %d layers\n", m.name, m.n_stream_layers, n_layer);
+                continue;
+            }
+
+            llama_memory_footprint footprint;
+
+            std::string error;
+            if (!llama_model_footprint(fname, 512, 1, n_threads, m.use_mmap, m.n_stream_layers, footprint, error)) {
+                fprintf(stderr, "%s: %s\n", __func__, error.c_str());
+                return 1;
+            }
+
+            printf("  %-8s: context = %9.2f MB, mapped = %9.2f MB, stream = %9.2f MB", m.name,
+                    footprint_mb(footprint.weights), footprint_mb(footprint.mapped), footprint_mb(footprint.stream));
+
+            if (m.n_stream_layers > 0) {
+                printf(" (%d of %d layers)", llama_stream_slots(hparams, m.n_stream_layers), n_layer);
+            }
+
+            printf("\n");
+        }
+    }
+    printf("\n");
+
+    // key + value memory
+    printf("key + value memory per session (the sessions store f32):\n");
+    printf("  %-8s", "n_ctx");
+    for (int n_ctx : footprint_n_ctx) {
+        printf(" %12d", n_ctx);
+    }
+    printf("\n");
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16 }) {
+        printf("  %-8s", type == GGML_TYPE_F32 ? "f32" : "f16");
+        for (int n_ctx : footprint_n_ctx) {
+            printf(" %9.2f MB", footprint_mb(llama_kv_memory_size(hparams, n_ctx, type)));
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    // compute buffer
+    printf("compute buffer per session:\n");
+    printf("  %-8s", "n_batch");
+    for (int n_ctx : footprint_n_ctx) {
+        printf(" %12d", n_ctx);
+    }
+    printf("\n");
+    for (int n_batch : footprint_n_batch) {
+        printf("  %-8d", n_batch);
+        for (int n_ctx : footprint_n_ctx) {
+            if (n_batch > n_ctx) {
+                printf(" %12s", "-");
+                continue;
+            }
+            printf(" %9.2f MB", footprint_mb(llama_eval_buffer_size(hparams, n_ctx, n_batch, n_threads, false)));
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    // bytes moved by the evaluation of one token: every weight matrix is read once, the embeddings only for the row
+    // of the token - then the keys and values of all the past tokens are read and those of the token written
+    printf("bytes moved per token, with the context full:\n");
+    {
+        const size_t matrices = (size_t) n_layer*(footprint_nbytes(wtype, 4*(size_t) n_embd*n_embd) + footprint_nbytes(wtype, 3*(size_t) n_embd*n_ff))
+                              + footprint_nbytes(wtype, (size_t) n_embd*n_vocab);
+        const size_t norms    = (size_t) (2*n_layer + 1)*n_embd*sizeof(float);
+        const size_t embd     = footprint_nbytes(wtype, n_embd);
+        const size_t logits   = (size_t) n_vocab*sizeof(float);
+        const size_t weights  = matrices + norms + embd;
+
+        printf("  weights : %9.2f MB (matrices %.2f MB, norms %.2f kB, embedding row %.2f kB)\n",
+                footprint_mb(weights), footprint_mb(matrices), norms/1024.0, embd/1024.0);
+        printf("  logits  : %9.2f kB written\n", logits/1024.0);
+
+        for (int n_ctx : footprint_n_ctx) {
+            const size_t kv_read  = 2*(size_t) n_layer*n_ctx*n_embd*sizeof(float);
+            const size_t kv_write = 2*(size_t) n_layer*n_embd*sizeof(float);
+
+            printf("  n_ctx = %4d: kv read %9.2f MB, kv written %7.2f kB, total %9.2f MB\n",
+                    n_ctx, footprint_mb(kv_read), kv_write/1024.0, footprint_mb(weights + kv_read + kv_write + logits));
+        }
+
+        // a streamed model reads the weights of every layer from the file on each evaluation, whatever the batch size
+        if (llama_stream_slots(hparams, n_stream_layers) > 0) {
+            printf("  streamed: %9.2f MB read from the file per evaluation\n", footprint_mb(n_layer*llama_stream_slot_size(hparams)));
+        }
+    }
+
+    return 0;
+}
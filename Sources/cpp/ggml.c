@@ -1,3 +1,8 @@
+// for pthread_setaffinity_np()
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "ggml.h"
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
@@ -76,6 +81,10 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 #ifdef __HAIKU__
 #define static_assert(cond, msg) _Static_assert(cond, msg)
 #endif
@@ -1210,14 +1219,12 @@ inline static void ggml_vec_set_i32(const int n, int32_t * x, const int32_t v) {
 
 inline static void ggml_vec_set_f16(const int n, ggml_fp16_t * x, const int32_t v) { for (int i = 0; i < n; ++i) x[i] = v; }
 
-inline static void ggml_vec_add_f32 (const int n, float * z, const float * x, const float * y) { for (int i = 0; i < n; ++i) z[i]  = x[i] + y[i]; }
 inline static void ggml_vec_acc_f32 (const int n, float * y, const float * x)                  { for (int i = 0; i < n; ++i) y[i] += x[i];        }
 inline static void ggml_vec_acc1_f32(const int n, float * y, const float   v)                  { for (int i = 0; i < n; ++i) y[i] += v;           }
 inline static void ggml_vec_sub_f32 (const int n, float * z, const float * x, const float * y) { for (int i = 0; i < n; ++i) z[i]  = x[i] - y[i]; }
 inline static void ggml_vec_set_f32 (const int n, float * x, const float   v)                  { for (int i = 0; i < n; ++i) x[i]  = v;           }
 inline static void ggml_vec_cpy_f32 (const int n, float * y, const float * x)                  { for (int i = 0; i < n; ++i) y[i]  = x[i];        }
 inline static void ggml_vec_neg_f32 (const int n, float * y, const float * x)                  { for (int i = 0; i < n; ++i) y[i]  = -x[i];       }
-inline static void ggml_vec_mul_f32 (const int n, float * z, const float * x, const float * y) { for (int i = 0; i < n; ++i) z[i]  = x[i]*y[i];   }
 inline static void ggml_vec_div_f32 (const int n, float * z, const float * x, const float * y) { for (int i = 0; i < n; ++i) z[i]  = x[i]/y[i];   }
 
 inline static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y) {
@@ -1871,6 +1878,64 @@ inline static void ggml_vec_mad_q4_1(const int n, float * restrict y, void * res
     }
 }
 
+inline static void ggml_vec_add_f32(const int n, float * z, const float * x, const float * y) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR);
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j*GGML_F32_EPR);
+            ax[j] = GGML_F32_VEC_ADD(ax[j], ay[j]);
+
+            GGML_F32_VEC_STORE(z + i + j*GGML_F32_EPR, ax[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        z[i] = x[i] + y[i];
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        z[i] = x[i] + y[i];
+    }
+#endif
+}
+
+inline static void ggml_vec_mul_f32(const int n, float * z, const float * x, const float * y) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR);
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j*GGML_F32_EPR);
+            ax[j] = GGML_F32_VEC_MUL(ax[j], ay[j]);
+
+            GGML_F32_VEC_STORE(z + i + j*GGML_F32_EPR, ax[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        z[i] = x[i]*y[i];
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        z[i] = x[i]*y[i];
+    }
+#endif
+}
+
 //inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) { for (int i = 0; i < n; ++i) y[i] *= v;          }
 inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #if defined(GGML_SIMD)
@@ -2487,6 +2552,35 @@ size_t ggml_used_mem(const struct ggml_context * ctx) {
     return ctx->objects_end->offs + ctx->objects_end->size;
 }
 
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor);
+}
+
+// must match ggml_new_tensor_impl()
+size_t ggml_tensor_mem_size(enum ggml_type type, int n_dims, const int * ne) {
+    size_t size = GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
+    for (int i = 1; i < n_dims; i++) {
+        size *= ne[i];
+    }
+
+    return ((size + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN + ggml_tensor_overhead();
+}
+
+// must match ggml_graph_compute()
+size_t ggml_graph_work_mem_size(size_t work_size, int n_threads) {
+    if (work_size == 0) {
+        return 0;
+    }
+
+    const int ne = ggml_graph_work_buffer_size(work_size, n_threads);
+
+    return ggml_tensor_mem_size(GGML_TYPE_I8, 1, &ne);
+}
+
+size_t ggml_graph_work_buffer_size(size_t work_size, int n_threads) {
+    return work_size + CACHE_LINE_SIZE*(n_threads - 1);
+}
+
 size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch) {
     const size_t result = ctx->scratch.data ? ctx->scratch.offs : 0;
 
@@ -2625,6 +2719,17 @@ struct ggml_tensor * ggml_new_tensor(
     return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL);
 }
 
+struct ggml_tensor * ggml_new_tensor_with_data(
+        struct ggml_context * ctx,
+        enum   ggml_type type,
+        int    n_dims,
+        const int * ne,
+        void * data) {
+    GGML_ASSERT(data != NULL);
+
+    return ggml_new_tensor_impl(ctx, type, n_dims, ne, data);
+}
+
 struct ggml_tensor * ggml_new_tensor_1d(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -3047,11 +3152,13 @@ struct ggml_tensor * ggml_add_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    GGML_ASSERT(ggml_are_same_shape(a, b));
+    // b is broadcast across a
+    GGML_ASSERT(ggml_can_repeat(b, a));
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        GGML_ASSERT(ggml_are_same_shape(a, b)); // TODO: implement backward for broadcasting
         is_node = true;
     }
 
@@ -3125,11 +3232,13 @@ struct ggml_tensor * ggml_mul_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    GGML_ASSERT(ggml_are_same_shape(a, b));
+    // b is broadcast across a
+    GGML_ASSERT(ggml_can_repeat(b, a));
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        GGML_ASSERT(ggml_are_same_shape(a, b)); // TODO: implement backward for broadcasting
         is_node = true;
     }
 
@@ -3660,9 +3769,7 @@ struct ggml_tensor * ggml_scale_impl(
         is_node = true;
     }
 
-    // TODO: when implement backward, fix this:
-    //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
-    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+    struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
 
     result->op   = GGML_OP_SCALE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -3975,20 +4082,19 @@ struct ggml_tensor * ggml_get_rows(
 
 // ggml_diag_mask_inf
 
-struct ggml_tensor * ggml_diag_mask_inf(
+struct ggml_tensor * ggml_diag_mask_inf_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
-        int                   n_past) {
+        int                   n_past,
+        bool                  inplace) {
     bool is_node = false;
 
-    if (a->grad) {
+    if (!inplace && (a->grad)) {
         GGML_ASSERT(false); // TODO: implement backward
         is_node = true;
     }
 
-    // TODO: when implement backward, fix this:
-    //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
-    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+    struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * b = ggml_new_i32(ctx, n_past);
 
     result->op   = GGML_OP_DIAG_MASK_INF;
@@ -3999,21 +4105,34 @@ struct ggml_tensor * ggml_diag_mask_inf(
     return result;
 }
 
+struct ggml_tensor * ggml_diag_mask_inf(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   n_past) {
+    return ggml_diag_mask_inf_impl(ctx, a, n_past, false);
+}
+
+struct ggml_tensor * ggml_diag_mask_inf_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   n_past) {
+    return ggml_diag_mask_inf_impl(ctx, a, n_past, true);
+}
+
 // ggml_soft_max
 
-struct ggml_tensor * ggml_soft_max(
+struct ggml_tensor * ggml_soft_max_impl(
         struct ggml_context * ctx,
-        struct ggml_tensor  * a) {
+        struct ggml_tensor  * a,
+        bool                  inplace) {
     bool is_node = false;
 
-    if (a->grad) {
+    if (!inplace && (a->grad)) {
         GGML_ASSERT(false); // TODO: implement backward
         is_node = true;
     }
 
-    // TODO: when implement backward, fix this:
-    //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
-    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+    struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
 
     result->op   = GGML_OP_SOFT_MAX;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -4023,6 +4142,18 @@ struct ggml_tensor * ggml_soft_max(
     return result;
 }
 
+struct ggml_tensor * ggml_soft_max(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a) {
+    return ggml_soft_max_impl(ctx, a, false);
+}
+
+struct ggml_tensor * ggml_soft_max_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a) {
+    return ggml_soft_max_impl(ctx, a, true);
+}
+
 // ggml_rope
 
 struct ggml_tensor * ggml_rope(
@@ -4427,7 +4558,7 @@ static void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -4439,35 +4570,55 @@ static void ggml_compute_forward_add_f32(
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
     const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
 
     const size_t nb10 = src1->nb[0];
     const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
 
     const size_t nb0 = dst->nb[0];
     const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
 
     GGML_ASSERT( nb0 == sizeof(float));
     GGML_ASSERT(nb00 == sizeof(float));
 
-    if (nb10 == sizeof(float)) {
-        const int j0 = (n/nth)*ith;
-        const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
+    // rows per thread
+    const int j0 = (n/nth)*ith;
+    const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
 
-        for (int j = j0; j < j1; j++) {
-            ggml_vec_add_f32(nc,
-                    (float *) ((char *) dst->data  + j*nb1),
-                    (float *) ((char *) src0->data + j*nb01),
-                    (float *) ((char *) src1->data + j*nb11));
-        }
-    } else {
-        // src1 is not contiguous
-        for (int j = ith; j < n; j += nth) {
-            float * dst_ptr  = (float *) ((char *) dst->data  + j*nb1);
-            float * src0_ptr = (float *) ((char *) src0->data + j*nb01);
+    for (int j = j0; j < j1; j++) {
+        const int i3 = j/(ne02*ne01);
+        const int i2 = (j - i3*ne02*ne01)/ne01;
+        const int i1 = (j - i3*ne02*ne01 - i2*ne01);
+
+        float * dst_ptr  = (float *) ((char *) dst->data  + i3*nb3  + i2*nb2  + i1*nb1);
+        float * src0_ptr = (float *) ((char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01);
+
+        // src1 is broadcast across src0
+        char * src1_row = (char *) src1->data + (i3%ne13)*nb13 + (i2%ne12)*nb12 + (i1%ne11)*nb11;
+
+        if (nb10 == sizeof(float)) {
+            for (int i0 = 0; i0 < nc; i0 += ne10) {
+                ggml_vec_add_f32(ne10, dst_ptr + i0, src0_ptr + i0, (float *) src1_row);
+            }
+        } else {
+            // src1 is not contiguous
             for (int i = 0; i < nc; i++) {
-                float * src1_ptr = (float *) ((char *) src1->data + j*nb11 + i*nb10);
+                float * src1_ptr = (float *) (src1_row + (i%ne10)*nb10);
 
                 dst_ptr[i] = src0_ptr[i] + *src1_ptr;
             }
@@ -4557,25 +4708,48 @@ static void ggml_compute_forward_mul_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-    assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    assert(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
-        ggml_vec_mul_f32(nc,
-                (float *) ((char *) dst->data  + i*( dst->nb[1])),
-                (float *) ((char *) src0->data + i*(src0->nb[1])),
-                (float *) ((char *) src1->data + i*(src1->nb[1])));
+    // rows per thread
+    const int j0 = (n/nth)*ith;
+    const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
+
+    for (int j = j0; j < j1; j++) {
+        const int i3 = j/(ne02*ne01);
+        const int i2 = (j - i3*ne02*ne01)/ne01;
+        const int i1 = (j - i3*ne02*ne01 - i2*ne01);
+
+        float * dst_ptr  = (float *) ((char *) dst->data  + i3*dst->nb[3]  + i2*dst->nb[2]  + i1*dst->nb[1]);
+        float * src0_ptr = (float *) ((char *) src0->data + i3*src0->nb[3] + i2*src0->nb[2] + i1*src0->nb[1]);
+
+        // src1 is broadcast across src0
+        float * src1_ptr = (float *) ((char *) src1->data + (i3%ne13)*src1->nb[3] + (i2%ne12)*src1->nb[2] + (i1%ne11)*src1->nb[1]);
+
+        for (int i0 = 0; i0 < nc; i0 += ne10) {
+            ggml_vec_mul_f32(ne10, dst_ptr + i0, src0_ptr + i0, src1_ptr);
+        }
     }
 }
 
@@ -6677,6 +6851,10 @@ static void ggml_compute_forward_scale_f32(
     const int ir1 = MIN(ir0 + dr, nr);
 
     for (int i1 = ir0; i1 < ir1; i1++) {
+        if (dst->data != src0->data) {
+            // not in-place
+            memcpy((char *) dst->data + i1*(dst->nb[1]), (char *) src0->data + i1*(src0->nb[1]), nc*sizeof(float));
+        }
         ggml_vec_scale_f32(nc, (float *) ((char *) dst->data + i1*(dst->nb[1])), v);
     }
 }
@@ -6943,6 +7121,15 @@ static void ggml_compute_forward_diag_mask_inf_f32(
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
+    if (dst->data != src0->data) {
+        // not in-place
+        for (int k = 0; k < nz; k++) {
+            for (int j = 0; j < nr; j++) {
+                memcpy((char *) dst->data + k*dst->nb[2] + j*dst->nb[1], (char *) src0->data + k*src0->nb[2] + j*src0->nb[1], nc*sizeof(float));
+            }
+        }
+    }
+
     for (int k = 0; k < nz; k++) {
         for (int j = 0; j < nr; j++) {
             for (int i = n_past; i < nc; i++) {
@@ -7009,6 +7196,11 @@ static void ggml_compute_forward_soft_max_f32(
     for (int i1 = ir0; i1 < ir1; i1++) {
         float *p = (float *)((char *) dst->data + i1*dst->nb[1]);
 
+        if (dst->data != src0->data) {
+            // not in-place
+            memcpy(p, (char *) src0->data + i1*src0->nb[1], nc*sizeof(float));
+        }
+
 #ifndef NDEBUG
         for (int i = 0; i < nc; ++i) {
             //printf("p[%d] = %f\n", i, p[i]);
@@ -8926,6 +9118,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_nodes      =*/ 0,
         /*.n_leafs      =*/ 0,
         /*.n_threads    =*/ 0,
+        /*.thread_cpus  =*/ NULL,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
         /*.nodes        =*/ { NULL },
@@ -9038,6 +9231,16 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
+#if defined(__linux__)
+static void ggml_thread_set_cpu(pthread_t thrd, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    pthread_setaffinity_np(thrd, sizeof(set), &set);
+}
+#endif
+
 struct ggml_compute_state_shared {
     ggml_lock_t spin;
 
@@ -9145,9 +9348,24 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
             GGML_ASSERT(rc == 0);
             UNUSED(rc);
+
+#if defined(__linux__)
+            if (cgraph->thread_cpus) {
+                ggml_thread_set_cpu(workers[j].thrd, cgraph->thread_cpus[j + 1]);
+            }
+#endif
         }
     }
 
+#if defined(__linux__)
+    // the calling thread computes as thread 0, its own affinity is restored at the end
+    cpu_set_t cpus_saved;
+    const bool pin_main = cgraph->thread_cpus && pthread_getaffinity_np(pthread_self(), sizeof(cpus_saved), &cpus_saved) == 0;
+    if (pin_main) {
+        ggml_thread_set_cpu(pthread_self(), cgraph->thread_cpus[0]);
+    }
+#endif
+
     // initialize tasks + work buffer
     {
         size_t work_size = 0;
@@ -9162,11 +9380,11 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         node->n_tasks = 1;
                     } break;
                 case GGML_OP_ADD:
+                case GGML_OP_MUL:
                     {
                         node->n_tasks = n_threads;
                     } break;
                 case GGML_OP_SUB:
-                case GGML_OP_MUL:
                 case GGML_OP_DIV:
                 case GGML_OP_SQR:
                 case GGML_OP_SQRT:
@@ -9367,7 +9585,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         }
 
         if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+            cgraph->work_size = ggml_graph_work_buffer_size(work_size, n_threads);
 
             GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
             cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
@@ -9536,6 +9754,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         ggml_lock_destroy(&state_shared.spin);
     }
 
+#if defined(__linux__)
+    if (pin_main) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus_saved), &cpus_saved);
+    }
+#endif
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
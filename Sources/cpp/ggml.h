@@ -291,6 +291,9 @@ struct ggml_cgraph {
     int n_leafs;
     int n_threads;
 
+    // if not NULL, compute thread i runs on CPU thread_cpus[i] (Linux only)
+    const int * thread_cpus;
+
     size_t work_size;
     struct ggml_tensor * work;
 
@@ -340,6 +343,17 @@ void ggml_free(struct ggml_context * ctx);
 
 size_t ggml_used_mem(const struct ggml_context * ctx);
 
+// context memory taken by a view (object + tensor header) and by a new tensor (header + aligned data)
+size_t ggml_tensor_overhead(void);
+size_t ggml_tensor_mem_size(enum ggml_type type, int n_dims, const int * ne);
+
+// context memory taken by the work buffer that ggml_graph_compute() allocates for work_size bytes
+size_t ggml_graph_work_mem_size(size_t work_size, int n_threads);
+
+// number of bytes of that work buffer - a buffer of this size can be set in cgraph->work beforehand to share it
+// between graphs
+size_t ggml_graph_work_buffer_size(size_t work_size, int n_threads);
+
 size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch);
 
 struct ggml_tensor * ggml_new_tensor(
@@ -348,6 +362,15 @@ struct ggml_tensor * ggml_new_tensor(
         int    n_dims,
         const int *ne);
 
+// the tensor data is not allocated in the context's memory pool - it points to the provided memory instead
+// (e.g. a memory-mapped model file), which must outlive the tensor and be aligned to at least 16 bytes
+struct ggml_tensor * ggml_new_tensor_with_data(
+        struct ggml_context * ctx,
+        enum   ggml_type type,
+        int    n_dims,
+        const int *ne,
+        void * data);
+
 struct ggml_tensor * ggml_new_tensor_1d(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -401,21 +424,35 @@ struct ggml_tensor * ggml_dup(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// b is broadcast across a if ggml_repeat(b, a) is possible (e.g. a row vector across the rows of a matrix)
 struct ggml_tensor * ggml_add(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// in-place, returns view(a)
+struct ggml_tensor * ggml_add_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b);
+
 struct ggml_tensor * ggml_sub(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// b is broadcast across a if ggml_repeat(b, a) is possible (e.g. a row vector across the rows of a matrix)
 struct ggml_tensor * ggml_mul(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// in-place, returns view(a)
+struct ggml_tensor * ggml_mul_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b);
+
 struct ggml_tensor * ggml_div(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -476,6 +513,11 @@ struct ggml_tensor * ggml_silu(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// in-place, returns view(a)
+struct ggml_tensor * ggml_silu_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a);
+
 // normalize along rows
 // TODO: eps is hardcoded to 1e-5 for now
 struct ggml_tensor * ggml_norm(
@@ -494,12 +536,17 @@ struct ggml_tensor * ggml_mul_mat(
 // operations on tensors without backpropagation
 //
 
-// in-place, returns view(a)
 struct ggml_tensor * ggml_scale(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// in-place, returns view(a)
+struct ggml_tensor * ggml_scale_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b);
+
 // a -> b, return view(b)
 struct ggml_tensor * ggml_cpy(
         struct ggml_context * ctx,
@@ -564,17 +611,26 @@ struct ggml_tensor * ggml_get_rows(
         struct ggml_tensor  * b);
 
 // set elements above the diagonal to -INF
-// in-place, returns view(a)
 struct ggml_tensor * ggml_diag_mask_inf(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         int                   n_past);
 
 // in-place, returns view(a)
+struct ggml_tensor * ggml_diag_mask_inf_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   n_past);
+
 struct ggml_tensor * ggml_soft_max(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// in-place, returns view(a)
+struct ggml_tensor * ggml_soft_max_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a);
+
 // rotary position embedding
 // in-place, returns view(a)
 // if mode == 1, skip n_past elements
@@ -15,19 +15,6 @@
 // TODO: move somewhere else
 #define QK 32
 
-// default hparams (LLaMA76B)
-struct llama_hparams {
-    int32_t n_vocab = 32000;
-    int32_t n_ctx   = 512;   // this is provided as user input?
-    int32_t n_embd  = 4096;
-    int32_t n_mult  = 256;
-    int32_t n_head  = 32;
-    int32_t n_layer = 32;
-    int32_t n_rot   = 64;
-    int32_t f16     = 1;
-};
-
-
 // quantize a model
 bool llama_model_quantize(const std::string & fname_inp, const std::string & fname_out, int itype) {
     ggml_type type = GGML_TYPE_Q4_1;
@@ -59,16 +46,30 @@ bool llama_model_quantize(const std::string & fname_inp, const std::string & fna
         return false;
     }
 
-    // verify magic
+    // verify magic and version - the scores of the tokens are copied if the model has them
+    bool has_scores = false;
     {
         uint32_t magic;
         finp.read((char *) &magic, sizeof(magic));
-        if (magic != 0x67676d6c) {
+        if (magic != LLAMA_FILE_MAGIC && magic != LLAMA_FILE_MAGIC_SCORES) {
             fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
             return false;
         }
 
         fout.write((char *) &magic, sizeof(magic));
+
+        has_scores = magic == LLAMA_FILE_MAGIC_SCORES;
+
+        if (has_scores) {
+            uint32_t version;
+            finp.read((char *) &version, sizeof(version));
+            if (version != LLAMA_FILE_VERSION) {
+                fprintf(stderr, "%s: invalid model file '%s' (unsupported version %u)\n", __func__, fname_inp.c_str(), version);
+                return false;
+            }
+
+            fout.write((char *) &version, sizeof(version));
+        }
     }
 
     llama_hparams hparams;
@@ -122,8 +123,15 @@ bool llama_model_quantize(const std::string & fname_inp, const std::string & fna
             finp.read ((char *) word.data(), len);
             fout.write((char *) word.data(), len);
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            if (has_scores) {
+                float score;
+                finp.read ((char *) &score, sizeof(score));
+                fout.write((char *) &score, sizeof(score));
+
+                vocab.scores.push_back(score);
+            }
+
+            gpt_vocab_add(vocab, word.data(), word.size());
         }
     }
 
@@ -1,14 +1,39 @@
 #include "utils.h"
 
+#include "ggml.h"
+
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <fstream>
-#include <regex>
 #include <iostream>
 #include <iterator>
+#include <queue>
 #include <string>
+#include <unordered_map>
 #include <math.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <sys/mman.h>
+#endif
+
+#if defined (__APPLE__)
+#include <mach/vm_statistics.h>
+#endif
+
+#if defined (__linux__)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
  #if defined(_MSC_VER) || defined(__MINGW32__)
  #include <malloc.h> // using malloc.h with MSC/MINGW
  #elif !defined(__FreeBSD__) && !defined(__NetBSD__)
@@ -45,10 +70,51 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.repeat_last_n = std::stoi(argv[++i]);
         } else if (arg == "--repeat_penalty") {
             params.repeat_penalty = std::stof(argv[++i]);
+        } else if (arg == "--frequency_penalty") {
+            params.frequency_penalty = std::stof(argv[++i]);
+        } else if (arg == "--presence_penalty") {
+            params.presence_penalty = std::stof(argv[++i]);
+        } else if (arg == "--typical_p") {
+            params.typical_p = std::stof(argv[++i]);
+        } else if (arg == "--tfs") {
+            params.tfs_z = std::stof(argv[++i]);
+        } else if (arg == "--mirostat") {
+            params.mirostat = std::stoi(argv[++i]);
+        } else if (arg == "--mirostat_tau") {
+            params.mirostat_tau = std::stof(argv[++i]);
+        } else if (arg == "--mirostat_eta") {
+            params.mirostat_eta = std::stof(argv[++i]);
+        } else if (arg == "--json") {
+            params.grammar_json = true;
+        } else if (arg == "--regex") {
+            params.grammar_regex = argv[++i];
+        } else if (arg == "--draft-model") {
+            params.draft_model = argv[++i];
+        } else if (arg == "--draft") {
+            params.n_draft = std::stoi(argv[++i]);
+        } else if (arg == "-c" || arg == "--ctx_size") {
+            params.n_ctx = std::stoi(argv[++i]);
         } else if (arg == "-b" || arg == "--batch_size") {
             params.n_batch = std::stoi(argv[++i]);
         } else if (arg == "-m" || arg == "--model") {
             params.model = argv[++i];
+        } else if (arg == "--no-mmap") {
+            params.use_mmap = false;
+        } else if (arg == "--huge-pages") {
+            params.use_huge_pages = true;
+        } else if (arg == "--numa") {
+            const std::string strategy = argv[++i];
+            if (strategy == "interleave") {
+                params.numa = LLAMA_NUMA_INTERLEAVE;
+            } else if (strategy == "partition") {
+                params.numa = LLAMA_NUMA_PARTITION;
+            } else {
+                fprintf(stderr, "error: unknown NUMA strategy: %s\n", strategy.c_str());
+                gpt_print_usage(argc, argv, params);
+                exit(0);
+            }
+        } else if (arg == "--stream-layers") {
+            params.n_stream_layers = std::stoi(argv[++i]);
         } else if (arg == "-i" || arg == "--interactive") {
             params.interactive = true;
         } else if (arg == "--interactive-start") {
@@ -92,10 +158,30 @@ void gpt_print_usage(int argc, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --top_p N             top-p sampling (default: %.1f)\n", params.top_p);
     fprintf(stderr, "  --repeat_last_n N     last n tokens to consider for penalize (default: %d)\n", params.repeat_last_n);
     fprintf(stderr, "  --repeat_penalty N    penalize repeat sequence of tokens (default: %.1f)\n", params.repeat_penalty);
-    fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", params.temp);
+    fprintf(stderr, "  --frequency_penalty N penalize each repeat of a token in the last n tokens (default: %.1f)\n", params.frequency_penalty);
+    fprintf(stderr, "  --presence_penalty N  penalize the tokens present in the last n tokens (default: %.1f)\n", params.presence_penalty);
+    fprintf(stderr, "  --temp N              temperature, 0 picks the most likely token (default: %.1f)\n", params.temp);
+    fprintf(stderr, "  --typical_p N         locally typical sampling, 1.0 = disabled (default: %.1f)\n", params.typical_p);
+    fprintf(stderr, "  --tfs N               tail free sampling, 1.0 = disabled (default: %.1f)\n", params.tfs_z);
+    fprintf(stderr, "  --mirostat N          mirostat sampling in place of top-k, tail free, typical and top-p:\n");
+    fprintf(stderr, "                        0 = disabled, 1 = mirostat, 2 = mirostat 2.0 (default: %d)\n", params.mirostat);
+    fprintf(stderr, "  --mirostat_tau N      mirostat target surprise (default: %.1f)\n", params.mirostat_tau);
+    fprintf(stderr, "  --mirostat_eta N      mirostat learning rate (default: %.2f)\n", params.mirostat_eta);
+    fprintf(stderr, "  --json                constrain the generation to a JSON value\n");
+    fprintf(stderr, "  --regex PATTERN       constrain the generation to text that matches PATTERN whole\n");
+    fprintf(stderr, "  --draft-model FNAME   speculative decoding: a small model of the same vocab proposes the tokens, which\n");
+    fprintf(stderr, "                        the model checks in one batch, distributed as if it had sampled them itself\n");
+    fprintf(stderr, "  --draft N             tokens proposed at a time by the draft model, at most the batch size (default: %d)\n", params.n_draft);
+    fprintf(stderr, "  -c N, --ctx_size N    size of the prompt context (default: %d)\n", params.n_ctx);
     fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  --no-mmap             read the model into memory instead of memory-mapping it\n");
+    fprintf(stderr, "  --huge-pages          allocate the model context and the session buffers from 2 MB pages\n");
+    fprintf(stderr, "  --numa STRATEGY       place the weights on the NUMA nodes: interleave, or partition the rows of\n");
+    fprintf(stderr, "                        every weight and pin the compute threads to match\n");
+    fprintf(stderr, "  --stream-layers N     keep only N decoder layers in memory and read the others from the model file\n");
+    fprintf(stderr, "                        while the preceding ones are computed, for models larger than RAM (default: all)\n");
     fprintf(stderr, "\n");
 }
 
@@ -126,129 +212,401 @@ void replace(std::string & str, const std::string & needle, const std::string &
     }
 }
 
-std::map<std::string, int32_t> json_parse(const std::string & fname) {
-    std::map<std::string, int32_t> result;
+// write a code point as UTF-8, returns the number of bytes
+static size_t json_utf8_encode(uint32_t cp, char * out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
 
-    // read file into string
-    std::string json;
-    {
-        std::ifstream ifs(fname);
-        if (!ifs) {
-            fprintf(stderr, "Failed to open %s\n", fname.c_str());
-            exit(1);
-        }
+// the value of the 4 hex digits at p, or -1
+static int32_t json_hex4(const char * p, const char * end) {
+    if (end - p < 4) {
+        return -1;
+    }
 
-        json = std::string((std::istreambuf_iterator<char>(ifs)),
-                (std::istreambuf_iterator<char>()));
+    int32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char c = p[i];
+        v <<= 4;
+        if      (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
     }
 
-    if (json[0] != '{') {
-        return result;
+    return v;
+}
+
+static const char * json_skip_ws(const char * p, const char * end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        ++p;
     }
+    return p;
+}
 
-    // parse json
-    {
-        bool has_key  = false;
-        bool in_token = false;
+// decode the string that starts after the opening quote at p over itself - an escape never takes fewer bytes than
+// what it decodes to, so the decoded string ends at or before the closing quote
+//
+// returns the position after the closing quote and sets the length of the decoded string, or null if the string is
+// not valid
+static char * json_decode_string(char * p, const char * end, size_t & n) {
+    char * out = p;
+    const char * const begin = p;
 
-        std::string str_key = "";
-        std::string str_val = "";
+    while (p < end && *p != '"') {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
 
-        int n = json.size();
-        for (int i = 1; i < n; ++i) {
-            if (!in_token) {
-                if (json[i] == ' ') continue;
-                if (json[i] == '"') {
-                    in_token = true;
-                    continue;
-                }
-            } else {
-                if (json[i] == '\\' && i+1 < n) {
-                    if (has_key == false) {
-                        str_key += json[i];
-                    } else {
-                        str_val += json[i];
+        if (++p == end) {
+            return nullptr;
+        }
+
+        switch (*p++) {
+            case '"':  *out++ = '"';  break;
+            case '\\': *out++ = '\\'; break;
+            case '/':  *out++ = '/';  break;
+            case 'b':  *out++ = '\b'; break;
+            case 'f':  *out++ = '\f'; break;
+            case 'n':  *out++ = '\n'; break;
+            case 'r':  *out++ = '\r'; break;
+            case 't':  *out++ = '\t'; break;
+            case 'u':
+                {
+                    int32_t cp = json_hex4(p, end);
+                    if (cp < 0) {
+                        return nullptr;
                     }
-                    ++i;
-                } else if (json[i] == '"') {
-                    if (has_key == false) {
-                        has_key = true;
-                        ++i;
-                        while (json[i] == ' ') ++i;
-                        ++i; // :
-                        while (json[i] == ' ') ++i;
-                        if (json[i] != '\"') {
-                            while (json[i] != ',' && json[i] != '}') {
-                                str_val += json[i++];
-                            }
-                            has_key = false;
-                        } else {
-                            in_token = true;
-                            continue;
+                    p += 4;
+
+                    // a surrogate pair
+                    if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                        const int32_t lo = json_hex4(p + 2, end);
+                        if (lo >= 0xdc00 && lo < 0xe000) {
+                            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                            p += 6;
                         }
+                    }
+
+                    // GPT-2 maps the bytes of the space and the new line to these
+                    if (cp == 0x0120) {
+                        *out++ = ' ';
+                    } else if (cp == 0x010a) {
+                        *out++ = '\n';
                     } else {
-                        has_key = false;
+                        out += json_utf8_encode(cp, out);
                     }
+                } break;
+            default:
+                return nullptr;
+        }
+    }
 
-                    ::replace(str_key, "\\u0120", " " ); // \u0120 -> space
-                    ::replace(str_key, "\\u010a", "\n"); // \u010a -> new line
-                    ::replace(str_key, "\\\"",    "\""); // \\\"   -> "
+    if (p == end) {
+        return nullptr;
+    }
 
-                    try {
-                        result[str_key] = std::stoi(str_val);
-                    } catch (...) {
-                        //fprintf(stderr, "%s: ignoring key '%s' with value '%s'\n", fname.c_str(), str_key.c_str(), str_val.c_str());
+    n = out - begin;
 
-                    }
-                    str_key = "";
-                    str_val = "";
-                    in_token = false;
-                    continue;
+    return p + 1;
+}
+
+// skip the value at p, returns the position after it or null if it is not valid
+static const char * json_skip_value(const char * p, const char * end) {
+    int depth = 0;
+
+    do {
+        p = json_skip_ws(p, end);
+        if (p == end) {
+            return nullptr;
+        }
+
+        if (*p == '"') {
+            for (++p; p < end && *p != '"'; ++p) {
+                if (*p == '\\') {
+                    ++p;
                 }
-                if (has_key == false) {
-                    str_key += json[i];
-                } else {
-                    str_val += json[i];
+            }
+            if (p >= end) {
+                return nullptr;
+            }
+            ++p;
+        } else if (*p == '{' || *p == '[') {
+            ++depth;
+            ++p;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) {
+                return nullptr;
+            }
+            --depth;
+            ++p;
+        } else {
+            // a number or a literal, or a comma or colon inside an object or array
+            const char * const start = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != '"' && *p != '{' && *p != '[' &&
+                   *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+                ++p;
+            }
+            if (p == start) {
+                if (depth == 0) {
+                    return nullptr;
                 }
+                ++p;
             }
         }
-    }
+    } while (depth > 0);
 
-    return result;
+    return p;
 }
 
-std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+static bool json_parse_error(const std::string & fname, const char * what, size_t offset) {
+    fprintf(stderr, "json_parse: %s at offset %zu of '%s'\n", what, offset, fname.c_str());
+    return false;
+}
 
-    // first split the text into words
+bool json_parse(const std::string & fname, gpt_vocab & vocab) {
+    // read the whole file at once
+    std::string json;
     {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+        std::ifstream ifs(fname, std::ios::binary | std::ios::ate);
+        if (!ifs) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+            return false;
+        }
+
+        json.resize(ifs.tellg());
+        ifs.seekg(0);
+        if (!ifs.read(&json[0], json.size())) {
+            fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname.c_str());
+            return false;
+        }
+    }
+
+    char * p = &json[0];
+    const char * const end = p + json.size();
+
+    // the id of each key, with the offset and length of the key in json, which the keys are decoded over
+    struct json_key {
+        int32_t id;
+        size_t  offset;
+        size_t  length;
+    };
+    std::vector<json_key> keys;
+
+    const auto error = [&](const char * what) {
+        return json_parse_error(fname, what, p - json.data());
+    };
+
+    p = (char *) json_skip_ws(p, end);
+    if (p == end || *p != '{') {
+        return error("expected '{'");
+    }
+    p = (char *) json_skip_ws(p + 1, end);
+
+    if (p < end && *p == '}') {
+        ++p;
+    } else {
+        while (true) {
+            if (p == end || *p != '"') {
+                return error("expected a key");
+            }
+
+            char * const key = p + 1;
+            size_t n_key = 0;
+            p = json_decode_string(key, end, n_key);
+            if (!p) {
+                p = key;
+                return error("invalid key");
+            }
 
-        std::regex re(pat);
-        std::smatch m;
+            p = (char *) json_skip_ws(p, end);
+            if (p == end || *p != ':') {
+                return error("expected ':'");
+            }
+            p = (char *) json_skip_ws(p + 1, end);
+
+            // the ids are integers, the keys of other values are ignored
+            const char * q = p;
+            bool neg = false;
+            if (q < end && *q == '-') {
+                neg = true;
+                ++q;
+            }
+            int64_t id = 0;
+            const char * const digits = q;
+            while (q < end && *q >= '0' && *q <= '9' && id <= INT32_MAX) {
+                id = 10*id + (*q++ - '0');
+            }
+
+            const bool is_id = q > digits && (q == end || (*q != '.' && *q != 'e' && *q != 'E' && (*q < '0' || *q > '9')));
+            if (is_id) {
+                p = (char *) q;
+                if (!neg && id <= INT32_MAX) {
+                    keys.push_back({ (int32_t) id, (size_t) (key - &json[0]), n_key });
+                }
+            } else {
+                const char * r = json_skip_value(p, end);
+                if (!r) {
+                    return error("invalid value");
+                }
+                p = (char *) r;
+            }
+
+            p = (char *) json_skip_ws(p, end);
+            if (p < end && *p == ',') {
+                p = (char *) json_skip_ws(p + 1, end);
+                continue;
+            }
+            if (p < end && *p == '}') {
+                ++p;
+                break;
+            }
+
+            return error("expected ',' or '}'");
+        }
+    }
+
+    if (json_skip_ws(p, end) != end) {
+        return error("unexpected data after the object");
+    }
+
+    // the ids are sized by the number of keys, not by the largest id in the file: an id past them is an error, and an
+    // id that repeats leaves another one missing, which gets an empty token
+    std::vector<const json_key *> by_id(keys.size(), nullptr);
+    for (const auto & key : keys) {
+        if (key.id >= (int32_t) keys.size()) {
+            fprintf(stderr, "%s: id %d out of range for %zu tokens in '%s'\n", __func__, key.id, keys.size(), fname.c_str());
+            return false;
+        }
+        by_id[key.id] = &key;
+    }
+
+    // the tokens in the order of their ids
+    vocab = gpt_vocab();
+    vocab.arena.reserve(json.size());
+    vocab.offsets.reserve(keys.size() + 1);
+    for (const json_key * key : by_id) {
+        if (key) {
+            gpt_vocab_add(vocab, json.data() + key->offset, key->length);
+        } else {
+            gpt_vocab_add(vocab, "", 0);
+        }
+    }
+
+    return true;
+}
+
+// classes of the bytes in the split pattern of gpt_tokenize()
+enum gpt_char_class {
+    GPT_CHAR_SPACE,
+    GPT_CHAR_ALPHA,
+    GPT_CHAR_DIGIT,
+    GPT_CHAR_OTHER,
+};
+
+static gpt_char_class gpt_classify(char c) {
+    if (c == ' ' || (c >= '\t' && c <= '\r')) {
+        return GPT_CHAR_SPACE;
+    }
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        return GPT_CHAR_ALPHA;
+    }
+    if (c >= '0' && c <= '9') {
+        return GPT_CHAR_DIGIT;
+    }
+    return GPT_CHAR_OTHER;
+}
+
+void gpt_split_words(const std::string & text, std::vector<std::pair<size_t, size_t>> & words) {
+    words.clear();
+
+    const char * s = text.data();
+    const size_t n = text.size();
+
+    // end of the run of bytes of the given class that starts at i
+    auto run = [&](size_t i, gpt_char_class cls) {
+        while (i < n && gpt_classify(s[i]) == cls) {
+            ++i;
+        }
+        return i;
+    };
+
+    size_t i = 0;
+    while (i < n) {
+        size_t end = i;
+
+        // the alternatives of the pattern in order, the first one that matches at i wins
+        if (s[i] == '\'') {
+            const char * c = s + i + 1;
+            const size_t left = n - i - 1;
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+            if (left >= 1 && (c[0] == 's' || c[0] == 't' || c[0] == 'm' || c[0] == 'd')) {
+                end = i + 2;
+            } else if (left >= 2 && ((c[0] == 'r' && c[1] == 'e') || (c[0] == 'v' && c[1] == 'e') || (c[0] == 'l' && c[1] == 'l'))) {
+                end = i + 3;
             }
-            str = m.suffix();
         }
+
+        if (end == i) {
+            const gpt_char_class cls = gpt_classify(s[i]);
+
+            if (cls != GPT_CHAR_SPACE) {
+                // [[:alpha:]]+, [[:digit:]]+ or [^\s[:alpha:][:digit:]]+
+                end = run(i, cls);
+            } else if (s[i] == ' ' && i + 1 < n && gpt_classify(s[i + 1]) != GPT_CHAR_SPACE) {
+                // the same with a leading space
+                end = run(i + 1, gpt_classify(s[i + 1]));
+            } else {
+                // \s+(?!\S) takes the whitespace up to the last one before a non-space, \s+ a single one
+                end = run(i, GPT_CHAR_SPACE);
+                if (end < n && end - i > 1) {
+                    end--;
+                }
+            }
+        }
+
+        words.emplace_back(i, end - i);
+        i = end;
     }
+}
+
+std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
+    // first split the text into words
+    std::vector<std::pair<size_t, size_t>> words;
+    gpt_split_words(text, words);
 
     // find the longest tokens that form the words:
     std::vector<gpt_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.size() == 0) continue;
+    for (const auto & w : words) {
+        const char * word = text.data() + w.first;
 
         int i = 0;
-        int n = word.size();
+        int n = w.second;
         while (i < n) {
             int j = n;
             while (j > i) {
-                auto it = vocab.token_to_id.find(word.substr(i, j-i));
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
+                gpt_vocab::id id = 0;
+                if (gpt_vocab_find(vocab, word + i, j - i, id)) {
+                    tokens.push_back(id);
                     i = j;
                     break;
                 }
@@ -258,11 +616,11 @@ std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::stri
                 break;
             }
             if (j == i) {
-                auto sub = word.substr(i, 1);
-                if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-                    tokens.push_back(vocab.token_to_id.at(sub));
+                gpt_vocab::id id = 0;
+                if (gpt_vocab_find(vocab, word + i, 1, id)) {
+                    tokens.push_back(id);
                 } else {
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
+                    fprintf(stderr, "%s: unknown token '%c'\n", __func__, word[i]);
                 }
                 ++i;
             }
@@ -272,161 +630,3413 @@ std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::stri
     return tokens;
 }
 
-std::vector<gpt_vocab::id> llama_tokenize(const gpt_vocab & vocab, const std::string & text, bool bos) {
-    //auto res = gpt_tokenize(vocab, text);
+void gpt_vocab_add(gpt_vocab & vocab, const char * text, size_t n) {
+    vocab.arena.append(text, n);
+    vocab.offsets.push_back(vocab.arena.size());
+}
 
-    //if (bos) {
-    //    res.insert(res.begin(), 1); // TODO: replace with vocab.bos
-    //}
+// FNV-1a
+static uint64_t gpt_vocab_hash(const char * text, size_t n) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (uint8_t) text[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
 
-    std::vector<gpt_vocab::id> res;
+static void gpt_vocab_build_table(gpt_vocab & vocab) {
+    const int n_vocab = vocab.size();
 
-    if (bos) {
-        res.push_back(1); // TODO: replace with vocab.bos
+    // at most half full
+    size_t n_slots = 16;
+    while (n_slots < 2*(size_t) n_vocab) {
+        n_slots *= 2;
     }
 
-     //find the longest token that matches the text
-    int pos = 0;
-    while (true) {
-        int l = 0;
-        int t = 0;
-        for (const auto & kv : vocab.id_to_token) {
-            if (kv.second.size() < l) continue;
-            if (kv.second.size() > text.size() - pos) continue;
-            if (text.substr(pos, kv.second.size()) == kv.second) {
-                l = kv.second.size();
-                t = kv.first;
+    vocab.table.assign(n_slots, -1);
+
+    for (gpt_vocab::id i = 0; i < n_vocab; ++i) {
+        const auto text = vocab.text(i);
+
+        size_t slot = gpt_vocab_hash(text.data, text.size) & (n_slots - 1);
+        while (vocab.table[slot] != -1) {
+            const auto other = vocab.text(vocab.table[slot]);
+            if (other.size == text.size && memcmp(other.data, text.data, text.size) == 0) {
+                break;
             }
+            slot = (slot + 1) & (n_slots - 1);
         }
 
-        if (l == 0) {
-            break;
-        }
+        vocab.table[slot] = i;
+    }
+}
 
-        res.push_back(t);
-        pos += l;
+static void gpt_vocab_build_trie(gpt_vocab & vocab) {
+    gpt_vocab_trie & trie = vocab.trie;
+
+    // insert the tokens into a trie of maps, in the order of their ids
+    std::vector<int32_t> ids(1, -1);
+    std::vector<std::map<uint8_t, uint32_t>> children(1);
+
+    for (gpt_vocab::id i = 0; i < vocab.size(); ++i) {
+        const auto text = vocab.text(i);
+
+        uint32_t cur = 0;
+        for (size_t j = 0; j < text.size; ++j) {
+            const uint8_t c = text.data[j];
+
+            auto it = children[cur].find(c);
+            if (it == children[cur].end()) {
+                it = children[cur].emplace(c, (uint32_t) ids.size()).first;
+                ids.push_back(-1);
+                children.emplace_back();
+            }
+            cur = it->second;
+        }
+        if (cur != 0) {
+            ids[cur] = i;
+        }
     }
 
-    return res;
-}
+    // then flatten it, keeping the node numbers
+    trie.nodes.assign(ids.size(), gpt_vocab_trie::node());
+    trie.edges.clear();
+    trie.edges.reserve(ids.size() - 1);
 
-bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
-    printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        auto & node = trie.nodes[i];
 
-    vocab.token_to_id = ::json_parse(fname);
+        node.id      = ids[i];
+        node.edges   = trie.edges.size();
+        node.n_edges = children[i].size();
 
-    for (const auto & kv : vocab.token_to_id) {
-        vocab.id_to_token[kv.second] = kv.first;
+        for (const auto & kv : children[i]) {
+            trie.edges.push_back({ kv.first, kv.second });
+        }
     }
 
-    printf("%s: vocab size = %d\n", __func__, (int) vocab.token_to_id.size());
+    std::fill(std::begin(trie.root), std::end(trie.root), 0);
+    for (const auto & kv : children[0]) {
+        trie.root[kv.first] = kv.second;
+    }
+}
 
-    // print the vocabulary
-    //for (auto kv : vocab.token_to_id) {
-    //    printf("'%s' -> %d\n", kv.first.data(), kv.second);
-    //}
+void gpt_vocab_build(gpt_vocab & vocab) {
+    gpt_vocab_build_table(vocab);
+    gpt_vocab_build_trie(vocab);
+}
 
-    return true;
+bool gpt_vocab_find(const gpt_vocab & vocab, const char * text, size_t n, gpt_vocab::id & id) {
+    const size_t n_slots = vocab.table.size();
+    if (n_slots == 0) {
+        return false;
+    }
+
+    size_t slot = gpt_vocab_hash(text, n) & (n_slots - 1);
+    while (vocab.table[slot] != -1) {
+        const auto other = vocab.text(vocab.table[slot]);
+        if (other.size == n && memcmp(other.data, text, n) == 0) {
+            id = vocab.table[slot];
+            return true;
+        }
+        slot = (slot + 1) & (n_slots - 1);
+    }
+
+    return false;
 }
 
+// the node reached from a node of the trie by a byte, or 0 if none
+static uint32_t gpt_vocab_trie_next(const gpt_vocab_trie & trie, uint32_t cur, uint8_t byte) {
+    if (cur == 0) {
+        return trie.root[byte];
+    }
 
-void sample_top_k(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, int top_k) {
-    // find the top K tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
-        return a.first > b.first;
+    const auto & node = trie.nodes[cur];
+
+    // the edges of a node are few, except near the root
+    const auto * first = trie.edges.data() + node.edges;
+    const auto * last  = first + node.n_edges;
+    const auto * edge  = std::lower_bound(first, last, byte, [](const gpt_vocab_trie::edge & e, uint8_t b) {
+        return e.byte < b;
     });
 
-    logits_id.resize(top_k);
+    return edge != last && edge->byte == byte ? edge->node : 0;
 }
 
-gpt_vocab::id llama_sample_top_p_top_k(
-        const gpt_vocab & vocab,
-        const float * logits,
-        std::vector<gpt_vocab::id> & last_n_tokens,
-        double repeat_penalty,
-        int top_k,
-        double top_p,
-        double temp,
-        std::mt19937 & rng) {
-    int n_logits = vocab.id_to_token.size();
+size_t gpt_vocab_trie_match(const gpt_vocab_trie & trie, const char * text, size_t n, gpt_vocab::id & id) {
+    size_t len = 0;
 
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    if (n == 0 || trie.nodes.empty()) {
+        return 0;
+    }
 
-    {
-        const double scale = 1.0/temp;
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from CTRL paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (logits[i] < 0.0) {
-                    logits_id.push_back(std::make_pair(logits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(logits[i]*scale/repeat_penalty, i));
-                }                
-            } else {
-                logits_id.push_back(std::make_pair(logits[i]*scale, i));
-            }
+    uint32_t cur = trie.root[(uint8_t) text[0]];
+
+    for (size_t i = 1; cur != 0; ++i) {
+        const auto & node = trie.nodes[cur];
+
+        if (node.id >= 0) {
+            len = i;
+            id  = node.id;
+        }
+
+        if (i == n || node.n_edges == 0) {
+            break;
         }
+
+        cur = gpt_vocab_trie_next(trie, cur, (uint8_t) text[i]);
     }
 
-    sample_top_k(logits_id, top_k);
+    return len;
+}
 
-    double maxl = -INFINITY;
-    for (const auto & kv : logits_id) {
-        maxl = std::max(maxl, kv.first);
+// a piece of the text during the merges of llama_tokenize(), in a list of the pieces left
+struct llama_sp_symbol {
+    int prev;
+    int next;
+
+    const char * text;
+    size_t n; // 0 once merged into the symbol on its left
+};
+
+// two adjacent symbols whose text is a token
+struct llama_sp_bigram {
+    int left;
+    int right;
+
+    float  score;
+    size_t size; // of the text of the two symbols when the bigram was queued
+
+    // the highest score first, then the leftmost bigram
+    bool operator<(const llama_sp_bigram & other) const {
+        return score < other.score || (score == other.score && left > other.left);
     }
+};
 
-    // compute probs for the top K tokens
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+// length of the UTF-8 character that starts with the given byte
+static size_t llama_utf8_len(char c) {
+    static const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
+    return lookup[(uint8_t) c >> 4];
+}
 
-    double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        double p = exp(kv.first - maxl);
-        probs.push_back(p);
-        sum += p;
+static std::vector<gpt_vocab::id> llama_tokenize_bpe(const gpt_vocab & vocab, const std::string & text) {
+    std::vector<gpt_vocab::id> res;
+
+    // one symbol per character
+    std::vector<llama_sp_symbol> symbols;
+    symbols.reserve(text.size());
+
+    for (size_t offs = 0; offs < text.size(); ) {
+        const size_t n = std::min(llama_utf8_len(text[offs]), text.size() - offs);
+
+        symbols.push_back({ (int) symbols.size() - 1, (int) symbols.size() + 1, text.data() + offs, n });
+        offs += n;
     }
 
-    // normalize the probs
-    for (auto & p : probs) {
-        p /= sum;
+    if (symbols.empty()) {
+        return res;
     }
 
-    if (top_p < 1.0f) {
-        double cumsum = 0.0f;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            cumsum += probs[i];
-            if (cumsum >= top_p) {
-                probs.resize(i + 1);
-                logits_id.resize(i + 1);
-                break;
-            }
+    symbols.back().next = -1;
+
+    std::priority_queue<llama_sp_bigram> queue;
+
+    auto try_add_bigram = [&](int left, int right) {
+        if (left == -1 || right == -1) {
+            return;
         }
 
-        cumsum = 1.0/cumsum;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            probs[i] *= cumsum;
+        // the text of adjacent symbols is contiguous
+        const size_t size = symbols[left].n + symbols[right].n;
+
+        gpt_vocab::id id = 0;
+        if (!gpt_vocab_find(vocab, symbols[left].text, size, id) || id >= (int) vocab.scores.size()) {
+            return;
         }
+
+        queue.push({ left, right, vocab.scores[id], size });
+    };
+
+    for (int i = 1; i < (int) symbols.size(); ++i) {
+        try_add_bigram(i - 1, i);
     }
 
-    //printf("\n");
-    //for (int i = 0; i < (int) 10; i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), probs[i]);
-    //}
-    //printf("\n\n");
-    //exit(0);
+    // merge the best bigram until none is left
+    while (!queue.empty()) {
+        const llama_sp_bigram bigram = queue.top();
+        queue.pop();
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+        auto & left  = symbols[bigram.left];
+        auto & right = symbols[bigram.right];
 
-    return logits_id[idx].second;
-}
+        // skip the bigrams that an earlier merge made stale
+        if (left.n == 0 || right.n == 0 || left.n + right.n != bigram.size) {
+            continue;
+        }
+
+        left.n += right.n;
+        right.n = 0;
+
+        left.next = right.next;
+        if (right.next >= 0) {
+            symbols[right.next].prev = bigram.left;
+        }
+
+        try_add_bigram(left.prev, bigram.left);
+        try_add_bigram(bigram.left, left.next);
+    }
+
+    for (int i = 0; i != -1; i = symbols[i].next) {
+        const auto & symbol = symbols[i];
+
+        gpt_vocab::id id = 0;
+        if (gpt_vocab_find(vocab, symbol.text, symbol.n, id)) {
+            res.push_back(id);
+            continue;
+        }
+
+        // not a token, fall back to the tokens of its bytes
+        for (size_t j = 0; j < symbol.n; ++j) {
+            if (gpt_vocab_find(vocab, symbol.text + j, 1, id)) {
+                res.push_back(id);
+            } else {
+                fprintf(stderr, "%s: unknown byte 0x%02x\n", __func__, (uint8_t) symbol.text[j]);
+            }
+        }
+    }
 
+    return res;
+}
+
+std::vector<gpt_vocab::id> llama_tokenize(const gpt_vocab & vocab, const std::string & text, bool bos) {
+    std::vector<gpt_vocab::id> res;
+
+    if (bos) {
+        res.push_back(LLAMA_TOKEN_BOS); // TODO: replace with vocab.bos
+    }
+
+    // a vocab that was not built is built on a copy
+    if (vocab.table.empty() && vocab.size() > 0) {
+        gpt_vocab tmp = vocab;
+        gpt_vocab_build(tmp);
+
+        return llama_tokenize(tmp, text, bos);
+    }
+
+    if (!vocab.scores.empty()) {
+        const auto tokens = llama_tokenize_bpe(vocab, text);
+        res.insert(res.end(), tokens.begin(), tokens.end());
+        return res;
+    }
+
+    // find the longest token that matches the text
+    size_t pos = 0;
+    while (pos < text.size()) {
+        gpt_vocab::id t = 0;
+
+        const size_t l = gpt_vocab_trie_match(vocab.trie, text.data() + pos, text.size() - pos, t);
+        if (l == 0) {
+            break;
+        }
+
+        res.push_back(t);
+        pos += l;
+    }
+
+    return res;
+}
+
+bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
+    printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
+
+    if (!json_parse(fname, vocab)) {
+        return false;
+    }
+
+    gpt_vocab_build(vocab);
+
+    printf("%s: vocab size = %d\n", __func__, vocab.size());
+
+    // print the vocabulary
+    //for (int i = 0; i < vocab.size(); i++) {
+    //    printf("'%s' -> %d\n", vocab.text(i).str().c_str(), i);
+    //}
+
+    return true;
+}
+
+//
+// Grammars
+//
+
+// the most states that the DFA of a grammar and the NFA of a regex may have
+#define LLAMA_GRAMMAR_MAX_STATES 65536
+#define LLAMA_REGEX_MAX_STATES   65536
+
+// a DFA with a transition for each of the 256 bytes, as the grammars are compiled to before llama_grammar_build()
+struct llama_grammar_dfa {
+    std::vector<int32_t> next; // next[state*256 + byte], -1 if the byte is not allowed
+    std::vector<uint8_t> accepting;
+
+    int size() const {
+        return accepting.size();
+    }
+};
+
+// make the grammar of a DFA for the tokens of the vocab: the states from which the text can never end are dropped,
+// and the bytes with the same transitions in every state grouped into a class
+static bool llama_grammar_build(llama_grammar & grammar, const gpt_vocab & vocab, const llama_grammar_dfa & dfa, std::string & error) {
+    if (vocab.size() > 0 && vocab.table.empty()) {
+        error = "the vocab of the grammar is not built";
+        return false;
+    }
+
+    const int n = dfa.size();
+
+    // the states that reach an accepting one, found backwards from those through the transitions into each state
+    std::vector<uint32_t> first(n + 1, 0);
+    for (const int32_t t : dfa.next) {
+        if (t >= 0) {
+            first[t + 1]++;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        first[i + 1] += first[i];
+    }
+
+    std::vector<int32_t> from(first[n]);
+    {
+        std::vector<uint32_t> pos(first.begin(), first.end() - 1);
+        for (size_t i = 0; i < dfa.next.size(); ++i) {
+            const int32_t t = dfa.next[i];
+            if (t >= 0) {
+                from[pos[t]++] = i/256;
+            }
+        }
+    }
+
+    std::vector<uint8_t> live(dfa.accepting);
+    std::vector<int32_t> queue;
+    for (int i = 0; i < n; ++i) {
+        if (live[i]) {
+            queue.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < queue.size(); ++i) {
+        for (uint32_t j = first[queue[i]]; j < first[queue[i] + 1]; ++j) {
+            if (!live[from[j]]) {
+                live[from[j]] = 1;
+                queue.push_back(from[j]);
+            }
+        }
+    }
+
+    if (n == 0 || !live[0]) {
+        error = "the grammar matches no text";
+        return false;
+    }
+
+    // the live states keep their order, so the start state stays first
+    std::vector<int32_t> index(n, -1);
+    int n_live = 0;
+    for (int i = 0; i < n; ++i) {
+        if (live[i]) {
+            index[i] = n_live++;
+        }
+    }
+
+    // the classes of the bytes, by their column of transitions
+    std::map<std::vector<int32_t>, int> columns;
+    for (int c = 0; c < 256; ++c) {
+        std::vector<int32_t> column(n_live);
+        for (int i = 0; i < n; ++i) {
+            if (live[i]) {
+                const int32_t t = dfa.next[i*256 + c];
+                column[index[i]] = t >= 0 ? index[t] : -1;
+            }
+        }
+
+        const auto it = columns.emplace(std::move(column), (int) columns.size()).first;
+        grammar.classes[c] = it->second;
+    }
+
+    grammar.vocab     = &vocab;
+    grammar.n_states  = n_live;
+    grammar.n_classes = columns.size();
+
+    grammar.next.assign((size_t) n_live*grammar.n_classes, -1);
+    for (const auto & kv : columns) {
+        for (int i = 0; i < n_live; ++i) {
+            grammar.next[(size_t) i*grammar.n_classes + kv.second] = kv.first[i];
+        }
+    }
+
+    grammar.accepting.resize(n_live);
+    for (int i = 0; i < n; ++i) {
+        if (live[i]) {
+            grammar.accepting[index[i]] = dfa.accepting[i];
+        }
+    }
+
+    grammar.n_words = (vocab.size() + 63)/64;
+    grammar.mask_index.assign(n_live, -1);
+    grammar.masks.clear();
+
+    grammar.aliases.clear();
+    for (gpt_vocab::id i = 0; i < vocab.size(); ++i) {
+        const auto text = vocab.text(i);
+
+        gpt_vocab::id id = i;
+        if (text.size > 0 && gpt_vocab_find(vocab, text.data, text.size, id) && id != i) {
+            grammar.aliases.push_back({ i, id });
+        }
+    }
+
+    return true;
+}
+
+// a set of bytes
+struct llama_regex_set {
+    uint64_t bits[4] = { 0, 0, 0, 0 };
+
+    bool has(uint8_t c) const {
+        return bits[c >> 6] >> (c & 63) & 1;
+    }
+
+    void add(uint8_t c) {
+        bits[c >> 6] |= 1ull << (c & 63);
+    }
+
+    void add(uint8_t lo, uint8_t hi) {
+        for (int c = lo; c <= hi; ++c) {
+            add(c);
+        }
+    }
+
+    void add(const llama_regex_set & other) {
+        for (int i = 0; i < 4; ++i) {
+            bits[i] |= other.bits[i];
+        }
+    }
+
+    void invert() {
+        for (int i = 0; i < 4; ++i) {
+            bits[i] = ~bits[i];
+        }
+    }
+};
+
+// a state of the NFA of a regex: a transition on the bytes of a set, or up to two on no byte
+struct llama_regex_state {
+    llama_regex_set bytes;
+    int32_t next   = -1;
+    int32_t eps[2] = { -1, -1 };
+};
+
+// a piece of the NFA, entered at start and left from end, which has no transitions yet
+struct llama_regex_fragment {
+    int32_t start;
+    int32_t end;
+};
+
+// the parser of a regex, which builds its Thompson NFA by recursive descent
+//
+// the quantifiers with bounds parse their atom again for every copy of it they need
+struct llama_regex_parser {
+    const std::string & pattern;
+    size_t pos = 0;
+
+    std::vector<llama_regex_state> states;
+    std::string error;
+
+    explicit llama_regex_parser(const std::string & pattern) : pattern(pattern) {}
+
+    bool at(char c) const {
+        return pos < pattern.size() && pattern[pos] == c;
+    }
+
+    bool fail(const char * msg) {
+        if (error.empty()) {
+            error = std::string(msg) + " at offset " + std::to_string(pos) + " of the regex";
+        }
+        return false;
+    }
+
+    // the states are no longer added once the parse failed, the fragments built after that are not used
+    int32_t add_state() {
+        if (!error.empty() || states.size() >= LLAMA_REGEX_MAX_STATES) {
+            fail("the regex is too large");
+            return 0;
+        }
+        states.emplace_back();
+        return states.size() - 1;
+    }
+
+    void link(int32_t from, int32_t to) {
+        auto & eps = states[from].eps;
+        eps[eps[0] < 0 ? 0 : 1] = to;
+    }
+
+    llama_regex_fragment empty() {
+        const int32_t s = add_state();
+        return { s, s };
+    }
+
+    llama_regex_fragment bytes(const llama_regex_set & set) {
+        const int32_t start = add_state();
+        const int32_t end   = add_state();
+        if (error.empty()) {
+            states[start].bytes = set;
+            states[start].next  = end;
+        }
+        return { start, end };
+    }
+
+    llama_regex_fragment concat(llama_regex_fragment a, llama_regex_fragment b) {
+        link(a.end, b.start);
+        return { a.start, b.end };
+    }
+
+    llama_regex_fragment alternate(llama_regex_fragment a, llama_regex_fragment b) {
+        const int32_t start = add_state();
+        const int32_t end   = add_state();
+        link(start, a.start);
+        link(start, b.start);
+        link(a.end, end);
+        link(b.end, end);
+        return { start, end };
+    }
+
+    // a*, or a+
+    llama_regex_fragment repeat(llama_regex_fragment a, bool at_least_once) {
+        const int32_t end = add_state();
+        link(a.end, a.start);
+        link(a.end, end);
+        if (at_least_once) {
+            return { a.start, end };
+        }
+        const int32_t start = add_state();
+        link(start, a.start);
+        link(start, end);
+        return { start, end };
+    }
+
+    llama_regex_fragment optional(llama_regex_fragment a) {
+        const int32_t start = add_state();
+        link(start, a.start);
+        link(start, a.end);
+        return { start, a.end };
+    }
+
+    // alternation := sequence ('|' sequence)*
+    llama_regex_fragment parse_alternation() {
+        llama_regex_fragment frag = parse_sequence();
+        while (error.empty() && at('|')) {
+            ++pos;
+            frag = alternate(frag, parse_sequence());
+        }
+        return frag;
+    }
+
+    // sequence := repetition*
+    llama_regex_fragment parse_sequence() {
+        llama_regex_fragment frag = empty();
+        while (error.empty() && pos < pattern.size() && !at('|') && !at(')')) {
+            frag = concat(frag, parse_repetition());
+        }
+        return frag;
+    }
+
+    // repetition := atom quantifier?
+    llama_regex_fragment parse_repetition() {
+        const size_t atom_pos = pos;
+
+        const llama_regex_fragment frag = parse_atom();
+        if (!error.empty()) {
+            return frag;
+        }
+
+        int min = 0;
+        int max = -1; // unbounded
+        if (at('*')) {
+            ++pos;
+        } else if (at('+')) {
+            ++pos;
+            min = 1;
+        } else if (at('?')) {
+            ++pos;
+            max = 1;
+        } else if (at('{')) {
+            if (!parse_bounds(min, max)) {
+                return frag;
+            }
+        } else {
+            return frag;
+        }
+
+        // a lazy quantifier matches the same texts
+        if (at('?')) {
+            ++pos;
+        }
+        if (at('*') || at('+') || at('?') || at('{')) {
+            fail("nothing to repeat");
+            return frag;
+        }
+
+        if (min == 0 && max < 0) {
+            return repeat(frag, false);
+        }
+        if (min == 1 && max < 0) {
+            return repeat(frag, true);
+        }
+        if (min == 0 && max == 1) {
+            return optional(frag);
+        }
+
+        // the atom parsed once more for every further copy
+        const size_t end_pos = pos;
+
+        bool first = true;
+        const auto copy = [&]() -> llama_regex_fragment {
+            if (first) {
+                first = false;
+                return frag;
+            }
+            pos = atom_pos;
+            const llama_regex_fragment f = parse_atom();
+            pos = end_pos;
+            return f;
+        };
+
+        llama_regex_fragment result = empty();
+        for (int i = 0; i < min && error.empty(); ++i) {
+            result = concat(result, copy());
+        }
+        if (max < 0) {
+            result = concat(result, repeat(copy(), false));
+        } else {
+            for (int i = min; i < max && error.empty(); ++i) {
+                result = concat(result, optional(copy()));
+            }
+        }
+
+        return result;
+    }
+
+    // {n}, {n,} or {n,m}
+    bool parse_bounds(int & min, int & max) {
+        ++pos;
+
+        const auto number = [&](int & value) -> bool {
+            const size_t start = pos;
+            value = 0;
+            while (pos < pattern.size() && isdigit((uint8_t) pattern[pos]) && value <= 1000) {
+                value = 10*value + (pattern[pos++] - '0');
+            }
+            return pos > start;
+        };
+
+        if (!number(min)) {
+            return fail("expected a number in the bounds");
+        }
+        max = min;
+        if (at(',')) {
+            ++pos;
+            if (!number(max)) {
+                max = -1;
+            }
+        }
+        if (!at('}')) {
+            return fail("expected } after the bounds");
+        }
+        ++pos;
+
+        if (min > 1000 || max > 1000 || (max >= 0 && max < min)) {
+            return fail("bad bounds");
+        }
+
+        return true;
+    }
+
+    // atom := '(' alternation ')' | class | '.' | escape | literal
+    llama_regex_fragment parse_atom() {
+        const char c = pattern[pos];
+
+        switch (c) {
+            case '(':
+                {
+                    ++pos;
+                    if (pattern.compare(pos, 2, "?:") == 0) {
+                        pos += 2;
+                    } else if (at('?')) {
+                        fail("lookarounds are not supported");
+                        return empty();
+                    }
+
+                    const llama_regex_fragment frag = parse_alternation();
+                    if (error.empty() && !at(')')) {
+                        fail("expected )");
+                    }
+                    ++pos;
+
+                    return frag;
+                }
+            case '[':
+                return parse_class();
+            case '.':
+                {
+                    ++pos;
+
+                    llama_regex_set set;
+                    set.add('\n');
+                    set.add('\r');
+                    set.invert();
+
+                    return bytes(set);
+                }
+            case '\\':
+                {
+                    llama_regex_set set;
+                    int single = -1;
+                    if (!parse_escape(set, single, false)) {
+                        return empty();
+                    }
+                    return bytes(set);
+                }
+            case '^':
+            case '$':
+                // the whole text is matched
+                if ((c == '^' && pos == 0) || (c == '$' && pos + 1 == pattern.size())) {
+                    ++pos;
+                    return empty();
+                }
+                fail("anchors are only supported at the ends of the regex");
+                return empty();
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                fail("nothing to repeat");
+                return empty();
+            default:
+                {
+                    ++pos;
+
+                    llama_regex_set set;
+                    set.add(c);
+
+                    return bytes(set);
+                }
+        }
+    }
+
+    // the bytes of an escape, and the byte if it stands for a single one
+    bool parse_escape(llama_regex_set & set, int & single, bool in_class) {
+        if (pos + 1 >= pattern.size()) {
+            return fail("trailing \\");
+        }
+
+        const char c = pattern[pos + 1];
+        pos += 2;
+
+        single = -1;
+
+        switch (c) {
+            case 'd': case 'D':
+                set.add('0', '9');
+                break;
+            case 'w': case 'W':
+                set.add('a', 'z');
+                set.add('A', 'Z');
+                set.add('0', '9');
+                set.add('_');
+                break;
+            case 's': case 'S':
+                for (const char * s = " \t\n\r\v\f"; *s; ++s) {
+                    set.add(*s);
+                }
+                break;
+            case 'n': single = '\n'; break;
+            case 't': single = '\t'; break;
+            case 'r': single = '\r'; break;
+            case 'v': single = '\v'; break;
+            case 'f': single = '\f'; break;
+            case '0': single = '\0'; break;
+            case 'x':
+                {
+                    const auto hex = [](char h) {
+                        return h >= '0' && h <= '9' ? h - '0' : h >= 'a' && h <= 'f' ? h - 'a' + 10 : h >= 'A' && h <= 'F' ? h - 'A' + 10 : -1;
+                    };
+                    if (pos + 2 > pattern.size() || hex(pattern[pos]) < 0 || hex(pattern[pos + 1]) < 0) {
+                        return fail("expected two hex digits after \\x");
+                    }
+                    single = 16*hex(pattern[pos]) + hex(pattern[pos + 1]);
+                    pos += 2;
+                    break;
+                }
+            case 'b':
+                if (in_class) {
+                    single = '\b';
+                    break;
+                }
+                return fail("word boundaries are not supported");
+            default:
+                if (isalnum((uint8_t) c)) {
+                    return fail("unsupported escape");
+                }
+                single = (uint8_t) c;
+                break;
+        }
+
+        if (single >= 0) {
+            set.add(single);
+        } else if (isupper((uint8_t) c)) {
+            set.invert();
+        }
+
+        return true;
+    }
+
+    // '[' '^'? (byte | escape | byte '-' byte)* ']'
+    llama_regex_fragment parse_class() {
+        ++pos;
+
+        bool negate = false;
+        if (at('^')) {
+            negate = true;
+            ++pos;
+        }
+
+        llama_regex_set set;
+        while (!at(']')) {
+            if (pos >= pattern.size()) {
+                fail("expected ]");
+                return empty();
+            }
+
+            llama_regex_set item;
+            int lo = -1;
+            if (at('\\')) {
+                if (!parse_escape(item, lo, true)) {
+                    return empty();
+                }
+            } else {
+                lo = (uint8_t) pattern[pos++];
+                item.add(lo);
+            }
+
+            // a range, unless the - ends the class
+            if (lo >= 0 && at('-') && pos + 1 < pattern.size() && pattern[pos + 1] != ']') {
+                ++pos;
+
+                int hi = -1;
+                if (at('\\')) {
+                    llama_regex_set tmp;
+                    if (!parse_escape(tmp, hi, true)) {
+                        return empty();
+                    }
+                } else {
+                    hi = (uint8_t) pattern[pos++];
+                }
+
+                if (hi < lo) {
+                    fail("bad range");
+                    return empty();
+                }
+                item.add(lo, hi);
+            }
+
+            set.add(item);
+        }
+        ++pos;
+
+        if (negate) {
+            set.invert();
+        }
+
+        return bytes(set);
+    }
+};
+
+bool llama_grammar_regex(llama_grammar & grammar, const gpt_vocab & vocab, const std::string & pattern, std::string & error) {
+    llama_regex_parser parser(pattern);
+
+    const llama_regex_fragment frag = parser.parse_alternation();
+    if (parser.error.empty() && parser.pos < pattern.size()) {
+        parser.fail("unmatched )");
+    }
+    if (!parser.error.empty()) {
+        error = parser.error;
+        return false;
+    }
+
+    const auto & states = parser.states;
+    const int32_t accept = frag.end;
+
+    // the classes of the bytes: those that the set of every state holds or not together
+    uint8_t classes[256] = { 0 };
+    int n_classes = 1;
+
+    for (const auto & state : states) {
+        if (state.next < 0) {
+            continue;
+        }
+
+        int remap[512];
+        std::fill(remap, remap + 2*n_classes, -1);
+
+        int n = 0;
+        for (int c = 0; c < 256; ++c) {
+            int & k = remap[2*classes[c] + state.bytes.has(c)];
+            if (k < 0) {
+                k = n++;
+            }
+            classes[c] = k;
+        }
+        n_classes = n;
+    }
+
+    // the subset construction: a state of the DFA is the set of states of the NFA it can be in - only those with a
+    // transition on bytes, and the accepting one, tell the sets apart
+    std::vector<uint32_t> mark(states.size(), 0);
+    uint32_t epoch = 0;
+
+    std::vector<int32_t> stack;
+
+    const auto closure = [&](std::vector<int32_t> & set) {
+        ++epoch;
+
+        stack = set;
+        set.clear();
+        for (const int32_t s : stack) {
+            mark[s] = epoch;
+        }
+
+        while (!stack.empty()) {
+            const int32_t s = stack.back();
+            stack.pop_back();
+
+            if (states[s].next >= 0 || s == accept) {
+                set.push_back(s);
+            }
+            for (const int32_t t : states[s].eps) {
+                if (t >= 0 && mark[t] != epoch) {
+                    mark[t] = epoch;
+                    stack.push_back(t);
+                }
+            }
+        }
+
+        std::sort(set.begin(), set.end());
+    };
+
+    std::map<std::vector<int32_t>, int32_t> ids;
+    std::vector<const std::vector<int32_t> *> sets;
+
+    llama_grammar_dfa dfa;
+
+    const auto add = [&](std::vector<int32_t> & set) -> int32_t {
+        closure(set);
+
+        const auto it = ids.find(set);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        if (sets.size() >= LLAMA_GRAMMAR_MAX_STATES) {
+            return -1;
+        }
+
+        const int32_t id = sets.size();
+        sets.push_back(&ids.emplace(set, id).first->first);
+
+        dfa.next.resize(dfa.next.size() + 256, -1);
+        dfa.accepting.push_back(std::binary_search(set.begin(), set.end(), accept));
+
+        return id;
+    };
+
+    // the first byte of each class
+    std::vector<int> first(n_classes, -1);
+    for (int c = 255; c >= 0; --c) {
+        first[classes[c]] = c;
+    }
+
+    std::vector<int32_t> set = { frag.start };
+    add(set);
+
+    for (size_t i = 0; i < sets.size(); ++i) {
+        for (int k = 0; k < n_classes; ++k) {
+            const int c0 = first[k];
+
+            set.clear();
+            for (const int32_t s : *sets[i]) {
+                if (states[s].next >= 0 && states[s].bytes.has(c0)) {
+                    set.push_back(states[s].next);
+                }
+            }
+            if (set.empty()) {
+                continue;
+            }
+
+            const int32_t t = add(set);
+            if (t < 0) {
+                error = "the regex needs more than " + std::to_string(LLAMA_GRAMMAR_MAX_STATES) + " states";
+                return false;
+            }
+
+            for (int c = c0; c < 256; ++c) {
+                if (classes[c] == k) {
+                    dfa.next[i*256 + c] = t;
+                }
+            }
+        }
+    }
+
+    return llama_grammar_build(grammar, vocab, dfa, error);
+}
+
+// where the recognizer of JSON that llama_grammar_json() explores is in the text
+enum llama_json_mode {
+    LLAMA_JSON_VALUE,        // before a value
+    LLAMA_JSON_ARRAY_FIRST,  // after [: a value or ]
+    LLAMA_JSON_OBJECT_FIRST, // after {: a key or }
+    LLAMA_JSON_KEY,          // after , in an object: a key
+    LLAMA_JSON_COLON,        // after a key
+    LLAMA_JSON_AFTER,        // after a value: , or the end of its object or array - or of the text, at the top
+    LLAMA_JSON_STRING,       // in a string
+    LLAMA_JSON_UTF8,         // in a string: n continuation bytes of a character left, the first one in range
+    LLAMA_JSON_ESCAPE,       // after \ in a string
+    LLAMA_JSON_HEX,          // in \u: n hex digits left
+    LLAMA_JSON_MINUS,        // a number: after -
+    LLAMA_JSON_ZERO,         //           a leading 0
+    LLAMA_JSON_INT,          //           in the digits of the integer
+    LLAMA_JSON_DOT,          //           after .
+    LLAMA_JSON_FRAC,         //           in the digits of the fraction
+    LLAMA_JSON_E,            //           after e or E
+    LLAMA_JSON_E_SIGN,       //           after the sign of the exponent
+    LLAMA_JSON_EXP,          //           in the digits of the exponent
+    LLAMA_JSON_LITERAL,      // in true, false or null: n bytes of it read
+};
+
+static const char * llama_json_literals[] = { "true", "false", "null" };
+
+// the bytes allowed after the lead byte of a character, which rule out the overlong forms, the surrogates and the code
+// points past U+10FFFF: 80..BF, or after E0 A0..BF, after ED 80..9F, after F0 90..BF and after F4 80..8F
+static const uint8_t llama_json_utf8_range[][2] = { { 0x80, 0xbf }, { 0xa0, 0xbf }, { 0x80, 0x9f }, { 0x90, 0xbf }, { 0x80, 0x8f } };
+
+// a state of the recognizer, which becomes a state of the DFA - the fields it does not use are 0
+struct llama_json_state {
+    int      mode  = LLAMA_JSON_VALUE;
+    int      key   = 0; // the string is a key
+    int      n     = 0;
+    int      lit   = 0; // the literal
+    int      depth = 0; // of the objects and arrays the state is in
+    uint32_t stack = 0; // bit i is set if the one at depth i + 1 is an object
+    int      range = 0; // the llama_json_utf8_range of the next continuation byte
+
+    uint64_t pack() const {
+        return (uint64_t) mode | (uint64_t) key << 5 | (uint64_t) n << 6 | (uint64_t) lit << 9 | (uint64_t) depth << 11 | (uint64_t) stack << 17 |
+               (uint64_t) range << 49;
+    }
+
+    bool object() const {
+        return depth > 0 && (stack >> (depth - 1) & 1);
+    }
+
+    bool accepting() const {
+        return depth == 0 && (mode == LLAMA_JSON_AFTER || mode == LLAMA_JSON_ZERO || mode == LLAMA_JSON_INT ||
+                              mode == LLAMA_JSON_FRAC  || mode == LLAMA_JSON_EXP);
+    }
+};
+
+static bool llama_json_ws(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool llama_json_digit(uint8_t c) {
+    return c >= '0' && c <= '9';
+}
+
+// the end of a value
+static void llama_json_end(llama_json_state & s) {
+    s.mode = LLAMA_JSON_AFTER;
+    s.key  = 0;
+    s.n    = 0;
+    s.lit  = 0;
+}
+
+// the first byte of a value
+static bool llama_json_value(llama_json_state & s, uint8_t c, int max_depth) {
+    switch (c) {
+        case '{':
+        case '[':
+            if (s.depth >= max_depth) {
+                return false;
+            }
+            if (c == '{') {
+                s.stack |= 1u << s.depth;
+            }
+            s.depth++;
+            s.mode = c == '{' ? LLAMA_JSON_OBJECT_FIRST : LLAMA_JSON_ARRAY_FIRST;
+            return true;
+        case '"':
+            s.mode = LLAMA_JSON_STRING;
+            return true;
+        case '-':
+            s.mode = LLAMA_JSON_MINUS;
+            return true;
+        case '0':
+            s.mode = LLAMA_JSON_ZERO;
+            return true;
+        case 't':
+        case 'f':
+        case 'n':
+            s.mode = LLAMA_JSON_LITERAL;
+            s.lit  = c == 't' ? 0 : c == 'f' ? 1 : 2;
+            s.n    = 1;
+            return true;
+        default:
+            if (llama_json_digit(c)) {
+                s.mode = LLAMA_JSON_INT;
+                return true;
+            }
+            return false;
+    }
+}
+
+// the end of the object or array the state is in
+static bool llama_json_close(llama_json_state & s, uint8_t c) {
+    if (s.depth == 0 || c != (s.object() ? '}' : ']')) {
+        return false;
+    }
+
+    s.depth--;
+    s.stack &= ~(1u << s.depth);
+    llama_json_end(s);
+
+    return true;
+}
+
+// the state after a byte, false if the byte is not allowed
+static bool llama_json_step(llama_json_state & s, uint8_t c, int max_depth) {
+    switch (s.mode) {
+        case LLAMA_JSON_VALUE:
+            return llama_json_ws(c) || llama_json_value(s, c, max_depth);
+        case LLAMA_JSON_ARRAY_FIRST:
+            return llama_json_ws(c) || llama_json_close(s, c) || llama_json_value(s, c, max_depth);
+        case LLAMA_JSON_OBJECT_FIRST:
+        case LLAMA_JSON_KEY:
+            if (c == '"') {
+                s.mode = LLAMA_JSON_STRING;
+                s.key  = 1;
+                return true;
+            }
+            return llama_json_ws(c) || (s.mode == LLAMA_JSON_OBJECT_FIRST && llama_json_close(s, c));
+        case LLAMA_JSON_COLON:
+            if (c == ':') {
+                s.mode = LLAMA_JSON_VALUE;
+                return true;
+            }
+            return llama_json_ws(c);
+        case LLAMA_JSON_AFTER:
+            if (c == ',' && s.depth > 0) {
+                s.mode = s.object() ? LLAMA_JSON_KEY : LLAMA_JSON_VALUE;
+                return true;
+            }
+            return llama_json_ws(c) || llama_json_close(s, c);
+        case LLAMA_JSON_STRING:
+            if (c == '"') {
+                if (s.key) {
+                    s.mode = LLAMA_JSON_COLON;
+                    s.key  = 0;
+                } else {
+                    llama_json_end(s);
+                }
+                return true;
+            }
+            if (c == '\\') {
+                s.mode = LLAMA_JSON_ESCAPE;
+                return true;
+            }
+            if (c < 0x20) {
+                return false;
+            }
+            if (c < 0x80) {
+                return true;
+            }
+            // the lead byte of a character of 2 to 4 bytes, short of the overlong ones and those past U+10FFFF - the
+            // byte after it rules out the rest of them
+            s.n = c >= 0xc2 && c <= 0xdf ? 1 : c >= 0xe0 && c <= 0xef ? 2 : c >= 0xf0 && c <= 0xf4 ? 3 : 0;
+            if (s.n == 0) {
+                return false;
+            }
+            s.range = c == 0xe0 ? 1 : c == 0xed ? 2 : c == 0xf0 ? 3 : c == 0xf4 ? 4 : 0;
+            s.mode  = LLAMA_JSON_UTF8;
+            return true;
+        case LLAMA_JSON_UTF8:
+            if (c < llama_json_utf8_range[s.range][0] || c > llama_json_utf8_range[s.range][1]) {
+                return false;
+            }
+            s.range = 0;
+            if (--s.n == 0) {
+                s.mode = LLAMA_JSON_STRING;
+            }
+            return true;
+        case LLAMA_JSON_ESCAPE:
+            if (c == 'u') {
+                s.mode = LLAMA_JSON_HEX;
+                s.n    = 4;
+                return true;
+            }
+            if (c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' || c == 'n' || c == 'r' || c == 't') {
+                s.mode = LLAMA_JSON_STRING;
+                return true;
+            }
+            return false;
+        case LLAMA_JSON_HEX:
+            if (!llama_json_digit(c) && !(c >= 'a' && c <= 'f') && !(c >= 'A' && c <= 'F')) {
+                return false;
+            }
+            if (--s.n == 0) {
+                s.mode = LLAMA_JSON_STRING;
+            }
+            return true;
+        case LLAMA_JSON_MINUS:
+            if (c == '0') {
+                s.mode = LLAMA_JSON_ZERO;
+                return true;
+            }
+            if (llama_json_digit(c)) {
+                s.mode = LLAMA_JSON_INT;
+                return true;
+            }
+            return false;
+        case LLAMA_JSON_DOT:
+        case LLAMA_JSON_E_SIGN:
+            if (llama_json_digit(c)) {
+                s.mode = s.mode == LLAMA_JSON_DOT ? LLAMA_JSON_FRAC : LLAMA_JSON_EXP;
+                return true;
+            }
+            return false;
+        case LLAMA_JSON_E:
+            if (c == '+' || c == '-') {
+                s.mode = LLAMA_JSON_E_SIGN;
+                return true;
+            }
+            if (llama_json_digit(c)) {
+                s.mode = LLAMA_JSON_EXP;
+                return true;
+            }
+            return false;
+        case LLAMA_JSON_ZERO:
+        case LLAMA_JSON_INT:
+        case LLAMA_JSON_FRAC:
+        case LLAMA_JSON_EXP:
+            if (llama_json_digit(c) && s.mode != LLAMA_JSON_ZERO) {
+                return true;
+            }
+            if (c == '.' && s.mode != LLAMA_JSON_FRAC && s.mode != LLAMA_JSON_EXP) {
+                s.mode = LLAMA_JSON_DOT;
+                return true;
+            }
+            if ((c == 'e' || c == 'E') && s.mode != LLAMA_JSON_EXP) {
+                s.mode = LLAMA_JSON_E;
+                return true;
+            }
+            // the number ends before the byte
+            llama_json_end(s);
+            return llama_json_step(s, c, max_depth);
+        case LLAMA_JSON_LITERAL:
+            {
+                const char * lit = llama_json_literals[s.lit];
+                if (c != (uint8_t) lit[s.n]) {
+                    return false;
+                }
+                if (lit[++s.n] == '\0') {
+                    llama_json_end(s);
+                }
+                return true;
+            }
+    }
+
+    return false;
+}
+
+bool llama_grammar_json(llama_grammar & grammar, const gpt_vocab & vocab, int max_depth, std::string & error) {
+    if (max_depth < 0 || max_depth > 31) {
+        error = "the depth of a JSON grammar must be between 0 and 31";
+        return false;
+    }
+
+    // the states that the recognizer reaches from the start, breadth first
+    std::unordered_map<uint64_t, int32_t> ids;
+    std::vector<llama_json_state> states(1);
+    ids[states[0].pack()] = 0;
+
+    llama_grammar_dfa dfa;
+
+    for (size_t i = 0; i < states.size(); ++i) {
+        dfa.accepting.push_back(states[i].accepting());
+
+        for (int c = 0; c < 256; ++c) {
+            llama_json_state s = states[i];
+            if (!llama_json_step(s, c, max_depth)) {
+                dfa.next.push_back(-1);
+                continue;
+            }
+
+            const auto it = ids.emplace(s.pack(), (int32_t) states.size());
+            if (it.second) {
+                if (states.size() >= LLAMA_GRAMMAR_MAX_STATES) {
+                    error = "a JSON grammar " + std::to_string(max_depth) + " deep needs more than " + std::to_string(LLAMA_GRAMMAR_MAX_STATES) + " states";
+                    return false;
+                }
+                states.push_back(s);
+            }
+
+            dfa.next.push_back(it.first->second);
+        }
+    }
+
+    return llama_grammar_build(grammar, vocab, dfa, error);
+}
+
+int llama_grammar_advance(const llama_grammar & grammar, int state, gpt_vocab::id id) {
+    if (state < 0 || id < 0 || id >= grammar.vocab->size()) {
+        return -1;
+    }
+
+    // the text ends with EOS
+    if (id == LLAMA_TOKEN_EOS) {
+        return state;
+    }
+
+    const auto text = grammar.vocab->text(id);
+    if (text.size == 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < text.size && state >= 0; ++i) {
+        state = llama_grammar_step(grammar, state, text.data[i]);
+    }
+
+    return state;
+}
+
+// the tokens the state allows: the trie of the vocab is walked along the DFA, and the subtrees of the bytes that the
+// DFA does not allow are skipped
+static void llama_grammar_fill_mask(llama_grammar & grammar, int state, uint64_t * mask) {
+    const gpt_vocab_trie & trie = grammar.vocab->trie;
+
+    const auto set = [mask](gpt_vocab::id id) {
+        mask[id >> 6] |= 1ull << (id & 63);
+    };
+
+    auto & stack = grammar.stack;
+    stack.clear();
+
+    for (int c = 0; c < 256; ++c) {
+        if (trie.root[c] != 0) {
+            const int32_t next = llama_grammar_step(grammar, state, c);
+            if (next >= 0) {
+                stack.push_back({ trie.root[c], next });
+            }
+        }
+    }
+
+    while (!stack.empty()) {
+        const auto top = stack.back();
+        stack.pop_back();
+
+        const auto & node = trie.nodes[top.first];
+        if (node.id >= 0) {
+            set(node.id);
+        }
+
+        for (uint32_t i = node.edges; i < node.edges + node.n_edges; ++i) {
+            const auto & edge = trie.edges[i];
+            const int32_t next = llama_grammar_step(grammar, top.second, edge.byte);
+            if (next >= 0) {
+                stack.push_back({ edge.node, next });
+            }
+        }
+    }
+
+    for (const auto & alias : grammar.aliases) {
+        if (mask[alias.second >> 6] >> (alias.second & 63) & 1) {
+            set(alias.first);
+        }
+    }
+
+    bool any = false;
+    for (int i = 0; i < grammar.n_words && !any; ++i) {
+        any = mask[i] != 0;
+    }
+
+    if ((grammar.accepting[state] || !any) && LLAMA_TOKEN_EOS < grammar.vocab->size()) {
+        set(LLAMA_TOKEN_EOS);
+    }
+}
+
+const uint64_t * llama_grammar_mask(llama_grammar & grammar, int state) {
+    if (grammar.mask_index[state] < 0) {
+        grammar.mask_index[state] = grammar.masks.size()/grammar.n_words;
+        grammar.masks.resize(grammar.masks.size() + grammar.n_words, 0);
+
+        llama_grammar_fill_mask(grammar, state, grammar.masks.data() + (size_t) grammar.mask_index[state]*grammar.n_words);
+    }
+
+    return grammar.masks.data() + (size_t) grammar.mask_index[state]*grammar.n_words;
+}
+
+
+// the number of bins of the histogram that llama_select_top_k() finds its threshold with, and the number of scores
+// that it first tries to find it from
+#define LLAMA_TOP_K_BINS   1024
+#define LLAMA_TOP_K_SAMPLE 1024
+
+// the least and the greatest of the n scores
+static void llama_scores_min_max(const float * scores, int n, float & min, float & max) {
+    min =  INFINITY;
+    max = -INFINITY;
+
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    if (n >= 4) {
+        float32x4_t vmin = vld1q_f32(scores);
+        float32x4_t vmax = vmin;
+        for (i = 4; i + 4 <= n; i += 4) {
+            const float32x4_t v = vld1q_f32(scores + i);
+            vmin = vminq_f32(vmin, v);
+            vmax = vmaxq_f32(vmax, v);
+        }
+
+        float tmin[4];
+        float tmax[4];
+        vst1q_f32(tmin, vmin);
+        vst1q_f32(tmax, vmax);
+        for (int j = 0; j < 4; ++j) {
+            min = std::min(min, tmin[j]);
+            max = std::max(max, tmax[j]);
+        }
+    }
+#elif defined(__SSE2__)
+    if (n >= 4) {
+        __m128 vmin = _mm_loadu_ps(scores);
+        __m128 vmax = vmin;
+        for (i = 4; i + 4 <= n; i += 4) {
+            const __m128 v = _mm_loadu_ps(scores + i);
+            vmin = _mm_min_ps(vmin, v);
+            vmax = _mm_max_ps(vmax, v);
+        }
+
+        float tmin[4];
+        float tmax[4];
+        _mm_storeu_ps(tmin, vmin);
+        _mm_storeu_ps(tmax, vmax);
+        for (int j = 0; j < 4; ++j) {
+            min = std::min(min, tmin[j]);
+            max = std::max(max, tmax[j]);
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        min = std::min(min, scores[i]);
+        max = std::max(max, scores[i]);
+    }
+}
+
+// count the scores in the bins of (score - min)*scale, which is below LLAMA_TOP_K_BINS for all of them but the
+// greatest - the scores below min fall in bin 0 and the greatest in the last bin
+static void llama_scores_histogram(const float * scores, int n, float min, float scale, int * hist) {
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const float32x4_t vmin   = vdupq_n_f32(min);
+    const float32x4_t vscale = vdupq_n_f32(scale);
+    const float32x4_t vzero  = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t x = vmaxq_f32(vmulq_f32(vsubq_f32(vld1q_f32(scores + i), vmin), vscale), vzero);
+
+        int bins[4];
+        vst1q_s32(bins, vcvtq_s32_f32(x));
+        for (int j = 0; j < 4; ++j) {
+            hist[std::min(bins[j], LLAMA_TOP_K_BINS - 1)]++;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 vmin   = _mm_set1_ps(min);
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vzero  = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        const __m128 x = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(scores + i), vmin), vscale), vzero);
+
+        int bins[4];
+        _mm_storeu_si128((__m128i *) bins, _mm_cvttps_epi32(x));
+        for (int j = 0; j < 4; ++j) {
+            hist[std::min(bins[j], LLAMA_TOP_K_BINS - 1)]++;
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        const float x = std::max((scores[i] - min)*scale, 0.0f);
+        hist[std::min((int) x, LLAMA_TOP_K_BINS - 1)]++;
+    }
+}
+
+// write the ids of the scores with (score - min)*scale >= bound to ids, in order, and return their number
+static int llama_scores_select(const float * scores, int n, float min, float scale, float bound, gpt_vocab::id * ids) {
+    int m = 0;
+    int i = 0;
+
+#if defined(__ARM_NEON)
+    const float32x4_t vmin   = vdupq_n_f32(min);
+    const float32x4_t vscale = vdupq_n_f32(scale);
+    const float32x4_t vbound = vdupq_n_f32(bound);
+    for (; i + 4 <= n; i += 4) {
+        const uint32x4_t ge = vcgeq_f32(vmulq_f32(vsubq_f32(vld1q_f32(scores + i), vmin), vscale), vbound);
+
+        // most of the scores are below the bound, skip them 4 at a time
+        const uint64x2_t ge64 = vreinterpretq_u64_u32(ge);
+        if ((vgetq_lane_u64(ge64, 0) | vgetq_lane_u64(ge64, 1)) == 0) {
+            continue;
+        }
+
+        uint32_t lanes[4];
+        vst1q_u32(lanes, ge);
+        for (int j = 0; j < 4; ++j) {
+            if (lanes[j]) {
+                ids[m++] = i + j;
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 vmin   = _mm_set1_ps(min);
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vbound = _mm_set1_ps(bound);
+    for (; i + 4 <= n; i += 4) {
+        const int mask = _mm_movemask_ps(_mm_cmpge_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(scores + i), vmin), vscale), vbound));
+
+        // most of the scores are below the bound, skip them 4 at a time
+        if (mask == 0) {
+            continue;
+        }
+
+        for (int j = 0; j < 4; ++j) {
+            if (mask & (1 << j)) {
+                ids[m++] = i + j;
+            }
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if ((scores[i] - min)*scale >= bound) {
+            ids[m++] = i;
+        }
+    }
+
+    return m;
+}
+
+// the threshold bin of a histogram: the highest bin with at least count scores in it and above it, or 0
+static int llama_histogram_bin(const int * hist, int count) {
+    int bin = LLAMA_TOP_K_BINS - 1;
+    for (int c = hist[bin]; c < count && bin > 0; c += hist[bin]) {
+        --bin;
+    }
+    return bin;
+}
+
+// the least of the n scores that are not -inf, or max if there are none
+static float llama_scores_min_finite(const float * scores, int n, int stride, float max) {
+    float min = max;
+    for (int i = 0; i < n; i += stride) {
+        if (scores[i] != -INFINITY) {
+            min = std::min(min, scores[i]);
+        }
+    }
+    return min;
+}
+
+int llama_select_top_k(const float * scores, int n, int k, gpt_vocab::id * ids) {
+    const auto greater = [scores](gpt_vocab::id a, gpt_vocab::id b) {
+        return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+    };
+
+    k = std::min(k, n);
+    if (k <= 0) {
+        return 0;
+    }
+
+    int m = 0;
+
+    if (k == 1) {
+        // the candidates are the scores equal to the greatest
+        float min = 0.0f;
+        float max = 0.0f;
+        llama_scores_min_max(scores, n, min, max);
+
+        m = llama_scores_select(scores, n, 0.0f, 1.0f, max, ids);
+    } else if (k < n) {
+        // the threshold from the histogram of a sample of the scores, with a margin for the error of the sample - any
+        // threshold with at least k scores above it gives the exact top K
+        const int stride = n/LLAMA_TOP_K_SAMPLE;
+        const int target = 2*((int64_t) k*LLAMA_TOP_K_SAMPLE/n + 1) + 16;
+
+        if (stride >= 4 && target < LLAMA_TOP_K_SAMPLE/2) {
+            float max = -INFINITY;
+            for (int i = 0; i < n; i += stride) {
+                max = std::max(max, scores[i]);
+            }
+            const float min = llama_scores_min_finite(scores, n, stride, max);
+
+            if (max > min && max - min < INFINITY) {
+                const float scale = LLAMA_TOP_K_BINS/(max - min);
+
+                int hist[LLAMA_TOP_K_BINS] = { 0 };
+                for (int i = 0; i < n; i += stride) {
+                    hist[std::min((int) std::max((scores[i] - min)*scale, 0.0f), LLAMA_TOP_K_BINS - 1)]++;
+                }
+
+                const int bin = llama_histogram_bin(hist, target);
+                if (bin > 0) {
+                    m = llama_scores_select(scores, n, min, scale, bin, ids);
+                }
+            }
+        }
+
+        // the threshold from the histogram of all the scores
+        if (m < k) {
+            m = 0;
+
+            float min = 0.0f;
+            float max = 0.0f;
+            llama_scores_min_max(scores, n, min, max);
+
+            // masked out tokens are -inf, the bins span the finite scores
+            if (min == -INFINITY) {
+                min = llama_scores_min_finite(scores, n, 1, max);
+            }
+
+            if (max > min && max - min < INFINITY) {
+                const float scale = LLAMA_TOP_K_BINS/(max - min);
+
+                int hist[LLAMA_TOP_K_BINS] = { 0 };
+                llama_scores_histogram(scores, n, min, scale, hist);
+
+                int bin = llama_histogram_bin(hist, k);
+
+                m = llama_scores_select(scores, n, min, scale, bin, ids);
+
+                // a score lands in the same bin in both passes unless the compiler contracts their arithmetic
+                // differently, and the -inf scores are counted in bin 0 but never selected - go down the bins until
+                // there are enough
+                while (m < k && bin > 0) {
+                    m = llama_scores_select(scores, n, min, scale, --bin, ids);
+                }
+            }
+        }
+    }
+
+    // no range to bin the scores in, or too few of them are finite - all the finite ones, and if there are fewer than
+    // k of them, the -inf ones after them with the lowest ids first
+    if (m < k) {
+        m = 0;
+        for (int i = 0; i < n; ++i) {
+            if (scores[i] != -INFINITY) {
+                ids[m++] = i;
+            }
+        }
+
+        if (m < k) {
+            std::sort(ids, ids + m, greater);
+            for (int i = 0; i < n && m < k; ++i) {
+                if (scores[i] == -INFINITY) {
+                    ids[m++] = i;
+                }
+            }
+            return k;
+        }
+    }
+
+    if (k < m) {
+        std::nth_element(ids, ids + k, ids + m, greater);
+    }
+    std::sort(ids, ids + k, greater);
+
+    return k;
+}
+
+void sample_top_k(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, int top_k) {
+    // find the top K tokens
+    std::partial_sort(
+            logits_id.begin(),
+            logits_id.begin() + top_k, logits_id.end(),
+            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
+        return a.first > b.first;
+    });
+
+    logits_id.resize(top_k);
+}
+
+void llama_apply_repeat_penalty(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, const std::vector<gpt_vocab::id> & last_n_tokens, double repeat_penalty) {
+    // each of the recent tokens is penalized once, however often it occurs
+    std::vector<gpt_vocab::id> recent(last_n_tokens);
+    std::sort(recent.begin(), recent.end());
+    recent.erase(std::unique(recent.begin(), recent.end()), recent.end());
+
+    const int n_logits = logits_id.size();
+
+    for (const auto id : recent) {
+        if (id < 0 || id >= n_logits) {
+            continue;
+        }
+
+        // repetition penalty from CTRL paper (https://arxiv.org/abs/1909.05858)
+        // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+        //
+        // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+        double & logit = logits_id[id].first;
+        if (logit < 0.0) {
+            logit *= repeat_penalty;
+        } else {
+            logit /= repeat_penalty;
+        }
+    }
+}
+
+gpt_vocab::id llama_sample_top_p_top_k(
+        const gpt_vocab & vocab,
+        const float * logits,
+        std::vector<gpt_vocab::id> & last_n_tokens,
+        double repeat_penalty,
+        int top_k,
+        double top_p,
+        double temp,
+        std::mt19937 & rng) {
+    int n_logits = vocab.size();
+
+    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
+    logits_id.reserve(n_logits);
+
+    {
+        const double scale = 1.0/temp;
+        for (int i = 0; i < n_logits; ++i) {
+            logits_id.push_back(std::make_pair(logits[i]*scale, i));
+        }
+    }
+
+    llama_apply_repeat_penalty(logits_id, last_n_tokens, repeat_penalty);
+
+    sample_top_k(logits_id, top_k);
+
+    double maxl = -INFINITY;
+    for (const auto & kv : logits_id) {
+        maxl = std::max(maxl, kv.first);
+    }
+
+    // compute probs for the top K tokens
+    std::vector<double> probs;
+    probs.reserve(logits_id.size());
+
+    double sum = 0.0;
+    for (const auto & kv : logits_id) {
+        double p = exp(kv.first - maxl);
+        probs.push_back(p);
+        sum += p;
+    }
+
+    // normalize the probs
+    for (auto & p : probs) {
+        p /= sum;
+    }
+
+    if (top_p < 1.0f) {
+        double cumsum = 0.0f;
+        for (int i = 0; i < (int) probs.size(); i++) {
+            cumsum += probs[i];
+            if (cumsum >= top_p) {
+                probs.resize(i + 1);
+                logits_id.resize(i + 1);
+                break;
+            }
+        }
+
+        cumsum = 1.0/cumsum;
+        for (int i = 0; i < (int) probs.size(); i++) {
+            probs[i] *= cumsum;
+        }
+    }
+
+    //printf("\n");
+    //for (int i = 0; i < (int) 10; i++) {
+    //    printf("%d: '%s' %f\n", i, vocab.text(logits_id[i].second).str().c_str(), probs[i]);
+    //}
+    //printf("\n\n");
+    //exit(0);
+
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    int idx = dist(rng);
+
+    return logits_id[idx].second;
+}
+
+void llama_sampler_init(llama_sampler & sampler, int n_vocab, int repeat_last_n) {
+    sampler.n_vocab = n_vocab;
+
+    sampler.last_n_tokens.assign(std::max(0, repeat_last_n), 0);
+    sampler.last_n_pos = 0;
+    sampler.last_n_counts.assign(n_vocab, 0);
+    if (n_vocab > 0) {
+        sampler.last_n_counts[0] = sampler.last_n_tokens.size();
+    }
+
+    sampler.logits.resize(n_vocab);
+    sampler.ids.resize(n_vocab);
+    sampler.probs.resize(n_vocab);
+    sampler.n_candidates = 0;
+    sampler.sorted       = false;
+    sampler.has_probs    = false;
+
+    sampler.penalized.assign(n_vocab, 0);
+    sampler.epoch = 0;
+
+    llama_sampler_set_stages(sampler, sampler.stages);
+}
+
+void llama_sampler_set_stages(llama_sampler & sampler, const std::vector<llama_sampler_stage> & stages) {
+    if (&stages != &sampler.stages) {
+        sampler.stages = stages;
+    }
+
+    sampler.mirostat_mu = 0.0f;
+    for (const auto & stage : sampler.stages) {
+        if (stage.type == LLAMA_SAMPLER_MIROSTAT || stage.type == LLAMA_SAMPLER_MIROSTAT_V2) {
+            sampler.mirostat_mu = 2.0f*stage.value;
+            break;
+        }
+    }
+}
+
+std::vector<llama_sampler_stage> llama_sampler_stages(const gpt_params & params) {
+    std::vector<llama_sampler_stage> stages;
+
+    if (params.grammar_json || !params.grammar_regex.empty()) {
+        stages.push_back({ LLAMA_SAMPLER_GRAMMAR });
+    }
+
+    if (params.repeat_penalty != 1.0f) {
+        stages.push_back({ LLAMA_SAMPLER_REPETITION_PENALTY, params.repeat_penalty });
+    }
+    if (params.frequency_penalty != 0.0f || params.presence_penalty != 0.0f) {
+        stages.push_back({ LLAMA_SAMPLER_FREQUENCY_PENALTY, params.frequency_penalty, params.presence_penalty });
+    }
+
+    if (params.temp <= 0.0f) {
+        stages.push_back({ LLAMA_SAMPLER_GREEDY });
+        return stages;
+    }
+
+    stages.push_back({ LLAMA_SAMPLER_TEMPERATURE, params.temp });
+
+    if (params.mirostat == 1) {
+        stages.push_back({ LLAMA_SAMPLER_MIROSTAT, params.mirostat_tau, params.mirostat_eta, 100 });
+    } else if (params.mirostat == 2) {
+        stages.push_back({ LLAMA_SAMPLER_MIROSTAT_V2, params.mirostat_tau, params.mirostat_eta });
+    } else {
+        stages.push_back({ LLAMA_SAMPLER_TOP_K, 0.0f, 0.0f, params.top_k });
+        if (params.tfs_z < 1.0f) {
+            stages.push_back({ LLAMA_SAMPLER_TAIL_FREE, params.tfs_z });
+        }
+        if (params.typical_p < 1.0f) {
+            stages.push_back({ LLAMA_SAMPLER_TYPICAL, params.typical_p });
+        }
+        if (params.top_p < 1.0f) {
+            stages.push_back({ LLAMA_SAMPLER_TOP_P, params.top_p });
+        }
+    }
+
+    return stages;
+}
+
+void llama_sampler_set_grammar(llama_sampler & sampler, llama_grammar * grammar) {
+    sampler.grammar       = grammar;
+    sampler.grammar_state = 0;
+}
+
+void llama_sampler_accept(llama_sampler & sampler, gpt_vocab::id id) {
+    if (sampler.last_n_tokens.empty()) {
+        return;
+    }
+
+    gpt_vocab::id & oldest = sampler.last_n_tokens[sampler.last_n_pos];
+    if (oldest >= 0 && oldest < sampler.n_vocab) {
+        sampler.last_n_counts[oldest]--;
+    }
+    if (id >= 0 && id < sampler.n_vocab) {
+        sampler.last_n_counts[id]++;
+    }
+
+    oldest = id;
+    sampler.last_n_pos = (sampler.last_n_pos + 1) % sampler.last_n_tokens.size();
+}
+
+void llama_sampler_advance(llama_sampler & sampler, gpt_vocab::id id) {
+    if (sampler.grammar == nullptr || sampler.grammar_state < 0) {
+        return;
+    }
+
+    sampler.grammar_state = llama_grammar_advance(*sampler.grammar, sampler.grammar_state, id);
+}
+
+// run the stages that shape the candidates, returns the stage that picks the token - or null if it is drawn from the
+// candidates
+static const llama_sampler_stage * llama_sampler_filter(llama_sampler & sampler, const float * logits) {
+    llama_sample_begin(sampler, logits);
+
+    for (const auto & stage : sampler.stages) {
+        switch (stage.type) {
+            case LLAMA_SAMPLER_GRAMMAR:
+                // a token off the grammar leaves it in no state, after which nothing is masked
+                if (sampler.grammar != nullptr && sampler.grammar_state >= 0) {
+                    llama_sample_grammar(sampler, *sampler.grammar, sampler.grammar_state);
+                }
+                break;
+            case LLAMA_SAMPLER_REPETITION_PENALTY: llama_sample_repetition_penalty(sampler, stage.value);               break;
+            case LLAMA_SAMPLER_FREQUENCY_PENALTY:  llama_sample_frequency_penalty(sampler, stage.value, stage.value2); break;
+            case LLAMA_SAMPLER_TEMPERATURE:        llama_sample_temperature(sampler, stage.value);                     break;
+            case LLAMA_SAMPLER_TOP_K:              llama_sample_top_k(sampler, stage.n);                               break;
+            case LLAMA_SAMPLER_TOP_P:              llama_sample_top_p(sampler, stage.value);                           break;
+            case LLAMA_SAMPLER_TYPICAL:            llama_sample_typical(sampler, stage.value);                         break;
+            case LLAMA_SAMPLER_TAIL_FREE:          llama_sample_tail_free(sampler, stage.value);                       break;
+            // the stages that pick the token end the pipeline
+            case LLAMA_SAMPLER_MIROSTAT:
+            case LLAMA_SAMPLER_MIROSTAT_V2:
+            case LLAMA_SAMPLER_GREEDY:
+                return &stage;
+        }
+    }
+
+    return nullptr;
+}
+
+gpt_vocab::id llama_sampler_run(llama_sampler & sampler, const float * logits, std::mt19937 & rng) {
+    const llama_sampler_stage * pick = llama_sampler_filter(sampler, logits);
+    if (pick == nullptr) {
+        return llama_sample_draw(sampler, rng);
+    }
+
+    switch (pick->type) {
+        case LLAMA_SAMPLER_MIROSTAT:
+            return llama_sample_mirostat(sampler, pick->value, pick->value2, pick->n, sampler.mirostat_mu, rng);
+        case LLAMA_SAMPLER_MIROSTAT_V2:
+            return llama_sample_mirostat_v2(sampler, pick->value, pick->value2, sampler.mirostat_mu, rng);
+        default:
+            return llama_sample_greedy(sampler);
+    }
+}
+
+gpt_vocab::id llama_sampler_sample(
+        llama_sampler & sampler,
+        const float * logits,
+        float repeat_penalty,
+        int top_k,
+        float top_p,
+        float temp,
+        std::mt19937 & rng) {
+    llama_sample_begin(sampler, logits);
+    llama_sample_repetition_penalty(sampler, repeat_penalty);
+    llama_sample_temperature(sampler, temp);
+    llama_sample_top_k(sampler, top_k);
+    if (top_p < 1.0f) {
+        llama_sample_top_p(sampler, top_p);
+    }
+
+    return llama_sample_draw(sampler, rng);
+}
+
+bool llama_sampler_can_speculate(const std::vector<llama_sampler_stage> & stages) {
+    for (const auto & stage : stages) {
+        if (stage.type == LLAMA_SAMPLER_MIROSTAT || stage.type == LLAMA_SAMPLER_MIROSTAT_V2) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// normalize the probabilities of the candidates as llama_sample_draw() computes them, without sorting them
+static void llama_sample_normalize(llama_sampler & sampler) {
+    if (sampler.has_probs) {
+        return;
+    }
+
+    const float * logits = sampler.logits.data();
+    const gpt_vocab::id * ids = sampler.ids.data();
+    float * probs = sampler.probs.data();
+
+    const int n = sampler.n_candidates;
+
+    float maxl = -INFINITY;
+    for (int i = 0; i < n; ++i) {
+        maxl = std::max(maxl, logits[ids[i]]);
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        probs[i] = expf(logits[ids[i]] - maxl);
+        sum += probs[i];
+    }
+
+    const float norm = 1.0f/sum;
+    for (int i = 0; i < n; ++i) {
+        probs[i] *= norm;
+    }
+
+    sampler.has_probs = true;
+}
+
+void llama_sampler_probs(llama_sampler & sampler, const float * logits) {
+    const llama_sampler_stage * pick = llama_sampler_filter(sampler, logits);
+    if (pick != nullptr && pick->type == LLAMA_SAMPLER_GREEDY) {
+        llama_sample_greedy(sampler);
+    }
+
+    llama_sample_normalize(sampler);
+}
+
+void llama_sampler_sync(llama_sampler & dst, const llama_sampler & src) {
+    dst.last_n_tokens = src.last_n_tokens;
+    dst.last_n_pos    = src.last_n_pos;
+    dst.last_n_counts = src.last_n_counts;
+
+    dst.grammar       = src.grammar;
+    dst.grammar_state = src.grammar_state;
+}
+
+gpt_vocab::id llama_sampler_draft(llama_sampler & sampler, const float * logits, llama_draft & draft, std::mt19937 & rng) {
+    llama_sampler_probs(sampler, logits);
+
+    // only the candidates of the previous draft are cleared
+    if ((int) draft.probs.size() != sampler.n_vocab) {
+        draft.probs.assign(sampler.n_vocab, 0.0f);
+    } else {
+        for (const auto id : draft.ids) {
+            draft.probs[id] = 0.0f;
+        }
+    }
+
+    draft.ids.assign(sampler.ids.begin(), sampler.ids.begin() + sampler.n_candidates);
+    for (int i = 0; i < sampler.n_candidates; ++i) {
+        draft.probs[sampler.ids[i]] = sampler.probs[i];
+    }
+
+    draft.id = llama_sample_draw(sampler, rng);
+
+    return draft.id;
+}
+
+gpt_vocab::id llama_sampler_verify(llama_sampler & sampler, const float * logits, const llama_draft & draft, bool & accepted, std::mt19937 & rng) {
+    llama_sampler_probs(sampler, logits);
+
+    const gpt_vocab::id * ids = sampler.ids.data();
+    float * probs = sampler.probs.data();
+
+    const int n = sampler.n_candidates;
+
+    float p = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        if (ids[i] == draft.id) {
+            p = probs[i];
+            break;
+        }
+    }
+
+    // the draft drew its token, so q is not 0
+    const float q = draft.probs[draft.id];
+
+    accepted = p >= q || std::uniform_real_distribution<float>(0.0f, 1.0f)(rng)*q < p;
+    if (accepted) {
+        return draft.id;
+    }
+
+    // the tokens that the model finds likelier than the draft does, by how much - the tokens that are not candidates
+    // of the model have p = 0 and are left out
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        probs[i] = std::max(0.0f, probs[i] - draft.probs[ids[i]]);
+        sum += probs[i];
+    }
+
+    // p and q only differ by rounding: a draw from p itself is as good
+    if (!(sum > 0.0f)) {
+        llama_sampler_probs(sampler, logits);
+    }
+
+    return llama_sample_draw(sampler, rng);
+}
+
+// the order of the candidates, the lower id first on ties as in llama_select_top_k()
+struct llama_candidate_greater {
+    const float * logits;
+
+    bool operator()(gpt_vocab::id a, gpt_vocab::id b) const {
+        return logits[a] > logits[b] || (logits[a] == logits[b] && a < b);
+    }
+};
+
+// sort the candidates, the whole vocab with llama_select_top_k() if they are not sorted yet
+static void llama_sample_sort(llama_sampler & sampler) {
+    if (sampler.sorted) {
+        return;
+    }
+
+    sampler.n_candidates = llama_select_top_k(sampler.logits.data(), sampler.n_vocab, sampler.n_candidates, sampler.ids.data());
+    sampler.sorted = true;
+}
+
+// the logits of the candidates changed: keep them sorted if they were
+static void llama_sample_logits_changed(llama_sampler & sampler) {
+    if (sampler.sorted) {
+        std::sort(sampler.ids.begin(), sampler.ids.begin() + sampler.n_candidates, llama_candidate_greater{ sampler.logits.data() });
+    }
+    sampler.has_probs = false;
+}
+
+// the recent tokens, each once, and their number of occurrences
+template <typename F>
+static void llama_sample_for_recent(llama_sampler & sampler, F f) {
+    if (++sampler.epoch == 0) {
+        std::fill(sampler.penalized.begin(), sampler.penalized.end(), 0);
+        sampler.epoch = 1;
+    }
+
+    for (const auto id : sampler.last_n_tokens) {
+        if (id < 0 || id >= sampler.n_vocab || sampler.penalized[id] == sampler.epoch) {
+            continue;
+        }
+        sampler.penalized[id] = sampler.epoch;
+
+        f(sampler.logits[id], sampler.last_n_counts[id]);
+    }
+}
+
+void llama_sample_begin(llama_sampler & sampler, const float * logits) {
+    std::copy(logits, logits + sampler.n_vocab, sampler.logits.begin());
+
+    for (int i = 0; i < sampler.n_vocab; ++i) {
+        sampler.ids[i] = i;
+    }
+
+    sampler.n_candidates = sampler.n_vocab;
+    sampler.sorted       = false;
+    sampler.has_probs    = false;
+}
+
+void llama_sample_grammar(llama_sampler & sampler, llama_grammar & grammar, int state) {
+    const uint64_t * mask = llama_grammar_mask(grammar, state);
+
+    const auto allowed = [mask](gpt_vocab::id id) {
+        return mask[id >> 6] >> (id & 63) & 1;
+    };
+
+    float * logits = sampler.logits.data();
+    gpt_vocab::id * ids = sampler.ids.data();
+
+    sampler.has_probs = false;
+
+    if (!sampler.sorted) {
+        // a word at a time, most are all allowed or all not
+        for (int i = 0; i < grammar.n_words; ++i) {
+            const uint64_t bits = mask[i];
+            if (bits == ~0ull) {
+                continue;
+            }
+
+            const int first = 64*i;
+            const int last  = std::min(first + 64, sampler.n_vocab);
+
+            if (bits == 0) {
+                std::fill(logits + first, logits + last, -INFINITY);
+                continue;
+            }
+            // the tokens not allowed, one bit at a time
+            uint64_t off = ~bits;
+            if (last - first < 64) {
+                off &= (1ull << (last - first)) - 1;
+            }
+            while (off) {
+                logits[first + __builtin_ctzll(off)] = -INFINITY;
+                off &= off - 1;
+            }
+        }
+        return;
+    }
+
+    int keep = 0;
+    for (int i = 0; i < sampler.n_candidates; ++i) {
+        if (allowed(ids[i])) {
+            ids[keep++] = ids[i];
+        }
+    }
+
+    if (keep == 0) {
+        gpt_vocab::id best = -1;
+        for (gpt_vocab::id id = 0; id < sampler.n_vocab; ++id) {
+            if (allowed(id) && (best < 0 || logits[id] > logits[best])) {
+                best = id;
+            }
+        }
+        ids[keep++] = best;
+    }
+
+    sampler.n_candidates = keep;
+}
+
+void llama_sample_repetition_penalty(llama_sampler & sampler, float penalty) {
+    if (penalty == 1.0f) {
+        return;
+    }
+
+    // repetition penalty from CTRL paper (https://arxiv.org/abs/1909.05858)
+    // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+    //
+    // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+    llama_sample_for_recent(sampler, [penalty](float & logit, int) {
+        if (logit < 0.0f) {
+            logit *= penalty;
+        } else {
+            logit /= penalty;
+        }
+    });
+
+    llama_sample_logits_changed(sampler);
+}
+
+void llama_sample_frequency_penalty(llama_sampler & sampler, float alpha_frequency, float alpha_presence) {
+    if (alpha_frequency == 0.0f && alpha_presence == 0.0f) {
+        return;
+    }
+
+    llama_sample_for_recent(sampler, [alpha_frequency, alpha_presence](float & logit, int count) {
+        logit -= count*alpha_frequency + (count > 0 ? alpha_presence : 0.0f);
+    });
+
+    llama_sample_logits_changed(sampler);
+}
+
+void llama_sample_temperature(llama_sampler & sampler, float temp) {
+    float * logits = sampler.logits.data();
+
+    const float scale = 1.0f/temp;
+    if (sampler.sorted) {
+        for (int i = 0; i < sampler.n_candidates; ++i) {
+            logits[sampler.ids[i]] *= scale;
+        }
+    } else {
+        for (int i = 0; i < sampler.n_vocab; ++i) {
+            logits[i] *= scale;
+        }
+    }
+
+    sampler.has_probs = false;
+}
+
+void llama_sample_top_k(llama_sampler & sampler, int k, int min_keep) {
+    if (k <= 0) {
+        return;
+    }
+
+    k = std::min(std::max(k, min_keep), sampler.n_candidates);
+
+    if (!sampler.sorted) {
+        sampler.n_candidates = llama_select_top_k(sampler.logits.data(), sampler.n_vocab, k, sampler.ids.data());
+        sampler.sorted = true;
+    } else {
+        sampler.n_candidates = k;
+    }
+
+    sampler.has_probs = false;
+}
+
+void llama_sample_softmax(llama_sampler & sampler) {
+    llama_sample_sort(sampler);
+
+    if (sampler.has_probs) {
+        return;
+    }
+
+    const float * logits = sampler.logits.data();
+    const gpt_vocab::id * ids = sampler.ids.data();
+    float * probs = sampler.probs.data();
+
+    const int n = sampler.n_candidates;
+
+    const float maxl = logits[ids[0]];
+
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        probs[i] = expf(logits[ids[i]] - maxl);
+        sum += probs[i];
+    }
+
+    const float norm = 1.0f/sum;
+    for (int i = 0; i < n; ++i) {
+        probs[i] *= norm;
+    }
+
+    sampler.has_probs = true;
+}
+
+// keep the first n candidates, whose probabilities are no longer normalized
+static void llama_sample_keep(llama_sampler & sampler, int n) {
+    if (n < sampler.n_candidates) {
+        sampler.n_candidates = n;
+        sampler.has_probs    = false;
+    }
+}
+
+void llama_sample_top_p(llama_sampler & sampler, float p, int min_keep) {
+    if (p >= 1.0f) {
+        return;
+    }
+
+    llama_sample_softmax(sampler);
+
+    const float * probs = sampler.probs.data();
+
+    const int n = sampler.n_candidates;
+
+    float cumsum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        cumsum += probs[i];
+        if (cumsum >= p && i + 1 >= min_keep) {
+            llama_sample_keep(sampler, i + 1);
+            break;
+        }
+    }
+}
+
+void llama_sample_typical(llama_sampler & sampler, float p, int min_keep) {
+    if (p >= 1.0f) {
+        return;
+    }
+
+    llama_sample_softmax(sampler);
+
+    const float * logits = sampler.logits.data();
+    const float * probs  = sampler.probs.data();
+    gpt_vocab::id * ids  = sampler.ids.data();
+
+    const int n = sampler.n_candidates;
+
+    // the entropy, and the log of the normalization of the probabilities, which gives the surprise of a candidate
+    // from its logit without a buffer of them: -log(p) = log_norm - logit
+    float entropy = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        if (probs[i] > 0.0f) {
+            entropy -= probs[i]*logf(probs[i]);
+        }
+    }
+
+    const float log_norm = logits[ids[0]] - logf(probs[0]);
+
+    const auto shift = [&](gpt_vocab::id id) {
+        return fabsf(log_norm - logits[id] - entropy);
+    };
+
+    // the candidates closest to the entropy first
+    std::sort(ids, ids + n, [&](gpt_vocab::id a, gpt_vocab::id b) {
+        const float sa = shift(a);
+        const float sb = shift(b);
+        return sa < sb || (sa == sb && a < b);
+    });
+
+    int keep = n;
+
+    float cumsum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        cumsum += expf(logits[ids[i]] - log_norm);
+        if (cumsum >= p && i + 1 >= min_keep) {
+            keep = i + 1;
+            break;
+        }
+    }
+
+    // and back to the order of the logits
+    sampler.n_candidates = keep;
+    sampler.has_probs    = false;
+    std::sort(ids, ids + keep, llama_candidate_greater{ logits });
+}
+
+void llama_sample_tail_free(llama_sampler & sampler, float z, int min_keep) {
+    if (z >= 1.0f || sampler.n_candidates <= 2) {
+        return;
+    }
+
+    llama_sample_softmax(sampler);
+
+    float * probs = sampler.probs.data();
+
+    const int n = sampler.n_candidates;
+
+    // the absolute second derivatives of the probabilities, over the probabilities as each only needs those after it
+    float sum = 0.0f;
+    for (int i = 0; i < n - 2; ++i) {
+        probs[i] = fabsf(probs[i] - 2.0f*probs[i + 1] + probs[i + 2]);
+        sum += probs[i];
+    }
+
+    sampler.has_probs = false;
+
+    if (sum <= 0.0f) {
+        return;
+    }
+
+    float cumsum = 0.0f;
+    for (int i = 0; i < n - 2; ++i) {
+        cumsum += probs[i]/sum;
+        if (cumsum > z && i >= min_keep) {
+            sampler.n_candidates = i;
+            break;
+        }
+    }
+}
+
+gpt_vocab::id llama_sample_draw(llama_sampler & sampler, std::mt19937 & rng) {
+    // the probabilities need not be normalized, nor the candidates sorted
+    const float * logits = sampler.logits.data();
+    const gpt_vocab::id * ids = sampler.ids.data();
+    float * probs = sampler.probs.data();
+
+    const int n = sampler.n_candidates;
+
+    if (!sampler.has_probs) {
+        float maxl = -INFINITY;
+        for (int i = 0; i < n; ++i) {
+            maxl = std::max(maxl, logits[ids[i]]);
+        }
+        for (int i = 0; i < n; ++i) {
+            probs[i] = expf(logits[ids[i]] - maxl);
+        }
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        sum += probs[i];
+    }
+
+    const float r = std::uniform_real_distribution<float>(0.0f, sum)(rng);
+
+    float cumsum = 0.0f;
+    for (int i = 0; i < n - 1; ++i) {
+        cumsum += probs[i];
+        if (r < cumsum) {
+            return ids[i];
+        }
+    }
+
+    // r can round up to the sum: the last candidate that can be drawn, as those masked out by a grammar cannot
+    for (int i = n - 1; i > 0; --i) {
+        if (probs[i] > 0.0f) {
+            return ids[i];
+        }
+    }
+
+    return ids[0];
+}
+
+// draw a candidate and move mu towards the surprise it brings, from the probabilities of the candidates
+static gpt_vocab::id llama_sample_mirostat_draw(llama_sampler & sampler, float tau, float eta, float & mu, std::mt19937 & rng) {
+    llama_sample_softmax(sampler);
+
+    const gpt_vocab::id id = llama_sample_draw(sampler, rng);
+
+    int pos = 0;
+    while (sampler.ids[pos] != id) {
+        ++pos;
+    }
+
+    const float surprise = -log2f(sampler.probs[pos]);
+
+    mu -= eta*(surprise - tau);
+
+    return id;
+}
+
+gpt_vocab::id llama_sample_mirostat(llama_sampler & sampler, float tau, float eta, int m, float & mu, std::mt19937 & rng) {
+    if (sampler.n_candidates >= 2) {
+        // the Zipf exponent from the m best candidates - the log of the ratio of the probabilities of two candidates
+        // is the difference of their logits
+        const float * logits = sampler.logits.data();
+        const gpt_vocab::id * ids = sampler.ids.data();
+
+        m = std::max(2, std::min(m, sampler.n_candidates));
+
+        if (!sampler.sorted) {
+            llama_select_top_k(sampler.logits.data(), sampler.n_vocab, m, sampler.ids.data());
+        }
+
+        // the tokens masked out by a grammar are left out
+        while (m > 1 && logits[ids[m - 1]] == -INFINITY) {
+            --m;
+        }
+
+        float sum_ti_bi = 0.0f;
+        float sum_ti_sq = 0.0f;
+        for (int i = 0; i < m - 1; ++i) {
+            const float t_i = logf(float(i + 2)/float(i + 1));
+            const float b_i = logits[ids[i]] - logits[ids[i + 1]];
+            sum_ti_bi += t_i*b_i;
+            sum_ti_sq += t_i*t_i;
+        }
+        const float s_hat = sum_ti_bi/sum_ti_sq;
+
+        // the K that gives a surprise of mu under that Zipf distribution, or the only token that a grammar allows
+        const float epsilon_hat = s_hat - 1.0f;
+        const float k = m < 2 ? 1.0f : powf((epsilon_hat*powf(2.0f, mu))/(1.0f - powf(sampler.n_vocab, -epsilon_hat)), 1.0f/s_hat);
+
+        // unsorted candidates are selected from the logits again, whatever the ids hold
+        llama_sample_top_k(sampler, std::isfinite(k) ? (int) std::max(1.0f, std::min(k, (float) sampler.n_vocab)) : sampler.n_vocab);
+    }
+
+    return llama_sample_mirostat_draw(sampler, tau, eta, mu, rng);
+}
+
+gpt_vocab::id llama_sample_mirostat_v2(llama_sampler & sampler, float tau, float eta, float & mu, std::mt19937 & rng) {
+    const float * logits = sampler.logits.data();
+    gpt_vocab::id * ids  = sampler.ids.data();
+
+    const int n = sampler.n_candidates;
+
+    // the candidates with a surprise below mu, at least the best one: -log2(p) <= mu is a bound on the logit, so the
+    // vocab need not be sorted to find them
+    float maxl = -INFINITY;
+    for (int i = 0; i < n; ++i) {
+        maxl = std::max(maxl, logits[ids[i]]);
+    }
+
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        sum += expf(logits[ids[i]] - maxl);
+    }
+
+    const float threshold = maxl + logf(sum) - mu*logf(2.0f);
+
+    int keep = 0;
+    for (int i = 0; i < n; ++i) {
+        if (logits[ids[i]] >= threshold || logits[ids[i]] == maxl) {
+            ids[keep++] = ids[i];
+        }
+    }
+
+    std::sort(ids, ids + keep, llama_candidate_greater{ logits });
+
+    sampler.n_candidates = keep;
+    sampler.sorted       = true;
+    sampler.has_probs    = false;
+
+    return llama_sample_mirostat_draw(sampler, tau, eta, mu, rng);
+}
+
+gpt_vocab::id llama_sample_greedy(llama_sampler & sampler) {
+    llama_sample_top_k(sampler, 1);
+
+    return sampler.ids[0];
+}
+
+
+int llama_split_type(const std::string & name) {
+    if (name.find("tok_embeddings") != std::string::npos) {
+        return 0;
+    }
+    if (name.find("layers") != std::string::npos) {
+        if (name.find("attention.wo.weight") != std::string::npos ||
+            name.find("feed_forward.w2.weight") != std::string::npos) {
+            return 0;
+        }
+        return 1;
+    }
+    return 1;
+}
+
+size_t llama_ftype_nbytes(int32_t ftype, int32_t nelements) {
+    ggml_type type = GGML_TYPE_COUNT;
+    switch (ftype) {
+        case 0: type = GGML_TYPE_F32;  break;
+        case 1: type = GGML_TYPE_F16;  break;
+        case 2: type = GGML_TYPE_Q4_0; break;
+        case 3: type = GGML_TYPE_Q4_1; break;
+        default: return 0;
+    }
+
+    return (nelements*ggml_type_size(type))/ggml_blck_size(type);
+}
+
+// the tensor header shared by both file formats: n_dims, name length, ftype, shape and name
+static bool llama_read_tensor_header(std::istream & fin, llama_tensor_info & info) {
+    int32_t length;
+
+    fin.read(reinterpret_cast<char *>(&info.n_dims), sizeof(info.n_dims));
+    fin.read(reinterpret_cast<char *>(&length),      sizeof(length));
+    fin.read(reinterpret_cast<char *>(&info.ftype),  sizeof(info.ftype));
+
+    if (!fin || info.n_dims < 1 || info.n_dims > 2 || length <= 0) {
+        return false;
+    }
+
+    int32_t nelements = 1;
+    for (int i = 0; i < info.n_dims; ++i) {
+        fin.read(reinterpret_cast<char *>(&info.ne[i]), sizeof(info.ne[i]));
+        nelements *= info.ne[i];
+    }
+
+    info.name.resize(length);
+    fin.read(&info.name[0], length);
+
+    info.size = llama_ftype_nbytes(info.ftype, nelements);
+
+    return fin && info.size > 0;
+}
+
+bool llama_scan_tensors(std::istream & fin, std::vector<llama_tensor_info> & tensors) {
+    while (true) {
+        // stop cleanly at the end of the file
+        if (fin.peek() == std::char_traits<char>::eof()) {
+            break;
+        }
+
+        llama_tensor_info info;
+        if (!llama_read_tensor_header(fin, info)) {
+            return false;
+        }
+
+        info.offset = fin.tellg();
+
+        fin.seekg(info.size, std::ios::cur);
+
+        tensors.push_back(info);
+    }
+
+    fin.clear();
+
+    return true;
+}
+
+bool llama_read_tensor_index(std::istream & fin, std::vector<llama_tensor_info> & tensors) {
+    uint32_t n_tensors;
+    fin.read(reinterpret_cast<char *>(&n_tensors), sizeof(n_tensors));
+
+    if (!fin) {
+        return false;
+    }
+
+    tensors.resize(n_tensors);
+
+    for (auto & info : tensors) {
+        uint64_t offset;
+
+        if (!llama_read_tensor_header(fin, info)) {
+            return false;
+        }
+
+        fin.read(reinterpret_cast<char *>(&offset), sizeof(offset));
+        info.offset = offset;
+    }
+
+    return (bool) fin;
+}
+
+void llama_write_tensor_index(std::ostream & fout, const std::vector<llama_tensor_info> & tensors) {
+    const uint32_t n_tensors = tensors.size();
+    fout.write(reinterpret_cast<const char *>(&n_tensors), sizeof(n_tensors));
+
+    for (const auto & info : tensors) {
+        const int32_t  length = info.name.size();
+        const uint64_t offset = info.offset;
+
+        fout.write(reinterpret_cast<const char *>(&info.n_dims), sizeof(info.n_dims));
+        fout.write(reinterpret_cast<const char *>(&length),      sizeof(length));
+        fout.write(reinterpret_cast<const char *>(&info.ftype),  sizeof(info.ftype));
+        for (int i = 0; i < info.n_dims; ++i) {
+            fout.write(reinterpret_cast<const char *>(&info.ne[i]), sizeof(info.ne[i]));
+        }
+        fout.write(info.name.data(), length);
+        fout.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    }
+}
+
+size_t llama_tensor_index_size(const std::vector<llama_tensor_info> & tensors) {
+    size_t size = sizeof(uint32_t);
+
+    for (const auto & info : tensors) {
+        size += 3*sizeof(int32_t) + info.n_dims*sizeof(int32_t) + info.name.size() + sizeof(uint64_t);
+    }
+
+    return size;
+}
+
+// determine number of model parts based on the dimension
+static const std::map<int, int> LLAMA_N_PARTS = {
+    { 4096, 1 },
+    { 5120, 2 },
+    { 6656, 4 },
+    { 8192, 8 },
+};
+
+// tensor data must start on this boundary in the file to be used directly from a memory mapping
+static const size_t LLAMA_MMAP_ALIGN = 32;
+
+int llama_n_parts(int n_embd) {
+    const auto it = LLAMA_N_PARTS.find(n_embd);
+
+    return it != LLAMA_N_PARTS.end() ? it->second : 0;
+}
+
+ggml_type llama_ftype_to_ggml_type(int32_t ftype) {
+    switch (ftype) {
+        case 0: return GGML_TYPE_F32;
+        case 1: return GGML_TYPE_F16;
+        case 2: return GGML_TYPE_Q4_0;
+        case 3: return GGML_TYPE_Q4_1;
+        default: return GGML_TYPE_COUNT;
+    }
+}
+
+int llama_n_ff(const llama_hparams & hparams) {
+    return ((2*(4*hparams.n_embd)/3 + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+}
+
+bool llama_read_header(std::istream & fin, const std::string & fname, llama_hparams & hparams, bool & single_file, gpt_vocab * vocab, std::string & error) {
+    bool has_scores = false;
+
+    // verify magic
+    {
+        uint32_t magic;
+        fin.read((char *) &magic, sizeof(magic));
+        if (magic != LLAMA_FILE_MAGIC && magic != LLAMA_FILE_MAGIC_SCORES && magic != LLAMA_FILE_MAGIC_SINGLE) {
+            error = "invalid model file '" + fname + "' (bad magic)";
+            return false;
+        }
+
+        single_file = magic == LLAMA_FILE_MAGIC_SINGLE;
+        has_scores  = magic != LLAMA_FILE_MAGIC;
+    }
+
+    // verify version
+    if (single_file) {
+        uint32_t version;
+        uint32_t alignment;
+        fin.read((char *) &version,   sizeof(version));
+        fin.read((char *) &alignment, sizeof(alignment));
+        if (version != 1 && version != LLAMA_FILE_VERSION_SINGLE) {
+            error = "invalid model file '" + fname + "' (unsupported version " + std::to_string(version) + ")";
+            return false;
+        }
+
+        has_scores = version > 1;
+    } else if (has_scores) {
+        uint32_t version;
+        fin.read((char *) &version, sizeof(version));
+        if (version != LLAMA_FILE_VERSION) {
+            error = "invalid model file '" + fname + "' (unsupported version " + std::to_string(version) + ")";
+            return false;
+        }
+    }
+
+    // load hparams
+    {
+        fin.read((char *) &hparams.n_vocab, sizeof(hparams.n_vocab));
+        //fin.read((char *) &hparams.n_ctx,   sizeof(hparams.n_ctx));
+        fin.read((char *) &hparams.n_embd,  sizeof(hparams.n_embd));
+        fin.read((char *) &hparams.n_mult,  sizeof(hparams.n_mult));
+        fin.read((char *) &hparams.n_head,  sizeof(hparams.n_head));
+        fin.read((char *) &hparams.n_layer, sizeof(hparams.n_layer));
+        fin.read((char *) &hparams.n_rot,   sizeof(hparams.n_rot));
+        fin.read((char *) &hparams.f16,     sizeof(hparams.f16));
+
+        if (!single_file && llama_n_parts(hparams.n_embd) == 0) {
+            error = "invalid model file '" + fname + "' (unsupported model dimension " + std::to_string(hparams.n_embd) + ")";
+            return false;
+        }
+    }
+
+    // load vocab
+    {
+        const int32_t n_vocab = hparams.n_vocab;
+
+        if (vocab) {
+            *vocab = gpt_vocab();
+            vocab->offsets.reserve(n_vocab + 1);
+            vocab->scores.assign(has_scores ? n_vocab : 0, 0.0f);
+        }
+
+        for (int i = 0; i < n_vocab && fin; i++) {
+            uint32_t len;
+            fin.read((char *) &len, sizeof(len));
+
+            if (!vocab) {
+                fin.seekg(len + (has_scores ? sizeof(float) : 0), std::ios::cur);
+                continue;
+            }
+
+            // the text goes straight to the end of the arena
+            const size_t offset = vocab->arena.size();
+            vocab->arena.resize(offset + len);
+            fin.read(&vocab->arena[offset], len);
+            vocab->offsets.push_back(vocab->arena.size());
+
+            if (has_scores) {
+                fin.read((char *) &vocab->scores[i], sizeof(float));
+            }
+
+            //if (i < 30000) {
+            //    printf("%s: vocab[%d] = '%s'\n", __func__, i, vocab->text(i).str().c_str());
+            //}
+        }
+
+        if (vocab && fin) {
+            gpt_vocab_build(*vocab);
+        }
+    }
+
+    // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+    // in order to save memory and also to speed up the computation
+    if (llama_ftype_to_ggml_type(hparams.f16) == GGML_TYPE_COUNT) {
+        error = "invalid model file '" + fname + "' (bad f16 value " + std::to_string(hparams.f16) + ")";
+        return false;
+    }
+
+    if (!fin) {
+        error = "invalid model file '" + fname + "' (truncated header)";
+        return false;
+    }
+
+    return true;
+}
+
+bool llama_read_index(std::istream & fin, const std::string & fname, bool single_file, bool scan, std::vector<llama_tensor_info> & index, std::string & error) {
+    index.clear();
+
+    if (single_file) {
+        if (!llama_read_tensor_index(fin, index)) {
+            error = "invalid model file '" + fname + "' (bad tensor index)";
+            return false;
+        }
+    } else if (scan) {
+        if (!llama_scan_tensors(fin, index)) {
+            index.clear();
+        }
+    }
+
+    return true;
+}
+
+std::map<std::string, llama_tensor_info> llama_mapped_tensors(const std::vector<llama_tensor_info> & index, ggml_type wtype, size_t file_size) {
+    std::map<std::string, llama_tensor_info> mapped_tensors;
+
+    for (const auto & info : index) {
+        // the model expects 1d tensors in F32 and 2d tensors in wtype
+        const ggml_type type = info.n_dims == 1 ? GGML_TYPE_F32 : wtype;
+
+        if (llama_ftype_to_ggml_type(info.ftype) == type &&
+            info.offset % LLAMA_MMAP_ALIGN == 0 &&
+            info.offset + info.size <= file_size) {
+            mapped_tensors[info.name] = info;
+        }
+    }
+
+    return mapped_tensors;
+}
+
+int llama_stream_slots(const llama_hparams & hparams, int n_stream_layers) {
+    return n_stream_layers > 0 && n_stream_layers < hparams.n_layer ? n_stream_layers : 0;
+}
+
+// must match the layer weights created by llama_model_load()
+size_t llama_stream_slot_size(const llama_hparams & hparams) {
+    const int n_embd = hparams.n_embd;
+    const int n_ff   = llama_n_ff(hparams);
+
+    const ggml_type wtype = llama_ftype_to_ggml_type(hparams.f16);
+
+    size_t slot_size = 0;
+
+    auto add_weight = [&](ggml_type type, int ne0, int ne1) {
+        const size_t size = ggml_type_size(type)*(ne0/ggml_blck_size(type))*ne1;
+
+        slot_size += ((size + LLAMA_STREAM_ALIGN - 1)/LLAMA_STREAM_ALIGN)*LLAMA_STREAM_ALIGN;
+    };
+
+    add_weight(GGML_TYPE_F32, n_embd, 1); // attention_norm
+
+    add_weight(wtype, n_embd, n_embd); // wq
+    add_weight(wtype, n_embd, n_embd); // wk
+    add_weight(wtype, n_embd, n_embd); // wv
+    add_weight(wtype, n_embd, n_embd); // wo
+
+    add_weight(GGML_TYPE_F32, n_embd, 1); // ffn_norm
+
+    add_weight(wtype, n_embd,   n_ff); // w1
+    add_weight(wtype,   n_ff, n_embd); // w2
+    add_weight(wtype, n_embd,   n_ff); // w3
+
+    return slot_size;
+}
+
+// must match the weights created by llama_model_load()
+size_t llama_model_ctx_size(const llama_hparams & hparams, const std::map<std::string, llama_tensor_info> & mapped_tensors, bool stream_layers) {
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_vocab = hparams.n_vocab;
+    const int n_ff    = llama_n_ff(hparams);
+
+    const ggml_type wtype = llama_ftype_to_ggml_type(hparams.f16);
+
+    size_t ctx_size = 0;
+
+    auto add_weight = [&](const std::string & name, ggml_type type, int n_dims, int ne0, int ne1) {
+        const int ne[2] = { ne0, ne1 };
+
+        ctx_size += mapped_tensors.count(name) ? ggml_tensor_overhead() : ggml_tensor_mem_size(type, n_dims, ne);
+    };
+
+    auto add_layer_weight = [&](const std::string & name, ggml_type type, int n_dims, int ne0, int ne1) {
+        if (stream_layers) {
+            ctx_size += ggml_tensor_overhead();
+        } else {
+            add_weight(name, type, n_dims, ne0, ne1);
+        }
+    };
+
+    add_weight("tok_embeddings.weight", wtype, 2, n_embd, n_vocab);
+
+    add_weight("norm.weight",   GGML_TYPE_F32, 1, n_embd, 1);
+    add_weight("output.weight", wtype,         2, n_embd, n_vocab);
+
+    for (int i = 0; i < n_layer; ++i) {
+        const std::string prefix = "layers." + std::to_string(i) + ".";
+
+        add_layer_weight(prefix + "attention_norm.weight", GGML_TYPE_F32, 1, n_embd, 1);
+
+        add_layer_weight(prefix + "attention.wq.weight", wtype, 2, n_embd, n_embd);
+        add_layer_weight(prefix + "attention.wk.weight", wtype, 2, n_embd, n_embd);
+        add_layer_weight(prefix + "attention.wv.weight", wtype, 2, n_embd, n_embd);
+        add_layer_weight(prefix + "attention.wo.weight", wtype, 2, n_embd, n_embd);
+
+        add_layer_weight(prefix + "ffn_norm.weight", GGML_TYPE_F32, 1, n_embd, 1);
+
+        add_layer_weight(prefix + "feed_forward.w1.weight", wtype, 2, n_embd,   n_ff);
+        add_layer_weight(prefix + "feed_forward.w2.weight", wtype, 2,   n_ff, n_embd);
+        add_layer_weight(prefix + "feed_forward.w3.weight", wtype, 2, n_embd,   n_ff);
+    }
+
+    return ctx_size;
+}
+
+size_t llama_kv_memory_size(const llama_hparams & hparams, int n_ctx, ggml_type type) {
+    const int n_elements = hparams.n_embd*hparams.n_layer*n_ctx;
+
+    return 2*ggml_tensor_mem_size(type, 1, &n_elements);
+}
+
+size_t llama_eval_work_size(const llama_hparams & hparams, int N, int n_out, int n_threads) {
+    const int n_embd  = hparams.n_embd;
+    const int n_vocab = hparams.n_vocab;
+    const int n_ff    = llama_n_ff(hparams);
+
+    const ggml_type wtype = llama_ftype_to_ggml_type(hparams.f16);
+
+    // weights times activations with src1 of ne0 x ne1
+    auto mul_mat_work = [&](int ne00, int ne01, int ne10, int ne11) -> size_t {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        if (wtype != GGML_TYPE_F32 && ne01 >= 32 && ne11 >= 32 && ne10 >= 32) {
+            return ggml_type_size(GGML_TYPE_F32)*ne00*ne01;
+        }
+#else
+        (void) ne00;
+        (void) ne01;
+#endif
+        switch (wtype) {
+            case GGML_TYPE_F16:  return ggml_type_size(GGML_TYPE_F16)*ne10*ne11;
+            case GGML_TYPE_Q4_0:
+            case GGML_TYPE_Q4_1: return (ggml_type_size(wtype)*ne10*ne11)/ggml_blck_size(wtype);
+            default:             return 0;
+        }
+    };
+
+    size_t work_size = 0;
+
+    work_size = std::max(work_size, mul_mat_work(n_embd, n_embd,  n_embd, N));     // wq, wk, wv, wo
+    work_size = std::max(work_size, mul_mat_work(n_embd, n_ff,    n_embd, N));     // w1, w3
+    work_size = std::max(work_size, mul_mat_work(n_ff,   n_embd,  n_ff,   N));     // w2
+    work_size = std::max(work_size, mul_mat_work(n_embd, n_vocab, n_embd, n_out)); // lm_head
+
+    // KQV: V_trans is transposed, every thread gets a copy of the result
+    work_size = std::max(work_size, ggml_type_size(GGML_TYPE_F32)*n_embd*N*n_threads);
+
+    return work_size;
+}
+
+// must match the tensors created by llama_eval(), which are the largest for n_batch tokens at the end of the
+// context, with the logits computed for all of them
+size_t llama_eval_buffer_size(const llama_hparams & hparams, int n_ctx, int n_batch, int n_threads, bool stream_layers) {
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+    const int n_vocab = hparams.n_vocab;
+    const int n_ff    = llama_n_ff(hparams);
+
+    const int N     = std::min(n_batch, n_ctx);
+    const int n_out = N;
+    const int n_kv  = n_ctx; // n_past + N
+
+    // a new tensor, and a view or an in-place op
+    auto tensor = [](ggml_type type, int ne0, int ne1 = 1, int ne2 = 1) {
+        const int ne[3] = { ne0, ne1, ne2 };
+        return ggml_tensor_mem_size(type, 3, ne);
+    };
+    const size_t view = ggml_tensor_overhead();
+
+    size_t size = 0;
+
+    size += tensor(GGML_TYPE_I32, N);         // embd
+    size += tensor(GGML_TYPE_F32, n_embd, N); // inpL
+
+    {
+        size_t layer = 0;
+
+        layer += tensor(GGML_TYPE_F32, n_embd, N) + view;                             // norm, attention_norm
+        layer += 3*tensor(GGML_TYPE_F32, n_embd, N);                                  // Qcur, Kcur, Vcur
+        layer += 4*view;                                                              // k, v and their copies
+        layer += tensor(GGML_TYPE_F32, n_embd/n_head, n_head, N) + view;              // Q: copy
+        layer += view + tensor(GGML_TYPE_I32, 3) + view;                              // Q: rope, permute
+        layer += 2*view + view + tensor(GGML_TYPE_I32, 3) + view;                     // K: view, reshape, rope, permute
+        layer += tensor(GGML_TYPE_F32, n_kv, N, n_head);                              // KQ
+        layer += view + tensor(GGML_TYPE_F32, 1);                                     // KQ_scaled
+        layer += view + tensor(GGML_TYPE_I32, 1);                                     // KQ_masked
+        layer += view;                                                                // KQ_soft_max
+        layer += 3*view;                                                              // V_trans
+        layer += tensor(GGML_TYPE_F32, n_embd/n_head, N, n_head) + view;              // KQV, KQV_merged
+        layer += tensor(GGML_TYPE_F32, n_embd, N) + view;                             // cur: copy
+        layer += tensor(GGML_TYPE_F32, n_embd, N) + view;                             // wo, inpFF
+        layer += tensor(GGML_TYPE_F32, n_embd, N) + view;                             // norm, ffn_norm
+        layer += 2*tensor(GGML_TYPE_F32, n_ff, N) + 2*view;                           // w3, w1, silu, mul
+        layer += tensor(GGML_TYPE_F32, n_embd, N) + view;                             // w2, add
+
+        if (stream_layers) {
+            layer += view;                                                            // input of the next layer's graph
+        }
+
+        size += n_layer*layer;
+    }
+
+    if (N > 1) {
+        size += tensor(GGML_TYPE_I32, n_out) + tensor(GGML_TYPE_F32, n_embd, n_out); // rows
+    }
+
+    size += tensor(GGML_TYPE_F32, n_embd, n_out) + view; // norm
+    size += tensor(GGML_TYPE_F32, n_vocab, n_out);       // lm_head
+
+    // work buffer of ggml_graph_compute()
+    size += ggml_graph_work_mem_size(llama_eval_work_size(hparams, N, n_out, n_threads), n_threads);
+
+    return size;
+}
+
+bool llama_model_footprint(const std::string & fname, int n_ctx, int n_batch, int n_threads, bool use_mmap, int n_stream_layers, llama_memory_footprint & footprint, std::string & error) {
+    auto fin = std::ifstream(fname, std::ios::binary);
+    if (!fin) {
+        error = "failed to open '" + fname + "'";
+        return false;
+    }
+
+    llama_hparams hparams;
+    bool single_file = false;
+
+    if (!llama_read_header(fin, fname, hparams, single_file, nullptr, error)) {
+        return false;
+    }
+
+    const int n_parts = single_file ? 1 : llama_n_parts(hparams.n_embd);
+
+    const int n_slots = llama_stream_slots(hparams, n_stream_layers);
+    if (n_slots > 0) {
+        use_mmap = false;
+    }
+
+    std::vector<llama_tensor_info> index;
+
+    if (!llama_read_index(fin, fname, single_file, use_mmap && n_parts == 1, index, error)) {
+        return false;
+    }
+
+    // the same weights as llama_model_load() would map, assuming the mapping succeeds - if it does not, they are
+    // read into the model context instead and the total stays the same
+    std::map<std::string, llama_tensor_info> mapped_tensors;
+
+    if (use_mmap && !index.empty()) {
+        fin.seekg(0, std::ios::end);
+
+        mapped_tensors = llama_mapped_tensors(index, llama_ftype_to_ggml_type(hparams.f16), fin.tellg());
+    }
+
+    footprint = {};
+
+    footprint.weights = llama_model_ctx_size(hparams, mapped_tensors, n_slots > 0);
+    for (const auto & kv : mapped_tensors) {
+        footprint.mapped += kv.second.size;
+    }
+    footprint.stream = n_slots*llama_stream_slot_size(hparams);
+
+    n_batch   = std::max(1, std::min(n_batch, n_ctx));
+    n_threads = std::max(1, n_threads);
+
+    footprint.kv      = llama_kv_memory_size(hparams, n_ctx, GGML_TYPE_F32);
+    footprint.compute = llama_eval_buffer_size(hparams, n_ctx, n_batch, n_threads, n_slots > 0);
+
+    return true;
+}
+
+static const size_t LLAMA_HUGE_PAGE_SIZE = 2*1024*1024;
+
+llama_buffer::~llama_buffer() {
+    llama_buffer_free(*this);
+}
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+static void * llama_map_huge_pages(size_t size, llama_buffer_type & type) {
+#if defined (MAP_HUGETLB)
+    // needs pages reserved in /proc/sys/vm/nr_hugepages
+    {
+        void * addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            type = LLAMA_BUFFER_HUGETLB;
+            return addr;
+        }
+    }
+#endif
+
+#if defined (MADV_HUGEPAGE)
+    // transparent huge pages are only used for 2 MB aligned ranges: over-allocate, then trim to an aligned range
+    {
+        const size_t length = size + LLAMA_HUGE_PAGE_SIZE;
+
+        char * addr = (char *) mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr != MAP_FAILED) {
+            char * start = (char *) ((((uintptr_t) addr + LLAMA_HUGE_PAGE_SIZE - 1)/LLAMA_HUGE_PAGE_SIZE)*LLAMA_HUGE_PAGE_SIZE);
+
+            if (start > addr) {
+                munmap(addr, start - addr);
+            }
+            if (start + size < addr + length) {
+                munmap(start + size, addr + length - (start + size));
+            }
+
+            if (madvise(start, size, MADV_HUGEPAGE) == 0) {
+                type = LLAMA_BUFFER_THP;
+                return start;
+            }
+
+            munmap(start, size);
+        }
+    }
+#endif
+
+#if defined (VM_FLAGS_SUPERPAGE_SIZE_2MB)
+    // not available on Apple silicon, where the mapping fails
+    {
+        void * addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+        if (addr != MAP_FAILED) {
+            type = LLAMA_BUFFER_SUPERPAGE;
+            return addr;
+        }
+    }
+#endif
+
+    return nullptr;
+}
+#endif
+
+bool llama_buffer_alloc(llama_buffer & buf, size_t size, bool use_huge_pages) {
+    llama_buffer_free(buf);
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+    if (use_huge_pages) {
+        const size_t mapped_size = ((size + LLAMA_HUGE_PAGE_SIZE - 1)/LLAMA_HUGE_PAGE_SIZE)*LLAMA_HUGE_PAGE_SIZE;
+
+        buf.data = llama_map_huge_pages(mapped_size, buf.type);
+        if (buf.data) {
+            buf.size = size;
+            buf.mapped_size = mapped_size;
+            return true;
+        }
+    }
+#endif
+
+    buf.data = malloc(size);
+    if (buf.data == nullptr) {
+        return false;
+    }
+
+    buf.size = size;
+    buf.type = LLAMA_BUFFER_MALLOC;
+
+    return true;
+}
+
+void llama_buffer_free(llama_buffer & buf) {
+    if (buf.data) {
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+        if (buf.type != LLAMA_BUFFER_MALLOC) {
+            munmap(buf.data, buf.mapped_size);
+        } else {
+            free(buf.data);
+        }
+#else
+        free(buf.data);
+#endif
+    }
+
+    buf.data = nullptr;
+    buf.size = 0;
+    buf.type = LLAMA_BUFFER_MALLOC;
+    buf.mapped_size = 0;
+}
+
+const char * llama_buffer_type_name(llama_buffer_type type) {
+    switch (type) {
+        case LLAMA_BUFFER_MALLOC:    return "malloc";
+        case LLAMA_BUFFER_HUGETLB:   return "hugetlb";
+        case LLAMA_BUFFER_THP:       return "transparent huge pages";
+        case LLAMA_BUFFER_SUPERPAGE: return "superpages";
+    }
+
+    return "unknown";
+}
+
+// parse a CPU list from /sys, e.g. "0-3,8-11"
+static std::vector<int> llama_parse_cpu_list(const std::string & str) {
+    std::vector<int> cpus;
+
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos) {
+            end = str.size();
+        }
+
+        const std::string range = str.substr(pos, end - pos);
+
+        int first = 0;
+        int last  = 0;
+        const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n == 1) {
+            cpus.push_back(first);
+        } else if (n == 2) {
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+
+        pos = end + 1;
+    }
+
+    return cpus;
+}
+
+bool llama_numa_topology_read(llama_numa_topology & topology) {
+    topology.node_cpus.clear();
+
+    for (int node = 0; ; ++node) {
+        std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!fin) {
+            break;
+        }
+
+        std::string line;
+        std::getline(fin, line);
+
+        topology.node_cpus.push_back(llama_parse_cpu_list(line));
+    }
+
+    return !topology.node_cpus.empty();
+}
+
+std::vector<int> llama_numa_thread_cpus(const llama_numa_topology & topology, int n_threads, int slot) {
+    std::vector<int> cpus(n_threads, 0);
+
+    const int n_nodes = topology.n_nodes();
+    if (n_nodes == 0) {
+        return cpus;
+    }
+
+    for (int i = 0; i < n_threads; ++i) {
+        const int node  = (int64_t) i*n_nodes/n_threads;
+        const int first = (n_threads*node + n_nodes - 1)/n_nodes;       // first thread of the node
+        const int last  = (n_threads*(node + 1) + n_nodes - 1)/n_nodes; // first thread of the next node
+
+        const auto & node_cpus = topology.node_cpus[node];
+        const size_t index = (size_t) slot*(last - first) + (i - first);
+        if (slot > 0 && index >= node_cpus.size()) {
+            return {};
+        }
+
+        cpus[i] = node_cpus.empty() ? 0 : node_cpus[index % node_cpus.size()];
+    }
+
+    return cpus;
+}
+
+#if defined (__linux__)
+static bool llama_mbind(void * addr, size_t size, int mode, const std::vector<int> & nodes) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    const uintptr_t start = ((uintptr_t) addr/page_size)*page_size;
+    const uintptr_t end   = (((uintptr_t) addr + size + page_size - 1)/page_size)*page_size;
+
+    const size_t bits = 8*sizeof(unsigned long);
+
+    int max_node = 0;
+    for (int node : nodes) {
+        max_node = std::max(max_node, node);
+    }
+
+    std::vector<unsigned long> mask(max_node/bits + 1, 0);
+    for (int node : nodes) {
+        mask[node/bits] |= 1ul << (node % bits);
+    }
+
+    // the kernel reads one bit less than maxnode
+    return syscall(SYS_mbind, start, end - start, mode, mask.data(), mask.size()*bits + 1, MPOL_MF_MOVE) == 0;
+}
+#endif
+
+bool llama_numa_interleave(void * addr, size_t size, int n_nodes) {
+#if defined (__linux__)
+    std::vector<int> nodes;
+    for (int node = 0; node < n_nodes; ++node) {
+        nodes.push_back(node);
+    }
+
+    return llama_mbind(addr, size, MPOL_INTERLEAVE, nodes);
+#else
+    return false;
+#endif
+}
+
+bool llama_numa_bind(void * addr, size_t size, int node) {
+#if defined (__linux__)
+    return llama_mbind(addr, size, MPOL_PREFERRED, { node });
+#else
+    return false;
+#endif
+}
 
 size_t ggml_quantize_q4_0(float * src, void * dst, int n, int k, int qk, int64_t * hist) {
     const int nb = k / qk;
@@ -2,7 +2,10 @@
 
 #pragma once
 
+#include "ggml.h"
+
 #include <string>
+#include <iosfwd>
 #include <map>
 #include <vector>
 #include <random>
@@ -12,21 +15,48 @@
 // CLI argument parsing
 //
 
+// placement of the weights on machines with several NUMA nodes, see LlamaModel.mm
+enum llama_numa_strategy {
+    LLAMA_NUMA_NONE,
+    LLAMA_NUMA_INTERLEAVE, // the pages of the weights go round-robin to the nodes
+    LLAMA_NUMA_PARTITION,  // every weight is split by rows in one block per node, the compute threads are pinned to match
+};
+
 struct gpt_params {
     int32_t seed      = -1; // RNG seed
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_predict = 128; // new tokens to predict
     int32_t repeat_last_n = 64;  // last n tokens to penalize
+    int32_t n_ctx = 512; // context size
 
     // sampling parameters
     int32_t top_k = 40;
     float   top_p = 0.95f;
     float   temp  = 0.80f;
     float   repeat_penalty  = 1.30f;
+    float   frequency_penalty = 0.00f; // subtracted from the logit of a token for each of its last n occurrences
+    float   presence_penalty  = 0.00f; // subtracted once if it occurs in the last n tokens
+    float   typical_p = 1.00f; // locally typical sampling, 1.0 = disabled
+    float   tfs_z     = 1.00f; // tail free sampling, 1.0 = disabled
+    int32_t mirostat  = 0;     // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
+    float   mirostat_tau = 5.00f; // target surprise
+    float   mirostat_eta = 0.10f; // learning rate
+
+    // grammar of the generation, see llama_grammar
+    bool        grammar_json = false; // a JSON value
+    std::string grammar_regex;        // text that matches the regex whole, if not empty
 
     int32_t n_batch = 8; // batch size for prompt processing
 
+    // speculative decoding, see llama_sampler_verify()
+    std::string draft_model; // a small model of the same vocab that proposes the tokens, if not empty
+    int32_t n_draft = 4;     // tokens proposed at a time, evaluated by the model in one batch
+
     std::string model = "models/lamma-7B/ggml-model.bin"; // model path
+    bool use_mmap = true; // map the model file instead of reading it where possible
+    bool use_huge_pages = false; // back the model context and the session buffers with 2 MB pages where possible
+    llama_numa_strategy numa = LLAMA_NUMA_NONE;
+    int32_t n_stream_layers = 0; // decoder layers held in memory at a time, read from the model file as needed (0 = all)
     std::string prompt;
 
     bool use_color = false; // use color to distinguish generations and inputs
@@ -46,18 +76,86 @@ std::string gpt_random_prompt(std::mt19937 & rng);
 // Vocab utils
 //
 
+// byte trie of the tokens of a vocab, for the longest-match tokenization of llama_tokenize()
+//
+// the nodes and their edges are stored flat, the edges of a node sorted by byte - the root, which has an edge for
+// almost every byte, is looked up directly instead
+struct gpt_vocab_trie {
+    struct node {
+        int32_t  id      = -1; // token that ends at this node, or -1
+        uint32_t edges   = 0;  // first edge of the node
+        uint32_t n_edges = 0;
+    };
+
+    struct edge {
+        uint8_t  byte;
+        uint32_t node;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+    std::vector<edge> edges;
+
+    uint32_t root[256] = {}; // node reached from the root by each byte, or 0 if none
+};
+
+// the text of a token, which points into the vocab it comes from
+struct gpt_token_text {
+    const char * data;
+    size_t size;
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+};
+
+// the tokens are stored flat: their text one after the other in a single arena, with the offset of each id in it,
+// and an open-addressing hash table of the ids by text
+//
+// fill it with gpt_vocab_add() in the order of the ids, then call gpt_vocab_build() before using it
 struct gpt_vocab {
     using id    = int32_t;
     using token = std::string;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    std::string           arena;           // the text of all the tokens
+    std::vector<uint32_t> offsets = { 0 }; // the text of token i is arena[offsets[i], offsets[i + 1])
+
+    std::vector<id> table; // ids by the hash of their text, -1 for an empty slot - its size is a power of 2
+
+    std::vector<float> scores; // of each token for the merges of llama_tokenize(), empty if the model file has none
+
+    gpt_vocab_trie trie; // of the tokens, see gpt_vocab_build()
+
+    // number of tokens
+    int size() const {
+        return offsets.size() - 1;
+    }
+
+    gpt_token_text text(id i) const {
+        return { arena.data() + offsets[i], offsets[i + 1] - offsets[i] };
+    }
 };
 
+// append a token to the vocab, with the next id
+void gpt_vocab_add(gpt_vocab & vocab, const char * text, size_t n);
+
+// build the hash table and the trie of the vocab once all of its tokens are added - if several tokens have the same
+// text, the one with the highest id is found and matched
+void gpt_vocab_build(gpt_vocab & vocab);
+
+// whether the n bytes of text are a token of the vocab, and its id
+bool gpt_vocab_find(const gpt_vocab & vocab, const char * text, size_t n, gpt_vocab::id & id);
+
+// length of the longest token of the trie that text starts with, and its id - 0 if there is none
+size_t gpt_vocab_trie_match(const gpt_vocab_trie & trie, const char * text, size_t n, gpt_vocab::id & id);
+
 void replace(std::string & str, const std::string & needle, const std::string & replacement);
 
-// poor-man's JSON parsing
-std::map<std::string, int32_t> json_parse(const std::string & fname);
+// read the tokens of encoder.json into the vocab in the order of their ids, without building it
+//
+// the file is read at once and parsed in a single pass, with the keys decoded over the text they are read from -
+// \u0120 and \u010a stand for the space and the new line, ids that are missing get an empty token and the keys of
+// values that are not integers are ignored
+bool json_parse(const std::string & fname, gpt_vocab & vocab);
 
 // split text into tokens
 //
@@ -71,13 +169,92 @@ std::map<std::string, int32_t> json_parse(const std::string & fname);
 //
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text);
 
-// TODO: this is probably wrong, but I cannot figure out how this tokenizer works ..
+// split text into the words of the C++ regex above, as the offset and length of each word in the text
+//
+// the text is scanned by hand with the classes of the regex in the "C" locale - letters and digits are ASCII, and
+// the bytes of the other UTF-8 characters are punctuation, so a character is never split
+void gpt_split_words(const std::string & text, std::vector<std::pair<size_t, size_t>> & words);
+
+// split text into tokens the way the SentencePiece BPE model of LLaMA does
+//
 // ref: https://github.com/google/sentencepiece
+//
+// the text starts as one symbol per UTF-8 character, then the adjacent pair of symbols that forms the token with the
+// highest score is merged until no pair forms a token - the leftmost pair first if scores tie. symbols that are not
+// tokens fall back to the tokens of their bytes
+//
+// a vocab without scores, read from an older model file, is split greedily into the longest tokens instead
 std::vector<gpt_vocab::id> llama_tokenize(const gpt_vocab & vocab, const std::string & text, bool bos);
 
-// load the tokens from encoder.json
+// load the tokens from encoder.json and build the trie
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab);
 
+// the control tokens of the LLaMA vocab, which have no text
+#define LLAMA_TOKEN_BOS 1
+#define LLAMA_TOKEN_EOS 2
+
+//
+// Grammars
+//
+
+// the nesting of the JSON values that llama_grammar_json() allows by default
+#define LLAMA_GRAMMAR_JSON_DEPTH 8
+
+// a grammar that the text of a generation must follow, compiled to a DFA over its bytes, together with the tokens of
+// the vocab that each state of the DFA allows next
+//
+// the bytes fall into classes that no transition tells apart, so a state only takes a row of n_classes transitions.
+// the tokens that a state allows are found by walking the trie of the vocab along the DFA, the first time the state
+// is reached, and are kept as a bitset of the vocab - after that, masking the logits by the grammar costs a pass over
+// the bitset and the step of the DFA past a token one lookup per byte
+//
+// EOS is allowed in the states where the text may end, and in those where no token of the vocab fits the grammar
+struct llama_grammar {
+    const gpt_vocab * vocab = nullptr;
+
+    int n_states  = 0; // state 0 is the start
+    int n_classes = 0;
+
+    uint8_t classes[256] = {}; // class of each byte
+
+    std::vector<int32_t> next;      // next[state*n_classes + class], -1 if the byte is not allowed
+    std::vector<uint8_t> accepting; // whether the text may end in the state
+
+    // the tokens that the states reached so far allow, n_words words per state - mask_index is the index of the
+    // bitset of each state in masks, or -1 if the state has not been reached yet
+    int n_words = 0;
+    std::vector<int32_t>  mask_index;
+    std::vector<uint64_t> masks;
+
+    // tokens that the trie leaves out because a later token has the same text, with that token
+    std::vector<std::pair<gpt_vocab::id, gpt_vocab::id>> aliases;
+
+    // the nodes of the trie and the states of the DFA left to visit while a bitset is computed
+    std::vector<std::pair<uint32_t, int32_t>> stack;
+};
+
+// compile a regex that the whole text must match, for the tokens of the vocab - the vocab must outlive the grammar
+//
+// the regex is matched over bytes and supports the ECMAScript syntax without backreferences, lookarounds and the
+// anchors inside it: literals and escapes, ., classes with ranges and negation, \d \w \s and their negations, \xHH,
+// groups, alternation and the quantifiers * + ? {n} {n,} {n,m}
+bool llama_grammar_regex(llama_grammar & grammar, const gpt_vocab & vocab, const std::string & pattern, std::string & error);
+
+// compile the grammar of a JSON value, with objects and arrays nested up to max_depth deep and strings of valid UTF-8,
+// for the tokens of the vocab - the vocab must outlive the grammar
+bool llama_grammar_json(llama_grammar & grammar, const gpt_vocab & vocab, int max_depth, std::string & error);
+
+// the state after a byte, -1 if the grammar does not allow it
+inline int llama_grammar_step(const llama_grammar & grammar, int state, uint8_t c) {
+    return grammar.next[state*grammar.n_classes + grammar.classes[c]];
+}
+
+// the state after the text of a token, -1 if the grammar does not allow it
+int llama_grammar_advance(const llama_grammar & grammar, int state, gpt_vocab::id id);
+
+// the tokens that the state allows next, as a bitset of the vocab - computed the first time the state is reached
+const uint64_t * llama_grammar_mask(llama_grammar & grammar, int state);
+
 // sample next token given probabilities for each embedding
 //
 //   - consider only the top K tokens
@@ -93,9 +270,413 @@ gpt_vocab::id llama_sample_top_p_top_k(
         double temp,
         std::mt19937 & rng);
 
+// divide the logits of the tokens in last_n_tokens by repeat_penalty, or multiply them if they are negative
+//
+// logits_id holds the logits of the whole vocab in the order of their ids - only the distinct recent tokens are
+// visited, so this takes O(repeat_last_n) instead of a search of last_n_tokens for every id
+void llama_apply_repeat_penalty(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, const std::vector<gpt_vocab::id> & last_n_tokens, double repeat_penalty);
+
+// write the ids of the k greatest of the n scores to ids, best first and the lowest id first on ties, and return
+// their number - ids is also used as scratch and must have room for n ids
+//
+// rather than sorting all the scores, a histogram of a sample of them - or of all of them, if the sample falls short -
+// gives a threshold above which at least k of them lie, and only those are sorted. the passes over all the scores use
+// SSE2 or NEON where available
+int llama_select_top_k(const float * scores, int n, int k, gpt_vocab::id * ids);
+
 // filer to top K tokens from list of logits
 void sample_top_k(std::vector<std::pair<double, gpt_vocab::id>> & logits_id, int top_k);
 
+// the stages of the sampler pipeline, see llama_sampler_run()
+enum llama_sampler_stage_type {
+    LLAMA_SAMPLER_GRAMMAR,            // the tokens that the grammar of the sampler allows, if it has one
+    LLAMA_SAMPLER_REPETITION_PENALTY, // value: the penalty of the CTRL paper
+    LLAMA_SAMPLER_FREQUENCY_PENALTY,  // value: the frequency penalty, value2: the presence penalty
+    LLAMA_SAMPLER_TEMPERATURE,        // value: the temperature
+    LLAMA_SAMPLER_TOP_K,              // n: K
+    LLAMA_SAMPLER_TOP_P,              // value: P
+    LLAMA_SAMPLER_TYPICAL,            // value: P of locally typical sampling
+    LLAMA_SAMPLER_TAIL_FREE,          // value: z of tail free sampling
+    LLAMA_SAMPLER_MIROSTAT,           // value: tau, value2: eta, n: the tokens that estimate the Zipf exponent
+    LLAMA_SAMPLER_MIROSTAT_V2,        // value: tau, value2: eta
+    LLAMA_SAMPLER_GREEDY,             // the best candidate
+};
+
+struct llama_sampler_stage {
+    llama_sampler_stage_type type;
+
+    float value;
+    float value2;
+    int   n;
+
+    llama_sampler_stage(llama_sampler_stage_type type, float value = 0.0f, float value2 = 0.0f, int n = 0)
+        : type(type), value(value), value2(value2), n(n) {}
+};
+
+// the state of the sampling of a generation, with the buffers that the stages of the sampler work in
+//
+// everything is allocated once by llama_sampler_init(), sampling a token and accepting it allocate nothing
+struct llama_sampler {
+    int n_vocab = 0;
+
+    // the last repeat_last_n tokens, as a ring buffer, and the number of times each token occurs in it
+    std::vector<gpt_vocab::id> last_n_tokens;
+    int last_n_pos = 0; // the oldest token, which the next accepted one replaces
+    std::vector<int> last_n_counts;
+
+    // the candidates of the token being sampled, which every stage works on in place: ids[0, n_candidates) with the
+    // logits of the whole vocab by id
+    //
+    // they start out as the whole vocab in the order of the ids, and once sorted stay in decreasing order of their
+    // logits - the stages that cut them sort them first
+    std::vector<float>         logits; // logits of the vocab, as the stages changed them
+    std::vector<gpt_vocab::id> ids;
+    std::vector<float>         probs;  // softmax of the logits of the candidates, in their order, once computed
+    int  n_candidates = 0;
+    bool sorted       = false;
+    bool has_probs    = false;
+
+    // the recent tokens already penalized by the current stage are marked with its epoch
+    std::vector<uint32_t> penalized;
+    uint32_t epoch = 0;
+
+    // the stages run by llama_sampler_run(), and the target surprise of mirostat, which it updates with every token
+    std::vector<llama_sampler_stage> stages;
+    float mirostat_mu = 0.0f;
+
+    // the grammar the sampled tokens follow and its state, see llama_sampler_set_grammar()
+    llama_grammar * grammar = nullptr;
+    int grammar_state = 0;
+};
+
+// allocate the buffers of a sampler for a vocab of n_vocab tokens, with a window of repeat_last_n recent tokens that
+// starts out filled with token 0
+void llama_sampler_init(llama_sampler & sampler, int n_vocab, int repeat_last_n);
+
+// set the stages run by llama_sampler_run() and reset the state of mirostat
+void llama_sampler_set_stages(llama_sampler & sampler, const std::vector<llama_sampler_stage> & stages);
+
+// the stages of the sampling described by the parameters:
+//
+//   - the repetition, frequency and presence penalties, if they are set
+//   - the greedy choice if the temperature is not positive, or else the temperature
+//   - mirostat or mirostat 2.0, if chosen - or else top K, tail free, locally typical and top P sampling
+//
+std::vector<llama_sampler_stage> llama_sampler_stages(const gpt_params & params);
+
+// constrain the sampled tokens to a grammar, from its start state, or lift the constraint if grammar is null - the
+// grammar is not owned and its bitsets are filled in as it is used
+void llama_sampler_set_grammar(llama_sampler & sampler, llama_grammar * grammar);
+
+// add a token to the recent tokens, in place of the oldest one
+void llama_sampler_accept(llama_sampler & sampler, gpt_vocab::id id);
+
+// move the grammar of the sampler past a sampled token - the tokens of the prompt do not go through the grammar
+void llama_sampler_advance(llama_sampler & sampler, gpt_vocab::id id);
+
+// sample the next token from the logits of the vocab with the stages of the sampler, then draw it from the candidates
+// they leave unless the last stage picked it - the token is not accepted
+gpt_vocab::id llama_sampler_run(llama_sampler & sampler, const float * logits, std::mt19937 & rng);
+
+// sample the next token from the logits of the vocab as llama_sample_top_p_top_k() does, with the repetition penalty,
+// temperature, top K and top P stages - the token is not accepted
+gpt_vocab::id llama_sampler_sample(
+        llama_sampler & sampler,
+        const float * logits,
+        float repeat_penalty,
+        int top_k,
+        float top_p,
+        float temp,
+        std::mt19937 & rng);
+
+// speculative sampling: a draft model proposes a token, which the sampler of the model accepts with probability
+// min(1, p/q) - p and q the probabilities that the two samplers give it - or else replaces by a token drawn from
+// max(0, p - q), normalized, so that the tokens are distributed as if the model had sampled them itself
+//
+// ref: https://arxiv.org/abs/2211.17192, https://arxiv.org/abs/2302.01318
+
+// a token proposed by the sampler of a draft model, with the distribution it was drawn from
+struct llama_draft {
+    gpt_vocab::id id = 0;
+
+    std::vector<float>         probs; // the probability of every token of the vocab, by id
+    std::vector<gpt_vocab::id> ids;   // the candidates, the only tokens whose probability may not be 0
+};
+
+// whether the stages draw the token from a distribution that drawing it leaves unchanged, which speculative sampling
+// needs - mirostat adapts to every token it draws
+bool llama_sampler_can_speculate(const std::vector<llama_sampler_stage> & stages);
+
+// run the stages of the sampler on the logits of the vocab up to the draw, and leave the normalized probabilities of
+// the candidates in probs - the stages must be able to speculate
+void llama_sampler_probs(llama_sampler & sampler, const float * logits);
+
+// copy the recent tokens and the grammar state of a sampler into one of the same vocab and window, such as that of a
+// draft model catching up with the tokens that the model accepted
+void llama_sampler_sync(llama_sampler & dst, const llama_sampler & src);
+
+// draw a token from the logits of a draft model and keep the distribution it was drawn from - the token is not
+// accepted
+gpt_vocab::id llama_sampler_draft(llama_sampler & sampler, const float * logits, llama_draft & draft, std::mt19937 & rng);
+
+// check the token of a draft against the logits of the model: accepted tells whether it is the token returned, or
+// else the token drawn in its place - the token is not accepted
+gpt_vocab::id llama_sampler_verify(llama_sampler & sampler, const float * logits, const llama_draft & draft, bool & accepted, std::mt19937 & rng);
+
+// the stages of the sampler, which can also be chained by hand between llama_sample_begin() and a stage that picks
+// the token
+//
+// ref: https://arxiv.org/abs/1909.05858 (repetition penalty), https://arxiv.org/abs/1904.09751 (top P),
+//      https://arxiv.org/abs/2202.00666 (locally typical), https://www.trentonbricken.com/Tail-Free-Sampling/,
+//      https://arxiv.org/abs/2007.14966 (mirostat)
+
+// make the whole vocab with the given logits the candidates
+void llama_sample_begin(llama_sampler & sampler, const float * logits);
+
+// set the logits of the tokens that the state of the grammar does not allow to -inf, or drop them from the candidates
+// once sorted - the best token the grammar allows is kept if none of the candidates is
+void llama_sample_grammar(llama_sampler & sampler, llama_grammar & grammar, int state);
+
+// divide the logits of the recent tokens by penalty, or multiply them if they are negative
+void llama_sample_repetition_penalty(llama_sampler & sampler, float penalty);
+
+// subtract from the logit of each recent token alpha_frequency times the number of its occurrences, and alpha_presence
+void llama_sample_frequency_penalty(llama_sampler & sampler, float alpha_frequency, float alpha_presence);
+
+// divide the logits of the candidates by the temperature, which must be positive
+void llama_sample_temperature(llama_sampler & sampler, float temp);
+
+// keep the K best candidates, at least min_keep - K <= 0 keeps them all
+void llama_sample_top_k(llama_sampler & sampler, int k, int min_keep = 1);
+
+// keep the best candidates with a cumulative probability of at least P, at least min_keep
+void llama_sample_top_p(llama_sampler & sampler, float p, int min_keep = 1);
+
+// keep the candidates whose surprise is closest to the entropy of the distribution, up to a cumulative probability
+// of P, at least min_keep
+void llama_sample_typical(llama_sampler & sampler, float p, int min_keep = 1);
+
+// cut the tail of the candidates where the second derivative of their sorted probabilities, normalized, adds up to z
+void llama_sample_tail_free(llama_sampler & sampler, float z, int min_keep = 1);
+
+// sort the candidates and compute their probabilities, which the stages that cut them by probability do
+void llama_sample_softmax(llama_sampler & sampler);
+
+// draw a candidate by its probability - never one whose probability is 0, such as a token masked out by a grammar
+gpt_vocab::id llama_sample_draw(llama_sampler & sampler, std::mt19937 & rng);
+
+// draw a candidate with mirostat, which keeps the surprise of the tokens near tau by adjusting K with a Zipf estimate
+// from the m best candidates - mu is the running target of the surprise, 2 tau to begin with
+gpt_vocab::id llama_sample_mirostat(llama_sampler & sampler, float tau, float eta, int m, float & mu, std::mt19937 & rng);
+
+// draw a candidate with mirostat 2.0, which keeps the candidates with a surprise below mu
+gpt_vocab::id llama_sample_mirostat_v2(llama_sampler & sampler, float tau, float eta, float & mu, std::mt19937 & rng);
+
+// the best candidate
+gpt_vocab::id llama_sample_greedy(llama_sampler & sampler);
+
+//
+// Model files
+//
+
+// multi-part model files - the tensors are split across the parts and their data is not aligned
+#define LLAMA_FILE_MAGIC 0x67676d6c // 'ggml'
+
+// multi-part model files with a version after the magic, and the score of each token after its text in the vocab
+#define LLAMA_FILE_MAGIC_SCORES 0x67676d66 // 'ggmf'
+#define LLAMA_FILE_VERSION      1
+
+// single-file models - the header holds an index of the tensors, whose data is stored whole and aligned
+//
+// the vocab holds the score of each token after its text, except in version 1
+#define LLAMA_FILE_MAGIC_SINGLE   0x67677366 // 'ggsf'
+#define LLAMA_FILE_VERSION_SINGLE 2
+#define LLAMA_FILE_ALIGN          64
+
+// location and layout of a tensor in a model file
+struct llama_tensor_info {
+    std::string name;
+
+    int32_t n_dims = 0;
+    int32_t ne[2]  = { 1, 1 };
+    int32_t ftype  = 0;
+
+    size_t offset = 0; // of the tensor data from the start of the file
+    size_t size   = 0; // of the tensor data in bytes
+};
+
+// how a 2d tensor is split across the parts of a multi-part model
+//   0: every part holds a slice of the columns of each row (tok_embeddings, wo, w2)
+//   1: every part holds a slice of the rows (output, wq, wk, wv, w1, w3)
+int llama_split_type(const std::string & name);
+
+// size in bytes of nelements values stored with the given ftype, or 0 if the ftype is unknown
+size_t llama_ftype_nbytes(int32_t ftype, int32_t nelements);
+
+// walk the tensor headers of a 'ggml' model file from the current position, skipping over the data
+bool llama_scan_tensors(std::istream & fin, std::vector<llama_tensor_info> & tensors);
+
+// read / write the tensor index of a single-file model
+bool llama_read_tensor_index (std::istream & fin, std::vector<llama_tensor_info> & tensors);
+void llama_write_tensor_index(std::ostream & fout, const std::vector<llama_tensor_info> & tensors);
+
+// size in bytes of the tensor index written by llama_write_tensor_index()
+size_t llama_tensor_index_size(const std::vector<llama_tensor_info> & tensors);
+
+//
+// Model sizes
+//
+// what the model and its sessions take in memory, computed from the header of the model file alone - see
+// llama_model_load(), llama_session_init() and llama_eval() in LlamaModel.mm, which allocate exactly this much
+//
+
+// default hparams (LLaMA 7B)
+struct llama_hparams {
+    int32_t n_vocab = 32000;
+    int32_t n_ctx   = 512;   // this is provided as user input?
+    int32_t n_embd  = 4096;
+    int32_t n_mult  = 256;
+    int32_t n_head  = 32;
+    int32_t n_layer = 32;
+    int32_t n_rot   = 64;
+    int32_t f16     = 1;
+};
+
+// the weights of a streamed layer start on this boundary in its slot
+#define LLAMA_STREAM_ALIGN 64
+
+// number of parts of a 'ggml' model with the given dimension, or 0 if the dimension is unknown
+int llama_n_parts(int n_embd);
+
+// size of the hidden layer of the feed-forward networks
+int llama_n_ff(const llama_hparams & hparams);
+
+// type of the weights stored with the given ftype, or GGML_TYPE_COUNT if the ftype is unknown
+enum ggml_type llama_ftype_to_ggml_type(int32_t ftype);
+
+// read the header of a model file up to the tensors: magic, version, hparams and vocab
+//
+// the vocab is skipped if vocab is null - its scores are read if the file has them
+bool llama_read_header(std::istream & fin, const std::string & fname, llama_hparams & hparams, bool & single_file, gpt_vocab * vocab, std::string & error);
+
+// the tensors in the file: read from the index of a single-file model, or scanned for a single-part 'ggml' model
+// if scan is set - an empty index otherwise, or if the scan fails
+bool llama_read_index(std::istream & fin, const std::string & fname, bool single_file, bool scan, std::vector<llama_tensor_info> & index, std::string & error);
+
+// the weights whose data can be used straight from a mapping of the file, which is file_size bytes long
+std::map<std::string, llama_tensor_info> llama_mapped_tensors(const std::vector<llama_tensor_info> & index, enum ggml_type wtype, size_t file_size);
+
+// the number of layers in the window of a layer stream, or 0 if the layers are all held in memory
+int llama_stream_slots(const llama_hparams & hparams, int n_stream_layers);
+
+// size of a slot of a layer stream: the data of the weights of one decoder layer
+size_t llama_stream_slot_size(const llama_hparams & hparams);
+
+// size of the model context: the header of every weight, plus the data of the weights that are neither mapped nor
+// streamed
+size_t llama_model_ctx_size(const llama_hparams & hparams, const std::map<std::string, llama_tensor_info> & mapped_tensors, bool stream_layers);
+
+// size of the key + value memory of a session for n_ctx tokens stored in the given type, in bytes
+size_t llama_kv_memory_size(const llama_hparams & hparams, int n_ctx, enum ggml_type type);
+
+// work memory that ggml_graph_compute() needs for the graph of llama_eval() on N tokens with n_out logits: the
+// largest of the matrix multiplications
+size_t llama_eval_work_size(const llama_hparams & hparams, int N, int n_out, int n_threads);
+
+// size of the compute buffer of a session that evaluates up to n_batch tokens at a time with n_threads threads, in bytes
+//
+// a model whose layers are streamed computes one layer at a time, which takes a little more
+size_t llama_eval_buffer_size(const llama_hparams & hparams, int n_ctx, int n_batch, int n_threads, bool stream_layers);
+
+// memory needed to run a model, in bytes - see llama_model_footprint()
+struct llama_memory_footprint {
+    size_t weights = 0; // model context: the weights read into memory and the headers of all the weights
+    size_t mapped  = 0; // weights used straight from the file mapping, held in the page cache
+    size_t stream  = 0; // window of the streamed decoder layers
+    size_t kv      = 0; // key + value memory of one session
+    size_t compute = 0; // compute buffer of one session
+
+    size_t session() const {
+        return kv + compute;
+    }
+
+    size_t total(int n_sessions = 1) const {
+        return weights + mapped + stream + n_sessions*session();
+    }
+};
+
+// compute the memory that llama_model_load() and llama_session_init() will allocate for a model file, from its
+// header alone - nothing is allocated, so a job can be admitted or turned away before the model is loaded
+bool llama_model_footprint(const std::string & fname, int n_ctx, int n_batch, int n_threads, bool use_mmap, int n_stream_layers, llama_memory_footprint & footprint, std::string & error);
+
+//
+// Memory
+//
+
+// how the memory of a llama_buffer was obtained
+enum llama_buffer_type {
+    LLAMA_BUFFER_MALLOC,    // regular pages from malloc()
+    LLAMA_BUFFER_HUGETLB,   // explicit huge pages from the hugetlb pool (Linux MAP_HUGETLB)
+    LLAMA_BUFFER_THP,       // anonymous mapping advised to use transparent huge pages (Linux MADV_HUGEPAGE)
+    LLAMA_BUFFER_SUPERPAGE, // 2 MB superpages (macOS VM_FLAGS_SUPERPAGE_SIZE_2MB)
+};
+
+// memory for a ggml context or a compute buffer
+//
+// with 2 MB pages, a buffer of several GB needs a few thousand TLB entries instead of about a million, which
+// matters for the scattered row reads of get_rows and for the matrix multiplications streaming over the weights
+struct llama_buffer {
+    void * data = nullptr;
+    size_t size = 0;
+
+    llama_buffer_type type = LLAMA_BUFFER_MALLOC;
+    size_t mapped_size = 0; // size of the mapping, if the buffer is not from malloc()
+
+    llama_buffer() = default;
+    llama_buffer(const llama_buffer &) = delete;
+    llama_buffer & operator=(const llama_buffer &) = delete;
+
+    ~llama_buffer();
+};
+
+// allocate size bytes, from 2 MB pages if use_huge_pages is set: explicit huge pages are tried first, then
+// transparent huge pages or superpages, and malloc() if the system provides none of them
+bool llama_buffer_alloc(llama_buffer & buf, size_t size, bool use_huge_pages);
+void llama_buffer_free (llama_buffer & buf);
+
+const char * llama_buffer_type_name(llama_buffer_type type);
+
+//
+// NUMA
+//
+
+// the CPUs of each NUMA node, as listed in /sys/devices/system/node
+struct llama_numa_topology {
+    std::vector<std::vector<int>> node_cpus;
+
+    int n_nodes() const {
+        return node_cpus.size();
+    }
+};
+
+// read the NUMA topology of the machine - fails where /sys/devices/system/node does not exist
+bool llama_numa_topology_read(llama_numa_topology & topology);
+
+// the CPU to pin each of n_threads compute threads to
+//
+// the threads are split in one block of consecutive threads per node, the same way ggml splits the rows of a matrix
+// multiplication between the threads, so that with LLAMA_NUMA_PARTITION each thread mostly reads rows of its node
+//
+// slot lets several sets of threads run side by side: those of slot k take the CPUs of each node that follow the ones
+// of slots 0 to k - 1 - the threads of slot 0 share the CPUs of a node if there are more of them, for any other slot
+// the list is empty if the CPUs of a node run out
+std::vector<int> llama_numa_thread_cpus(const llama_numa_topology & topology, int n_threads, int slot);
+
+// set the memory policy of the pages in [addr, addr + size): interleaved over the first n_nodes nodes, or on one node
+// if it has room - the pages that are already in memory are moved (Linux only)
+bool llama_numa_interleave(void * addr, size_t size, int n_nodes);
+bool llama_numa_bind      (void * addr, size_t size, int node);
+
 //
 // Quantization
 //
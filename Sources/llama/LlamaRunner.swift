@@ -12,13 +12,15 @@ public class LlamaRunner {
   public struct Config {
     public let numThreads: UInt
     public let numTokens: UInt
+    public let contextSize: UInt
     public let reversePrompt: String?
 
-    public static let `default` = Config(numThreads: 8, numTokens: 512, reversePrompt: nil)
+    public static let `default` = Config(numThreads: 8, numTokens: 512, contextSize: 512, reversePrompt: nil)
 
-    public init(numThreads: UInt, numTokens: UInt, reversePrompt: String? = nil) {
+    public init(numThreads: UInt, numTokens: UInt, contextSize: UInt = 512, reversePrompt: String? = nil) {
       self.numThreads = numThreads
       self.numTokens = numTokens
+      self.contextSize = contextSize
       self.reversePrompt = reversePrompt
     }
 
@@ -26,16 +28,72 @@ public class LlamaRunner {
       let _config = _LlamaRunnerBridgeConfig()
       _config.numberOfThreads = numThreads
       _config.numberOfTokens = numTokens
+      _config.contextSize = contextSize
       _config.reversePrompt = reversePrompt
       return _config
     }
   }
 
+  public struct ModelLoadStats {
+    public struct Part {
+      public let size: UInt // bytes read from the part
+      public let loadTime: TimeInterval
+    }
+
+    public let parts: [Part]
+    public let loadTime: TimeInterval
+    public let readThroughput: Double // in GB/s
+    public let numThreads: UInt
+
+    public let contextSize: UInt // bytes
+    public let bufferType: String
+
+    fileprivate init(_ stats: _LlamaLoadStats) {
+      parts = zip(stats.partSizes, stats.partLoadTimes).map { size, loadTime in
+        Part(size: size.uintValue, loadTime: loadTime.doubleValue)
+      }
+      loadTime = stats.loadTime
+      readThroughput = stats.readThroughput
+      numThreads = stats.numberOfThreads
+      contextSize = stats.contextSize
+      bufferType = stats.bufferType
+    }
+  }
+
+  public struct GenerationStats {
+    public let numTokens: UInt
+    public let generationTime: TimeInterval
+    public let tokensPerSecond: Double
+
+    // with a draft model: the speculative rounds, the tokens proposed and accepted in them, and the tokens they
+    // generated in all
+    public let numSpeculativeRounds: UInt
+    public let numDraftedTokens: UInt
+    public let numAcceptedTokens: UInt
+    public let numSpeculativeTokens: UInt
+    public let acceptanceRate: Double
+    public let draftTime: TimeInterval
+
+    fileprivate init(_ stats: _LlamaGenerationStats) {
+      numTokens = stats.numberOfTokens
+      generationTime = stats.generationTime
+      tokensPerSecond = stats.tokensPerSecond
+      numSpeculativeRounds = stats.numberOfSpeculativeRounds
+      numDraftedTokens = stats.numberOfDraftedTokens
+      numAcceptedTokens = stats.numberOfAcceptedTokens
+      numSpeculativeTokens = stats.numberOfSpeculativeTokens
+      acceptanceRate = stats.acceptanceRate
+      draftTime = stats.draftTime
+    }
+  }
+
   public enum RunState {
     case notStarted
     case initializing
+    // the stats are nil for a model that was already loaded by an earlier run, or for no draft model
+    case loadedModel(stats: ModelLoadStats?, draftStats: ModelLoadStats?)
     case generatingOutput
-    case completed
+    case completed(stats: GenerationStats)
     case failed(error: Error?)
   }
 
@@ -64,15 +122,17 @@ public class LlamaRunner {
             startedLoadingModel: {
               stateChangeHandler?(.initializing)
             },
-            finishedLoadingModel: {},
+            finishedLoadingModel: { stats, draftStats in
+              stateChangeHandler?(.loadedModel(stats: stats.map(ModelLoadStats.init), draftStats: draftStats.map(ModelLoadStats.init)))
+            },
             startedGeneratingOutput: {
               stateChangeHandler?(.generatingOutput)
             },
             outputToken: { token in
               continuation.yield(token)
             },
-            completed: {
-              stateChangeHandler?(.completed)
+            completed: { stats in
+              stateChangeHandler?(.completed(stats: GenerationStats(stats)))
               continuation.finish()
             },
             failed: { error in
@@ -103,15 +163,17 @@ public class LlamaRunner {
           startedLoadingModel: {
             stateChangeHandler?(.initializing)
           },
-          finishedLoadingModel: {},
+          finishedLoadingModel: { stats, draftStats in
+            stateChangeHandler?(.loadedModel(stats: stats.map(ModelLoadStats.init), draftStats: draftStats.map(ModelLoadStats.init)))
+          },
           startedGeneratingOutput: {
             stateChangeHandler?(.generatingOutput)
           },
           outputToken: { token in
             tokenHandler(token)
           },
-          completed: {
-            stateChangeHandler?(.completed)
+          completed: { stats in
+            stateChangeHandler?(.completed(stats: GenerationStats(stats)))
           },
           failed: { error in
             stateChangeHandler?(.failed(error: error))
@@ -18,7 +18,10 @@ typedef NS_ENUM(NSUInteger, LlamaEventType) {
 };
 
 typedef struct LlamaEventData {
+  _LlamaLoadStats *finishedLoadingModel_stats;
+  _LlamaLoadStats *finishedLoadingModel_draftStats;
   NSString *outputToken_token;
+  _LlamaGenerationStats *completed_stats;
   NSError *failed_error;
 } LlamaEventData;
 
@@ -31,6 +34,51 @@ typedef struct LlamaEventData {
 
 @end
 
+@implementation _LlamaLoadStats
+
+@synthesize partSizes = _partSizes;
+@synthesize partLoadTimes = _partLoadTimes;
+@synthesize loadTime = _loadTime;
+@synthesize readThroughput = _readThroughput;
+@synthesize numberOfThreads = _numberOfThreads;
+@synthesize contextSize = _contextSize;
+@synthesize bufferType = _bufferType;
+
+- (instancetype)init
+{
+  if ((self = [super init])) {
+    _partSizes = @[];
+    _partLoadTimes = @[];
+    _bufferType = @"";
+  }
+
+  return self;
+}
+
+@end
+
+@implementation _LlamaGenerationStats
+
+@synthesize numberOfTokens = _numberOfTokens;
+@synthesize generationTime = _generationTime;
+@synthesize numberOfSpeculativeRounds = _numberOfSpeculativeRounds;
+@synthesize numberOfDraftedTokens = _numberOfDraftedTokens;
+@synthesize numberOfAcceptedTokens = _numberOfAcceptedTokens;
+@synthesize numberOfSpeculativeTokens = _numberOfSpeculativeTokens;
+@synthesize draftTime = _draftTime;
+
+- (double)tokensPerSecond
+{
+  return _generationTime > 0 ? _numberOfTokens/_generationTime : 0.0;
+}
+
+- (double)acceptanceRate
+{
+  return _numberOfDraftedTokens > 0 ? (double)_numberOfAcceptedTokens/_numberOfDraftedTokens : 0.0;
+}
+
+@end
+
 @implementation _LlamaEvent
 
 - (instancetype)initWithEventType:(LlamaEventType)eventType data:(LlamaEventData)data
@@ -50,10 +98,9 @@ typedef struct LlamaEventData {
   return event;
 }
 
-+ (instancetype)finishedLoadingModel
++ (instancetype)finishedLoadingModelWithStats:(nullable _LlamaLoadStats *)stats draftStats:(nullable _LlamaLoadStats *)draftStats
 {
-  LlamaEventData data;
-  _LlamaEvent *event = [[_LlamaEvent alloc] initWithEventType:LlamaEventTypeFinishedLoadingModel data:{}];
+  _LlamaEvent *event = [[_LlamaEvent alloc] initWithEventType:LlamaEventTypeFinishedLoadingModel data:{ .finishedLoadingModel_stats = stats, .finishedLoadingModel_draftStats = draftStats }];
   return event;
 }
 
@@ -70,9 +117,9 @@ typedef struct LlamaEventData {
   return event;
 }
 
-+ (instancetype)completed
++ (instancetype)completedWithStats:(nonnull _LlamaGenerationStats *)stats
 {
-  _LlamaEvent *event = [[_LlamaEvent alloc] initWithEventType:LlamaEventTypeCompleted data:{}];
+  _LlamaEvent *event = [[_LlamaEvent alloc] initWithEventType:LlamaEventTypeCompleted data:{ .completed_stats = stats }];
   return event;
 }
 
@@ -83,10 +130,10 @@ typedef struct LlamaEventData {
 }
 
 - (void)matchWithStartedLoadingModel:(void (^)(void))startedLoadingModel
-                finishedLoadingModel:(void (^)(void))finishedLoadingModel
+                finishedLoadingModel:(void (^)(_LlamaLoadStats * _Nullable stats, _LlamaLoadStats * _Nullable draftStats))finishedLoadingModel
              startedGeneratingOutput:(void (^)(void))startedGeneratingOutput
                          outputToken:(void (^)(NSString *token))outputToken
-                           completed:(void (^)(void))completed
+                           completed:(void (^)(_LlamaGenerationStats *stats))completed
                               failed:(void (^)(NSError *error))failed
 {
   switch (_eventType) {
@@ -96,7 +143,7 @@ typedef struct LlamaEventData {
       startedLoadingModel();
       break;
     case LlamaEventTypeFinishedLoadingModel:
-      finishedLoadingModel();
+      finishedLoadingModel(_data.finishedLoadingModel_stats, _data.finishedLoadingModel_draftStats);
       break;
     case LlamaEventTypeStartedGeneratingOutput:
       startedGeneratingOutput();
@@ -105,7 +152,7 @@ typedef struct LlamaEventData {
       outputToken(_data.outputToken_token);
       break;
     case LlamaEventTypeCompleted:
-      completed();
+      completed(_data.completed_stats);
       break;
     case LlamaEventTypeFailed:
       failed(_data.failed_error);
@@ -0,0 +1,234 @@
+//
+//  LlamaModel.hh
+//  llama
+//
+
+#import <Foundation/Foundation.h>
+
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+struct llama_layer {
+  // normalization
+  struct ggml_tensor * attention_norm;
+
+  // attention
+  struct ggml_tensor * wq;
+  struct ggml_tensor * wk;
+  struct ggml_tensor * wv;
+  struct ggml_tensor * wo;
+
+  // normalization
+  struct ggml_tensor * ffn_norm;
+
+  // ff
+  struct ggml_tensor * w1;
+  struct ggml_tensor * w2;
+  struct ggml_tensor * w3;
+};
+
+// decoder layers read from the model file while the model is evaluated, see LlamaModel.mm
+struct llama_layer_stream;
+
+// the slots of CPUs (see llama_numa_thread_cpus) that the sessions of a model have pinned their threads to
+struct llama_numa_slots {
+  std::mutex mutex;
+  std::vector<bool> used;
+};
+
+// the weights of the model, which are only read during evaluation
+struct llama_model {
+  llama_hparams hparams; // n_ctx is unused, each session has its own
+
+  struct ggml_tensor * tok_embeddings;
+
+  struct ggml_tensor * norm;
+  struct ggml_tensor * output;
+
+  std::vector<llama_layer> layers;
+
+  //
+  struct ggml_context * ctx = nullptr;
+  std::map<std::string, struct ggml_tensor *> tensors;
+
+  llama_buffer buf; // memory of ctx
+
+  // placement of the weights on the NUMA nodes, which the sessions pin their compute threads to match
+  llama_numa_strategy numa = LLAMA_NUMA_NONE;
+  llama_numa_topology numa_topology;
+
+  // the threads that the rows of the weights are split between with LLAMA_NUMA_PARTITION, which every session then
+  // runs whatever its own count, and the CPUs that the sessions hold
+  int numa_n_threads = 0;
+  std::shared_ptr<llama_numa_slots> numa_slots;
+
+  // the model file mapping, if any of the weights point into it
+  void * mm_addr = nullptr;
+  size_t mm_length = 0;
+
+  // if set, the weights of the decoder layers are not held in the model context but streamed through a window of
+  // a few layers - the evaluations of the model are then serialized
+  std::shared_ptr<llama_layer_stream> stream;
+};
+
+// timings of llama_model_load(), one entry for each model part
+struct llama_load_stats {
+  struct part {
+    size_t  size; // bytes read from the part
+    int64_t t_us; // time spent reading them
+  };
+
+  int n_threads = 0;
+
+  std::vector<part> parts;
+
+  // overall read throughput in GB/s
+  double gbps() const {
+    size_t  size = 0;
+    int64_t t_us = 0;
+    for (const auto & p : parts) {
+      size += p.size;
+      t_us += p.t_us;
+    }
+    return t_us > 0 ? size/(t_us*1e3) : 0.0;
+  }
+};
+
+// read-only view of the logits computed by llama_eval()
+struct llama_logits {
+  const float * data = nullptr;
+
+  int n_vocab = 0;
+  int n_rows  = 0; // one row per requested position
+
+  const float * row(int i) const {
+    return data + (size_t) i*n_vocab;
+  }
+};
+
+// the state of a single generation: key + value memory, compute buffer, position and sampling state
+//
+// the model is not modified during evaluation, so any number of sessions can run concurrently on different
+// threads against the same model
+struct llama_session {
+  int n_ctx     = 0;
+  int n_batch   = 0; // most tokens evaluated by a single llama_eval() call
+  int n_threads = 0; // threads used by llama_eval()
+  int n_past    = 0; // number of tokens in the key + value memory
+
+  // key + value memory
+  struct ggml_tensor * memory_k = nullptr;
+  struct ggml_tensor * memory_v = nullptr;
+
+  struct ggml_context * ctx = nullptr; // holds the key + value memory
+  llama_buffer buf_kv;                 // memory of ctx
+
+  // compute buffer, sized for n_batch tokens at the end of the context, and the logits of the last llama_eval() call
+  //
+  // the logits live inside the compute buffer, so they stay valid until the next llama_eval() call
+  llama_buffer buf;
+  llama_logits logits;
+
+  // CPU of each compute thread, if they are pinned, and the slot of the model's CPUs that they are taken from
+  std::vector<int> thread_cpus;
+  std::shared_ptr<llama_numa_slots> numa_slots;
+  int numa_slot = -1;
+
+  // sampling state
+  std::mt19937 rng;
+  llama_sampler sampler;
+
+  llama_session() = default;
+  llama_session(const llama_session &) = delete;
+  llama_session & operator=(const llama_session &) = delete;
+
+  ~llama_session();
+};
+
+// load the model's weights and vocabulary from a file, see LlamaModel.mm
+bool llama_model_load(const std::string & fname, llama_model & model, gpt_vocab & vocab, bool use_mmap, bool use_huge_pages, llama_numa_strategy numa, int n_stream_layers, int n_threads, llama_load_stats * stats, NSError **outError);
+
+// release the model context, the layer stream and the file mapping, if any
+void llama_model_free(llama_model & model);
+
+// allocate the key + value memory of a session for n_ctx tokens and the compute buffer to evaluate up to n_batch tokens
+// at a time with n_threads threads, from 2 MB pages if use_huge_pages is set, and seed its sampling state
+//
+// with the weights partitioned between NUMA nodes, the session runs the model's numa_n_threads threads instead, and its
+// compute buffer is sized for that many threads
+bool llama_session_init(llama_session & session, const llama_model & model, int n_ctx, int n_batch, int n_threads, bool use_huge_pages, int repeat_last_n, int seed, NSError **outError);
+
+// release the key + value memory and the compute buffer of a session
+void llama_session_free(llama_session & session);
+
+// memory held by a session, in bytes
+size_t llama_session_memory_size(const llama_session & session);
+
+// llama_model_footprint() of utils.h, reporting errors as an NSError
+bool llama_model_footprint(const std::string & fname, int n_ctx, int n_batch, int n_threads, bool use_mmap, int n_stream_layers, llama_memory_footprint & footprint, NSError **outError);
+
+// evaluate the transformer, see LlamaModel.mm
+bool llama_eval(
+                const llama_model & model,
+                llama_session & session,
+                const std::vector<gpt_vocab::id> & embd_inp,
+                NSError **outError,
+                const std::vector<int32_t> & logits_pos = {});
+
+// the file of a model and the options of llama_model_load() that decide how its weights are held in memory
+struct llama_model_options {
+  std::string fname;
+  bool use_mmap = true;
+  bool use_huge_pages = false;
+  llama_numa_strategy numa = LLAMA_NUMA_NONE;
+  int n_stream_layers = 0;
+
+  bool operator==(const llama_model_options & other) const {
+    return fname == other.fname && use_mmap == other.use_mmap && use_huge_pages == other.use_huge_pages &&
+           numa == other.numa && n_stream_layers == other.n_stream_layers;
+  }
+};
+
+// a model loaded from disk together with its vocabulary
+//
+// it outlives the individual predictions: a bridge loads its model once and every prediction it runs reuses it
+struct llama_shared_model {
+  llama_model model;
+  gpt_vocab   vocab;
+
+  llama_model_options options; // what it was loaded from, and how
+  llama_load_stats load_stats;
+
+  llama_shared_model() = default;
+  llama_shared_model(const llama_shared_model &) = delete;
+  llama_shared_model & operator=(const llama_shared_model &) = delete;
+
+  ~llama_shared_model() {
+    llama_model_free(model);
+  }
+};
+
+// the model of a bridge, and the draft model of speculative decoding, each loaded by the first prediction that needs it
+struct llama_model_cache {
+  std::mutex mutex;
+  std::shared_ptr<llama_shared_model> model;
+  std::shared_ptr<llama_shared_model> draft_model;
+};
+
+// return the model held by the cache, loading it first if needed - did_load tells whether this call loaded it
+//
+// the model is reused only if it was loaded from the file and with the options of params (use_mmap, use_huge_pages,
+// numa and n_stream_layers), or else it is loaded again in its place: the predictions still running keep the model
+// they hold
+std::shared_ptr<llama_shared_model> llama_model_cache_get(llama_model_cache & cache, const gpt_params & params, bool & did_load, NSError **outError);
+
+// the same for the draft model of params, which is always held in memory whole
+std::shared_ptr<llama_shared_model> llama_model_cache_get_draft(llama_model_cache & cache, const gpt_params & params, bool & did_load, NSError **outError);
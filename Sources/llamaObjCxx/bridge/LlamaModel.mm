@@ -0,0 +1,1224 @@
+//
+//  LlamaModel.mm
+//  llama
+//
+
+#import "LlamaModel.hh"
+
+#import "LlamaError.h"
+
+#include "ggml.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// the tensor data is read in chunks of about this size, so that the loader threads stay busy until the end
+static const size_t LLAMA_READ_CHUNK_SIZE = 16*1024*1024;
+
+static NSError *makeLlamaError(LlamaErrorCode errorCode, NSString *description)
+{
+  return [[NSError alloc] initWithDomain:LlamaErrorDomain code:errorCode userInfo:@{
+    NSLocalizedDescriptionKey: description
+  }];
+}
+
+// a read of n_rows rows of row_size bytes, consecutive in the file from offset, into rows dst_stride bytes apart in dst
+struct llama_read_job {
+  size_t offset;
+  char * dst;
+  size_t row_size;
+  size_t n_rows;
+  size_t dst_stride;
+};
+
+static void llama_add_read_jobs(std::vector<llama_read_job> & jobs, size_t offset, char * dst, size_t row_size, size_t n_rows, size_t dst_stride) {
+  if (n_rows == 1) {
+    for (size_t i = 0; i < row_size; i += LLAMA_READ_CHUNK_SIZE) {
+      jobs.push_back({ offset + i, dst + i, std::min(LLAMA_READ_CHUNK_SIZE, row_size - i), 1, 0 });
+    }
+    return;
+  }
+
+  const size_t rows_per_job = std::max<size_t>(1, LLAMA_READ_CHUNK_SIZE/row_size);
+  for (size_t i = 0; i < n_rows; i += rows_per_job) {
+    jobs.push_back({ offset + i*row_size, dst + i*dst_stride, row_size, std::min(rows_per_job, n_rows - i), dst_stride });
+  }
+}
+
+// positional read, so that several threads can read from the same file descriptor
+static bool llama_pread(int fd, char * dst, size_t size, size_t offset) {
+  while (size > 0) {
+    const ssize_t n = pread(fd, dst, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+
+    dst    += n;
+    size   -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+static bool llama_read_job_run(int fd, const llama_read_job & job) {
+  for (size_t i = 0; i < job.n_rows; ++i) {
+    if (!llama_pread(fd, job.dst + i*job.dst_stride, job.row_size, job.offset + i*job.row_size)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// the decoder layers of a model that does not fit in memory, read from the model file into a window of n_slots
+// buffers while llama_eval() runs: a background thread reads the next layers while the current one is computed
+//
+// the layers are read in the order llama_eval() computes them, over and over: the k-th layer read since the
+// model was loaded is layer k % n_layer, into slot k % n_slots, and its slot is reused once the layer is computed -
+// the first layers of the next evaluation are thus read while the end of the current one is computed
+struct llama_layer_stream {
+  int n_layer = 0;
+  int n_slots = 0;
+
+  llama_buffer buf; // the slots, slot_size bytes each
+  size_t slot_size = 0;
+
+  // the weights of every layer with their offset in a slot, and the reads of their data - for the slot of the
+  // layer's first pass, il % n_slots - from the file descriptor of each model part
+  std::vector<std::vector<std::pair<struct ggml_tensor *, size_t>>> layer_tensors;
+  std::vector<std::vector<std::pair<int, llama_read_job>>> layer_reads;
+  std::vector<int> fds;
+
+  std::mutex eval_mutex; // held by llama_eval(), the slots are shared by all the sessions
+
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  uint64_t n_read     = 0; // layers read so far
+  uint64_t n_computed = 0; // layers computed so far, their slots can be reused
+  bool failed = false;
+  bool stop   = false;
+
+  std::thread thread;
+
+  char * slot(int i) const {
+    return (char *) buf.data + i*slot_size;
+  }
+
+  llama_layer_stream() = default;
+  llama_layer_stream(const llama_layer_stream &) = delete;
+  llama_layer_stream & operator=(const llama_layer_stream &) = delete;
+
+  ~llama_layer_stream() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cond.notify_all();
+
+    if (thread.joinable()) {
+      thread.join();
+    }
+
+    for (int fd : fds) {
+      close(fd);
+    }
+
+    llama_buffer_free(buf);
+  }
+};
+
+// the background thread of a layer stream: reads the layers in order, as long as there is a free slot
+static void llama_stream_run(llama_layer_stream & stream) {
+  while (true) {
+    uint64_t k = 0;
+    {
+      std::unique_lock<std::mutex> lock(stream.mutex);
+      stream.cond.wait(lock, [&]() {
+        return stream.stop || stream.n_read < stream.n_computed + stream.n_slots;
+      });
+
+      if (stream.stop) {
+        return;
+      }
+
+      k = stream.n_read;
+    }
+
+    const int il = k % stream.n_layer;
+
+    // the reads target the slot of the layer's first pass
+    const ptrdiff_t shift = stream.slot(k % stream.n_slots) - stream.slot(il % stream.n_slots);
+
+    bool ok = true;
+    for (const auto & read : stream.layer_reads[il]) {
+      llama_read_job job = read.second;
+      job.dst += shift;
+
+      if (!llama_read_job_run(stream.fds[read.first], job)) {
+        ok = false;
+        break;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(stream.mutex);
+      if (ok) {
+        stream.n_read++;
+      } else {
+        stream.failed = true;
+      }
+    }
+    stream.cond.notify_all();
+
+    if (!ok) {
+      return;
+    }
+  }
+}
+
+// wait until layer il, the next one to compute, is read and point its weights to its slot
+static bool llama_stream_acquire(llama_layer_stream & stream, int il, NSError **outError) {
+  const uint64_t k = stream.n_computed;
+
+  assert((int) (k % stream.n_layer) == il);
+
+  {
+    std::unique_lock<std::mutex> lock(stream.mutex);
+    stream.cond.wait(lock, [&]() {
+      return stream.failed || stream.n_read > k;
+    });
+
+    if (stream.failed) {
+      *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                                 [NSString stringWithFormat:@"failed to read layer %d from the model file", il]);
+      return false;
+    }
+  }
+
+  char * slot = stream.slot(k % stream.n_slots);
+  for (const auto & t : stream.layer_tensors[il]) {
+    t.first->data = slot + t.second;
+  }
+
+  return true;
+}
+
+// the layer acquired last is computed, its slot can take the next layer
+static void llama_stream_release(llama_layer_stream & stream) {
+  {
+    std::lock_guard<std::mutex> lock(stream.mutex);
+    stream.n_computed++;
+  }
+  stream.cond.notify_all();
+}
+
+static void * llama_mmap_file(const std::string & fname, size_t & length) {
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  // shared, read-only mapping: the pages come straight from the page cache and can be shared between processes
+  void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+
+  length = st.st_size;
+
+  return addr;
+}
+
+void llama_model_free(llama_model & model) {
+  model.stream.reset();
+
+  if (model.ctx) {
+    ggml_free(model.ctx);
+    model.ctx = nullptr;
+  }
+
+  llama_buffer_free(model.buf);
+
+  if (model.mm_addr) {
+    munmap(model.mm_addr, model.mm_length);
+    model.mm_addr = nullptr;
+    model.mm_length = 0;
+  }
+}
+
+// set the NUMA memory policy of the weights in the model context
+//
+//   - LLAMA_NUMA_INTERLEAVE: the pages go round-robin to the nodes, which spreads the memory bandwidth evenly
+//   - LLAMA_NUMA_PARTITION:  the rows of every weight are split in one block per node, along the same boundaries as
+//                            the rows that model.numa_n_threads threads pinned with llama_numa_thread_cpus() get in
+//                            ggml_mul_mat
+//
+// the weights of a streamed layer are placed in the slot of its first pass, which every layer read into that slot
+// shares since the layers all have the same shapes
+static void llama_numa_place(const llama_model & model) {
+  const int n_nodes = model.numa_topology.n_nodes();
+
+  if (model.numa == LLAMA_NUMA_INTERLEAVE) {
+    llama_numa_interleave(model.buf.data, model.buf.size, n_nodes);
+    if (model.stream) {
+      llama_numa_interleave(model.stream->buf.data, model.stream->buf.size, n_nodes);
+    }
+    return;
+  }
+
+  const int n_threads = model.numa_n_threads;
+
+  for (const auto & kv : model.tensors) {
+    struct ggml_tensor * tensor = kv.second;
+
+    if (tensor->n_dims == 1) {
+      llama_numa_interleave(tensor->data, ggml_nbytes(tensor), n_nodes);
+      continue;
+    }
+
+    // rows per thread, as in ggml_compute_forward_mul_mat
+    const int nr = tensor->ne[1];
+    const int dr = (nr + n_threads - 1)/n_threads;
+
+    for (int node = 0; node < n_nodes; ++node) {
+      // the first thread of the node and of the next one
+      const int ith0 = (n_threads*node + n_nodes - 1)/n_nodes;
+      const int ith1 = (n_threads*(node + 1) + n_nodes - 1)/n_nodes;
+
+      const int ir0 = std::min(dr*ith0, nr);
+      const int ir1 = std::min(dr*ith1, nr);
+
+      if (ir1 > ir0) {
+        llama_numa_bind((char *) tensor->data + ir0*tensor->nb[1], (ir1 - ir0)*tensor->nb[1], node);
+      }
+    }
+  }
+}
+
+// load the model's weights from a file
+//
+// the file is either a 'ggml' model, possibly split in several parts, or a single-file model ('ggsf') whose
+// header indexes the tensors (see convert.cpp)
+//
+// if use_mmap is set and the model is in a single part, the file is memory-mapped and every weight whose data
+// is suitably aligned in the file points straight into the mapping instead of being read into the model context
+//
+// the model context, which holds the weights that are not mapped, is allocated from 2 MB pages if use_huge_pages
+// is set - the mapped weights are in the page cache, in regular pages
+//
+// on a machine with several NUMA nodes, numa selects how the weights are placed on the nodes (see llama_numa_place);
+// the weights are then always read into the model context, since the page cache does not follow the memory policy
+// of a file mapping
+//
+// if n_stream_layers is less than the number of layers, only that many decoder layers are held in memory at a time:
+// their weights are read from the file while the model is evaluated (see llama_layer_stream), and the file is not
+// mapped
+//
+// the tensors of each part are indexed and validated first, then their data is read by n_threads threads
+// using positional reads; the read timings are reported in stats, if given
+bool llama_model_load(const std::string & fname, llama_model & model, gpt_vocab & vocab, bool use_mmap, bool use_huge_pages, llama_numa_strategy numa, int n_stream_layers, int n_threads, llama_load_stats * stats, NSError **outError) {
+  auto fin = std::ifstream(fname, std::ios::binary);
+  if (!fin) {
+    *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                               [NSString stringWithFormat:@"failed to open '%s'", fname.c_str()]);
+    return false;
+  }
+
+  bool single_file = false;
+
+  std::string error;
+
+  if (!llama_read_header(fin, fname, model.hparams, single_file, &vocab, error)) {
+    *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel, [NSString stringWithUTF8String:error.c_str()]);
+    return false;
+  }
+
+  if (numa != LLAMA_NUMA_NONE && llama_numa_topology_read(model.numa_topology) && model.numa_topology.n_nodes() > 1) {
+    model.numa = numa;
+    model.numa_n_threads = std::max(n_threads, model.numa_topology.n_nodes());
+    model.numa_slots = std::make_shared<llama_numa_slots>();
+    use_mmap = false;
+  }
+
+  const int n_slots = llama_stream_slots(model.hparams, n_stream_layers);
+  if (n_slots > 0) {
+    use_mmap = false;
+  }
+
+  const int n_ff    = llama_n_ff(model.hparams);
+  const int n_parts = single_file ? 1 : llama_n_parts(model.hparams.n_embd);
+
+  const ggml_type wtype = llama_ftype_to_ggml_type(model.hparams.f16);
+
+  const size_t file_offset = fin.tellg();
+
+  std::vector<llama_tensor_info> index;
+
+  if (!llama_read_index(fin, fname, single_file, use_mmap && n_parts == 1, index, error)) {
+    *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel, [NSString stringWithUTF8String:error.c_str()]);
+    return false;
+  }
+
+  // weights that are used directly from the file mapping
+  std::map<std::string, llama_tensor_info> mapped_tensors;
+
+  if (use_mmap && !index.empty()) {
+    model.mm_addr = llama_mmap_file(fname, model.mm_length);
+
+    if (model.mm_addr) {
+      mapped_tensors = llama_mapped_tensors(index, wtype, model.mm_length);
+    }
+
+    // nothing to map, all the weights are read as usual
+    if (mapped_tensors.empty()) {
+      llama_model_free(model);
+    }
+  }
+
+  auto & ctx = model.ctx;
+
+  // the streamed weights, with their layer
+  std::map<std::string, int> streamed_tensors;
+
+  // the window of the streamed layers
+  if (n_slots > 0) {
+    model.stream = std::make_shared<llama_layer_stream>();
+
+    auto & stream = *model.stream;
+
+    stream.n_layer   = model.hparams.n_layer;
+    stream.n_slots   = n_slots;
+    stream.slot_size = llama_stream_slot_size(model.hparams);
+
+    stream.layer_tensors.resize(stream.n_layer);
+    stream.layer_reads.resize(stream.n_layer);
+
+    if (!llama_buffer_alloc(stream.buf, n_slots*stream.slot_size, use_huge_pages)) {
+      *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                 [NSString stringWithFormat:@"failed to allocate %zu bytes", n_slots*stream.slot_size]);
+      return false;
+    }
+  }
+
+  // create the ggml context
+  {
+    const size_t ctx_size = llama_model_ctx_size(model.hparams, mapped_tensors, n_slots > 0);
+
+    if (!llama_buffer_alloc(model.buf, ctx_size, use_huge_pages)) {
+      *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                 [NSString stringWithFormat:@"failed to allocate %zu bytes", ctx_size]);
+      return false;
+    }
+
+    struct ggml_init_params params = {
+      /*.mem_size   =*/ model.buf.size,
+      /*.mem_buffer =*/ model.buf.data,
+    };
+
+    model.ctx = ggml_init(params);
+    if (!model.ctx) {
+      *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel, [NSString stringWithFormat:@"ggml_init() failed"]);
+      return false;
+    }
+  }
+
+  // prepare memory for the weights
+  {
+    const auto & hparams = model.hparams;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_vocab = hparams.n_vocab;
+
+    model.layers.resize(n_layer);
+
+    // creates a weight and maps it by name
+    // the weights in mapped_tensors point into the file mapping, the others are allocated in the model context
+    auto new_weight = [&](const std::string & name, ggml_type type, int n_dims, int ne0, int ne1) {
+      const int ne[2] = { ne0, ne1 };
+
+      const auto it = mapped_tensors.find(name);
+
+      struct ggml_tensor * tensor = it != mapped_tensors.end()
+        ? ggml_new_tensor_with_data(ctx, type, n_dims, ne, (char *) model.mm_addr + it->second.offset)
+        : ggml_new_tensor(ctx, type, n_dims, ne);
+
+      model.tensors[name] = tensor;
+
+      return tensor;
+    };
+
+    // creates a weight of decoder layer il
+    // the weights of a streamed layer point into the slot of the layer's first pass, at slot_offset
+    size_t slot_offset = 0;
+
+    auto new_layer_weight = [&](int il, const std::string & name, ggml_type type, int n_dims, int ne0, int ne1) {
+      if (!model.stream) {
+        return new_weight(name, type, n_dims, ne0, ne1);
+      }
+
+      auto & stream = *model.stream;
+
+      const int ne[2] = { ne0, ne1 };
+
+      struct ggml_tensor * tensor = ggml_new_tensor_with_data(ctx, type, n_dims, ne, stream.slot(il % stream.n_slots) + slot_offset);
+
+      stream.layer_tensors[il].push_back({ tensor, slot_offset });
+      streamed_tensors[name] = il;
+
+      slot_offset += ((ggml_nbytes(tensor) + LLAMA_STREAM_ALIGN - 1)/LLAMA_STREAM_ALIGN)*LLAMA_STREAM_ALIGN;
+
+      model.tensors[name] = tensor;
+
+      return tensor;
+    };
+
+    model.tok_embeddings = new_weight("tok_embeddings.weight", wtype, 2, n_embd, n_vocab);
+
+    model.norm   = new_weight("norm.weight",   GGML_TYPE_F32, 1, n_embd, 1);
+    model.output = new_weight("output.weight", wtype,         2, n_embd, n_vocab);
+
+    for (int i = 0; i < n_layer; ++i) {
+      auto & layer = model.layers[i];
+
+      const std::string prefix = "layers." + std::to_string(i) + ".";
+
+      slot_offset = 0;
+
+      layer.attention_norm = new_layer_weight(i, prefix + "attention_norm.weight", GGML_TYPE_F32, 1, n_embd, 1);
+
+      layer.wq = new_layer_weight(i, prefix + "attention.wq.weight", wtype, 2, n_embd, n_embd);
+      layer.wk = new_layer_weight(i, prefix + "attention.wk.weight", wtype, 2, n_embd, n_embd);
+      layer.wv = new_layer_weight(i, prefix + "attention.wv.weight", wtype, 2, n_embd, n_embd);
+      layer.wo = new_layer_weight(i, prefix + "attention.wo.weight", wtype, 2, n_embd, n_embd);
+
+      layer.ffn_norm = new_layer_weight(i, prefix + "ffn_norm.weight", GGML_TYPE_F32, 1, n_embd, 1);
+
+      layer.w1 = new_layer_weight(i, prefix + "feed_forward.w1.weight", wtype, 2, n_embd,   n_ff);
+      layer.w2 = new_layer_weight(i, prefix + "feed_forward.w2.weight", wtype, 2,   n_ff, n_embd);
+      layer.w3 = new_layer_weight(i, prefix + "feed_forward.w3.weight", wtype, 2, n_embd,   n_ff);
+    }
+  }
+
+  // the pages get their node when the weights are read into them
+  if (model.numa != LLAMA_NUMA_NONE) {
+    llama_numa_place(model);
+  }
+
+  fin.close();
+
+  // index the tensors of every part
+  std::vector<std::vector<llama_tensor_info>> part_index(n_parts);
+
+  for (int i = 0; i < n_parts; ++i) {
+    if (i == 0 && (single_file || !index.empty())) {
+      part_index[i] = std::move(index);
+      continue;
+    }
+
+    std::string fname_part = fname;
+    if (i > 0) {
+      fname_part += "." + std::to_string(i);
+    }
+
+    fin = std::ifstream(fname_part, std::ios::binary);
+    fin.seekg(file_offset);
+
+    if (!fin || !llama_scan_tensors(fin, part_index[i])) {
+      *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                 [NSString stringWithFormat:@"invalid model file '%s' (bad tensor header)", fname_part.c_str()]);
+      return false;
+    }
+
+    fin.close();
+  }
+
+  if (stats) {
+    stats->n_threads = std::max(1, n_threads);
+    stats->parts.clear();
+  }
+
+  for (int i = 0; i < n_parts; ++i) {
+    const int part_id = i;
+
+    std::string fname_part = fname;
+    if (i > 0) {
+      fname_part += "." + std::to_string(i);
+    }
+
+    // validate the tensors of the part and plan the reads
+    std::vector<llama_read_job> jobs;
+    size_t total_size = 0;
+
+    for (const auto & info : part_index[i]) {
+      const std::string & name = info.name;
+
+      if (model.tensors.find(name) == model.tensors.end()) {
+        *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                   [NSString stringWithFormat:@"unknown tensor '%s' in model file", name.c_str()]);
+        return false;
+      }
+
+      auto tensor = model.tensors[name];
+
+      const int32_t nelements = info.ne[0]*info.ne[1];
+
+      // the 1d tensors are stored whole in every part
+      const bool split = info.n_dims == 2 && n_parts > 1;
+
+      const int split_type = llama_split_type(name);
+
+      if (ggml_nelements(tensor)/(split ? n_parts : 1) != nelements) {
+        *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                   [NSString stringWithFormat:@"tensor '%s' has wrong size in model file", name.c_str()]);
+        return false;
+      }
+
+      const int ne0 = split && split_type == 0 ? tensor->ne[0]/n_parts : tensor->ne[0];
+      const int ne1 = split && split_type == 1 ? tensor->ne[1]/n_parts : tensor->ne[1];
+
+      if (ne0 != info.ne[0] || ne1 != info.ne[1]) {
+        *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                   [NSString stringWithFormat:@"tensor '%s' has wrong shape in model file: got [%d, %d], expected [%d, %d]", name.c_str(), ne0, ne1, info.ne[0], info.ne[1]]);
+        return false;
+      }
+
+      if (llama_ftype_to_ggml_type(info.ftype) != tensor->type || info.size != ggml_nbytes(tensor)/(split ? n_parts : 1)) {
+        *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                   [NSString stringWithFormat:@"tensor '%s' has wrong size in model file: got %zu, expected %zu", name.c_str(), ggml_nbytes(tensor)/(split ? n_parts : 1), info.size]);
+        return false;
+      }
+
+      if (mapped_tensors.count(name) || (!split && part_id > 0)) {
+        continue;
+      }
+
+      char * data = reinterpret_cast<char *>(tensor->data);
+
+      std::vector<llama_read_job> tensor_jobs;
+
+      if (split && split_type == 0) {
+        // every row of the tensor gets a slice from each part
+        const size_t row_size = tensor->nb[1];
+
+        llama_add_read_jobs(tensor_jobs, info.offset, data + part_id*(row_size/n_parts), row_size/n_parts, tensor->ne[1], row_size);
+      } else if (split) {
+        // the part holds a contiguous block of rows
+        llama_add_read_jobs(tensor_jobs, info.offset, data + part_id*info.size, info.size, 1, 0);
+      } else {
+        llama_add_read_jobs(tensor_jobs, info.offset, data, info.size, 1, 0);
+      }
+
+      // the streamed weights are read by the layer stream, when their layer is needed
+      const auto it = streamed_tensors.find(name);
+      if (it != streamed_tensors.end()) {
+        for (const auto & job : tensor_jobs) {
+          model.stream->layer_reads[it->second].push_back({ part_id, job });
+        }
+        continue;
+      }
+
+      jobs.insert(jobs.end(), tensor_jobs.begin(), tensor_jobs.end());
+
+      total_size += info.size;
+    }
+
+    // read the tensor data with a pool of threads
+    const int64_t t_start_us = ggml_time_us();
+
+    const int fd = open(fname_part.c_str(), O_RDONLY);
+    if (fd == -1) {
+      *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                 [NSString stringWithFormat:@"failed to open '%s'", fname_part.c_str()]);
+      return false;
+    }
+
+    std::atomic<size_t> next_job(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]() {
+      while (!failed) {
+        const size_t j = next_job++;
+        if (j >= jobs.size()) {
+          break;
+        }
+
+        if (!llama_read_job_run(fd, jobs[j])) {
+          failed = true;
+        }
+      }
+    };
+
+    const int n_workers = std::min<int>(std::max(1, n_threads), std::max<size_t>(1, jobs.size()));
+
+    std::vector<std::thread> workers;
+    for (int j = 1; j < n_workers; ++j) {
+      workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+      w.join();
+    }
+
+    close(fd);
+
+    if (failed) {
+      *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                 [NSString stringWithFormat:@"invalid model file '%s' (truncated tensor data)", fname_part.c_str()]);
+      return false;
+    }
+
+    if (stats) {
+      stats->parts.push_back({ total_size, ggml_time_us() - t_start_us });
+    }
+  }
+
+  // start reading the first layers
+  if (model.stream) {
+    auto & stream = *model.stream;
+
+    for (int i = 0; i < n_parts; ++i) {
+      std::string fname_part = fname;
+      if (i > 0) {
+        fname_part += "." + std::to_string(i);
+      }
+
+      const int fd = open(fname_part.c_str(), O_RDONLY);
+      if (fd == -1) {
+        *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel,
+                                   [NSString stringWithFormat:@"failed to open '%s'", fname_part.c_str()]);
+        return false;
+      }
+
+      stream.fds.push_back(fd);
+    }
+
+    stream.thread = std::thread(llama_stream_run, std::ref(stream));
+  }
+
+  return true;
+}
+
+llama_session::~llama_session() {
+  llama_session_free(*this);
+}
+
+bool llama_session_init(llama_session & session, const llama_model & model, int n_ctx, int n_batch, int n_threads, bool use_huge_pages, int repeat_last_n, int seed, NSError **outError) {
+  llama_session_free(session);
+
+  const auto & hparams = model.hparams;
+
+  const int n_embd  = hparams.n_embd;
+  const int n_layer = hparams.n_layer;
+
+  const int n_mem      = n_layer*n_ctx;
+  const int n_elements = n_embd*n_mem;
+
+  n_batch   = std::max(1, std::min(n_batch, n_ctx));
+  n_threads = std::max(1, n_threads);
+
+  // the threads must split the rows of the weights as they were placed on the nodes
+  if (model.numa == LLAMA_NUMA_PARTITION) {
+    n_threads = model.numa_n_threads;
+  }
+
+  // key + value memory
+  {
+    const size_t kv_size = llama_kv_memory_size(hparams, n_ctx, GGML_TYPE_F32);
+
+    if (!llama_buffer_alloc(session.buf_kv, kv_size, use_huge_pages)) {
+      *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                                 [NSString stringWithFormat:@"failed to allocate %zu bytes", kv_size]);
+      return false;
+    }
+
+    struct ggml_init_params params = {
+      /*.mem_size   =*/ session.buf_kv.size,
+      /*.mem_buffer =*/ session.buf_kv.data,
+    };
+
+    session.ctx = ggml_init(params);
+    if (!session.ctx) {
+      llama_session_free(session);
+      *outError = makeLlamaError(LlamaErrorCodePredictionFailed, [NSString stringWithFormat:@"ggml_init() failed"]);
+      return false;
+    }
+
+    session.memory_k = ggml_new_tensor_1d(session.ctx, GGML_TYPE_F32, n_elements);
+    session.memory_v = ggml_new_tensor_1d(session.ctx, GGML_TYPE_F32, n_elements);
+  }
+
+  // compute buffer
+  {
+    const size_t buf_size = llama_eval_buffer_size(hparams, n_ctx, n_batch, n_threads, model.stream != nullptr);
+
+    if (!llama_buffer_alloc(session.buf, buf_size, use_huge_pages)) {
+      llama_session_free(session);
+      *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                                 [NSString stringWithFormat:@"failed to allocate %zu bytes", buf_size]);
+      return false;
+    }
+  }
+
+  session.n_ctx     = n_ctx;
+  session.n_batch   = n_batch;
+  session.n_threads = n_threads;
+  session.n_past    = 0;
+
+  // concurrent sessions pin their threads to CPUs of their own, in the first slot that no session holds - the threads
+  // are left to the scheduler once the CPUs of a node run out
+  if (model.numa != LLAMA_NUMA_NONE) {
+    std::lock_guard<std::mutex> lock(model.numa_slots->mutex);
+
+    auto & used = model.numa_slots->used;
+    const int slot = std::find(used.begin(), used.end(), false) - used.begin();
+
+    session.thread_cpus = llama_numa_thread_cpus(model.numa_topology, n_threads, slot);
+    if (!session.thread_cpus.empty()) {
+      if (slot == (int) used.size()) {
+        used.push_back(true);
+      } else {
+        used[slot] = true;
+      }
+
+      session.numa_slots = model.numa_slots;
+      session.numa_slot  = slot;
+    }
+  }
+
+  session.rng.seed(seed);
+  llama_sampler_init(session.sampler, hparams.n_vocab, repeat_last_n);
+
+  return true;
+}
+
+void llama_session_free(llama_session & session) {
+  if (session.ctx) {
+    ggml_free(session.ctx);
+    session.ctx = nullptr;
+  }
+
+  session.memory_k = nullptr;
+  session.memory_v = nullptr;
+
+  llama_buffer_free(session.buf_kv);
+  llama_buffer_free(session.buf);
+
+  session.logits = {};
+  session.thread_cpus.clear();
+
+  if (session.numa_slots) {
+    std::lock_guard<std::mutex> lock(session.numa_slots->mutex);
+    session.numa_slots->used[session.numa_slot] = false;
+  }
+
+  session.numa_slots.reset();
+  session.numa_slot = -1;
+}
+
+size_t llama_session_memory_size(const llama_session & session) {
+  size_t size = session.buf.size;
+
+  if (session.ctx) {
+    size += ggml_nbytes(session.memory_k) + ggml_nbytes(session.memory_v);
+  }
+
+  return size;
+}
+
+bool llama_model_footprint(const std::string & fname, int n_ctx, int n_batch, int n_threads, bool use_mmap, int n_stream_layers, llama_memory_footprint & footprint, NSError **outError) {
+  std::string error;
+
+  if (!llama_model_footprint(fname, n_ctx, n_batch, n_threads, use_mmap, n_stream_layers, footprint, error)) {
+    *outError = makeLlamaError(LlamaErrorCodeFailedToLoadModel, [NSString stringWithUTF8String:error.c_str()]);
+    return false;
+  }
+
+  return true;
+}
+
+// evaluate the transformer
+//
+//   - model:     the model
+//   - session:   the session, the tokens are evaluated at position session.n_past, which is then advanced by their number
+//   - embd_inp:  the embeddings of the tokens in the context, at most session.n_batch of them
+//   - logits_pos: the positions in embd_inp to compute logits for (default: the last token only)
+//
+// the predicted logits, n_vocab for each entry in logits_pos, are left in session.logits - a view into the
+// session's compute buffer
+//
+// the compute buffer is allocated by llama_session_init() and sized for the largest evaluation, so no memory is
+// allocated here
+//
+// if the layers of the model are streamed, the layers are computed one at a time, each one as soon as its weights
+// are read, and the evaluations of all the sessions of the model take turns
+//
+bool llama_eval(
+                const llama_model & model,
+                llama_session & session,
+                const std::vector<gpt_vocab::id> & embd_inp,
+                NSError **outError,
+                const std::vector<int32_t> & logits_pos
+) {
+  const int N = embd_inp.size();
+  const int n_past = session.n_past;
+
+  if (N > session.n_batch) {
+    *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                               [NSString stringWithFormat:@"too many tokens: %d, the session evaluates at most %d at a time", N, session.n_batch]);
+    return false;
+  }
+
+  if (n_past + N > session.n_ctx) {
+    *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                               [NSString stringWithFormat:@"context is full: %d + %d tokens do not fit in %d", n_past, N, session.n_ctx]);
+    return false;
+  }
+
+  auto & buf    = session.buf;
+  auto & logits = session.logits;
+
+  // the output projection is only applied to these rows
+  std::vector<int32_t> out_pos = logits_pos;
+  if (out_pos.empty()) {
+    out_pos.push_back(N - 1);
+  }
+
+  if ((int) out_pos.size() > N) {
+    *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                               [NSString stringWithFormat:@"too many logits positions: %zu for %d input tokens", out_pos.size(), N]);
+    return false;
+  }
+
+  for (const auto pos : out_pos) {
+    if (pos < 0 || pos >= N) {
+      *outError = makeLlamaError(LlamaErrorCodePredictionFailed,
+                                 [NSString stringWithFormat:@"invalid logits position %d for %d input tokens", pos, N]);
+      return false;
+    }
+  }
+
+  const int n_out = out_pos.size();
+
+  const auto & hparams = model.hparams;
+
+  const int n_embd  = hparams.n_embd;
+  const int n_layer = hparams.n_layer;
+  const int n_ctx   = session.n_ctx;
+  const int n_head  = hparams.n_head;
+  const int n_vocab = hparams.n_vocab;
+  const int n_rot   = hparams.n_embd/hparams.n_head;
+
+  const int d_key = n_embd/n_head;
+
+  llama_layer_stream * stream = model.stream.get();
+
+  std::unique_lock<std::mutex> stream_lock;
+  if (stream) {
+    stream_lock = std::unique_lock<std::mutex>(stream->eval_mutex);
+  }
+
+  struct ggml_init_params params = {
+    /*.mem_size   =*/ buf.size,
+    /*.mem_buffer =*/ buf.data,
+  };
+
+  struct ggml_context * ctx0 = ggml_init(params);
+
+  // the graphs of the layers of a streamed model share one work buffer, sized for the largest of them
+  struct ggml_tensor * work = nullptr;
+  if (stream) {
+    const size_t work_size = llama_eval_work_size(hparams, N, n_out, session.n_threads);
+    if (work_size > 0) {
+      work = ggml_new_tensor_1d(ctx0, GGML_TYPE_I8, ggml_graph_work_buffer_size(work_size, session.n_threads));
+    }
+  }
+
+  ggml_cgraph gf;
+
+  auto init_graph = [&]() {
+    gf = {};
+    gf.n_threads = session.n_threads;
+    gf.thread_cpus = session.thread_cpus.empty() ? NULL : session.thread_cpus.data();
+    gf.work = work;
+    gf.work_size = work ? ggml_nbytes(work) : 0;
+  };
+
+  init_graph();
+
+  struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+  memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+
+  struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
+
+  for (int il = 0; il < n_layer; ++il) {
+    struct ggml_tensor * inpSA = inpL;
+
+    struct ggml_tensor * cur;
+
+    // norm
+    {
+      cur = ggml_norm(ctx0, inpL);
+
+      // cur = attention_norm*cur
+      cur = ggml_mul_inplace(ctx0, cur, model.layers[il].attention_norm);
+    }
+
+    // self-attention
+    {
+      struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+      struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+      struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+
+      // store key and value to memory
+      if (N >= 1) {
+        struct ggml_tensor * k = ggml_view_1d(ctx0, session.memory_k, N*n_embd, (ggml_element_size(session.memory_k)*n_embd)*(il*n_ctx + n_past));
+        struct ggml_tensor * v = ggml_view_1d(ctx0, session.memory_v, N*n_embd, (ggml_element_size(session.memory_v)*n_embd)*(il*n_ctx + n_past));
+
+        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
+        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+      }
+
+      // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+      struct ggml_tensor * Q =
+      ggml_permute(ctx0,
+                   ggml_rope(ctx0,
+                             ggml_cpy(ctx0,
+                                      Qcur,
+                                      ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
+                             n_past, n_rot, 0),
+                   0, 2, 1, 3);
+
+      // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+      struct ggml_tensor * K =
+      ggml_permute(ctx0,
+                   ggml_rope(ctx0,
+                             ggml_reshape_3d(ctx0,
+                                             ggml_view_1d(ctx0, session.memory_k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(session.memory_k)*n_embd),
+                                             n_embd/n_head, n_head, n_past + N),
+                             n_past, n_rot, 1),
+                   0, 2, 1, 3);
+
+      // K * Q
+      struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+      // KQ_scaled = KQ / sqrt(n_embd/n_head)
+      struct ggml_tensor * KQ_scaled =
+      ggml_scale_inplace(ctx0,
+                         KQ,
+                         ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
+                         );
+
+      // KQ_masked = mask_past(KQ_scaled)
+      struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+
+      // KQ = soft_max(KQ_masked)
+      struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+
+      // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
+      struct ggml_tensor * V_trans =
+      ggml_permute(ctx0,
+                   ggml_reshape_3d(ctx0,
+                                   ggml_view_1d(ctx0, session.memory_v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(session.memory_v)*n_embd),
+                                   n_embd/n_head, n_head, n_past + N),
+                   1, 2, 0, 3);
+
+      // KQV = transpose(V) * KQ_soft_max
+      struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+
+      // KQV_merged = KQV.permute(0, 2, 1, 3)
+      struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+      // cur = KQV_merged.contiguous().view(n_embd, N)
+      cur = ggml_cpy(ctx0,
+                     KQV_merged,
+                     ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+
+      // projection (no bias)
+      cur = ggml_mul_mat(ctx0,
+                         model.layers[il].wo,
+                         cur);
+    }
+
+    struct ggml_tensor * inpFF = ggml_add_inplace(ctx0, cur, inpSA);
+
+    // feed-forward network
+    {
+      // norm
+      {
+        cur = ggml_norm(ctx0, inpFF);
+
+        // cur = ffn_norm*cur
+        cur = ggml_mul_inplace(ctx0, cur, model.layers[il].ffn_norm);
+      }
+
+      struct ggml_tensor * tmp = ggml_mul_mat(ctx0,
+                                              model.layers[il].w3,
+                                              cur);
+
+
+      cur = ggml_mul_mat(ctx0,
+                         model.layers[il].w1,
+                         cur);
+
+      // SILU activation
+      cur = ggml_silu_inplace(ctx0, cur);
+
+      cur = ggml_mul_inplace(ctx0, cur, tmp);
+
+      cur = ggml_mul_mat(ctx0,
+                         model.layers[il].w2,
+                         cur);
+    }
+
+    cur = ggml_add_inplace(ctx0, cur, inpFF);
+
+    // input for next layer
+    inpL = cur;
+
+    // compute the layer once its weights are read, then hand its slot back to the stream
+    if (stream) {
+      if (!llama_stream_acquire(*stream, il, outError)) {
+        ggml_free(ctx0);
+        return false;
+      }
+
+      ggml_build_forward_expand(&gf, inpL);
+      ggml_graph_compute       (ctx0, &gf);
+
+      llama_stream_release(*stream);
+
+      // the graph of the next layer starts from the output of this one
+      inpL = ggml_new_tensor_with_data(ctx0, GGML_TYPE_F32, 2, inpL->ne, inpL->data);
+
+      init_graph();
+    }
+  }
+
+  // drop the rows we don't need logits for before the final norm and lm_head
+  if (N > 1) {
+    struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_out);
+    memcpy(rows->data, out_pos.data(), n_out*ggml_element_size(rows));
+
+    inpL = ggml_get_rows(ctx0, inpL, rows);
+  }
+
+  // norm
+  {
+    inpL = ggml_norm(ctx0, inpL);
+
+    // inpL = norm*inpL
+    inpL = ggml_mul_inplace(ctx0, inpL, model.norm);
+  }
+
+  // lm_head
+  {
+    inpL = ggml_mul_mat(ctx0, model.output, inpL);
+  }
+
+  // logits -> probs
+  //inpL = ggml_soft_max(ctx0, inpL);
+
+  // run the computation
+  ggml_build_forward_expand(&gf, inpL);
+  ggml_graph_compute       (ctx0, &gf);
+
+  //if (n_past%100 == 0) {
+  //    ggml_graph_print   (&gf);
+  //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
+  //}
+
+  // the result stays in buf, which outlives ctx0
+  logits.data    = ggml_get_data_f32(inpL);
+  logits.n_vocab = n_vocab;
+  logits.n_rows  = n_out;
+
+  //printf("used_mem = %zu, buf.size = %zu\n", ggml_used_mem(ctx0), buf.size);
+
+  ggml_free(ctx0);
+
+  session.n_past += N;
+
+  return true;
+}
+
+// the model held by a slot of the cache, loaded first if the slot is empty or holds a model of other options - with
+// the cache locked
+static std::shared_ptr<llama_shared_model> llama_model_cache_load(std::shared_ptr<llama_shared_model> & slot, const llama_model_options & options, const gpt_params & params, bool & did_load, NSError **outError) {
+  did_load = false;
+
+  if (slot && slot->options == options) {
+    return slot;
+  }
+
+  auto model = std::make_shared<llama_shared_model>();
+  if (!llama_model_load(options.fname, model->model, model->vocab, options.use_mmap, options.use_huge_pages, options.numa, options.n_stream_layers, params.n_threads, &model->load_stats, outError)) {
+    return nullptr;
+  }
+
+  model->options = options;
+
+  slot = model;
+  did_load = true;
+
+  return model;
+}
+
+// the options of the model of params loaded from fname, with n_stream_layers decoder layers streamed
+static llama_model_options llama_model_cache_options(const gpt_params & params, const std::string & fname, int n_stream_layers) {
+  llama_model_options options;
+  options.fname           = fname;
+  options.use_mmap        = params.use_mmap;
+  options.use_huge_pages  = params.use_huge_pages;
+  options.numa            = params.numa;
+  options.n_stream_layers = n_stream_layers;
+
+  return options;
+}
+
+std::shared_ptr<llama_shared_model> llama_model_cache_get(llama_model_cache & cache, const gpt_params & params, bool & did_load, NSError **outError) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+
+  return llama_model_cache_load(cache.model, llama_model_cache_options(params, params.model, params.n_stream_layers), params, did_load, outError);
+}
+
+std::shared_ptr<llama_shared_model> llama_model_cache_get_draft(llama_model_cache & cache, const gpt_params & params, bool & did_load, NSError **outError) {
+  std::lock_guard<std::mutex> lock(cache.mutex);
+
+  // streaming its layers would cost the draft model more than it saves
+  return llama_model_cache_load(cache.draft_model, llama_model_cache_options(params, params.draft_model, 0), params, did_load, outError);
+}
@@ -7,6 +7,9 @@
 
 #import <Foundation/NSOperation.h>
 #import "utils.h"
+#import "LlamaModel.hh"
+
+#include <memory>
 
 @class _LlamaEvent;
 
@@ -17,6 +20,7 @@ typedef void (^LlamaPredictOperationEventHandler)(_LlamaEvent *event);
 @interface LlamaPredictOperation : NSOperation
 
 - (instancetype)initWithParams:(gpt_params)params
+                    modelCache:(std::shared_ptr<llama_model_cache>)modelCache
                   eventHandler:(LlamaPredictOperationEventHandler)eventHandler
              eventHandlerQueue:(dispatch_queue_t)eventHandlerQueue;
 
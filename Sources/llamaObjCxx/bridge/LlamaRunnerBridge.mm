@@ -10,10 +10,14 @@
 #import "LlamaRunnerBridgeConfig.h"
 #import "LlamaPredictOperation.hh"
 
+#import "LlamaModel.hh"
 #import "utils.h"
 
+#include <memory>
+
 @implementation _LlamaRunnerBridge {
   NSOperationQueue *_operationQueue;
+  std::shared_ptr<llama_model_cache> _modelCache;
 }
 
 - (instancetype)initWithModelPath:(nonnull NSString *)modelPath
@@ -22,6 +26,7 @@
     _modelPath = [modelPath copy];
     _operationQueue = [[NSOperationQueue alloc] init];
     _operationQueue.qualityOfService = NSQualityOfServiceUserInitiated;
+    _modelCache = std::make_shared<llama_model_cache>();
   }
   return self;
 }
@@ -38,11 +43,16 @@
   params.n_threads = (int)config.numberOfThreads;
   params.n_predict = (int)config.numberOfTokens;
 
+  if (config.contextSize > 0) {
+    params.n_ctx = (int)config.contextSize;
+  }
+
   if (config.reversePrompt != nil) {
     params.antiprompt = [config.reversePrompt cStringUsingEncoding:NSUTF8StringEncoding];
   }
 
   LlamaPredictOperation *operation = [[LlamaPredictOperation alloc] initWithParams:params
+                                                                        modelCache:_modelCache
                                                                       eventHandler:eventHandler
                                                                  eventHandlerQueue:eventHandlerQueue];
   [_operationQueue addOperation:operation];
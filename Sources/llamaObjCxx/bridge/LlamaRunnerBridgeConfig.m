@@ -11,6 +11,7 @@
 
 @synthesize numberOfThreads = _numberOfThreads;
 @synthesize numberOfTokens = _numberOfTokens;
+@synthesize contextSize = _contextSize;
 @synthesize reversePrompt = _reversePrompt;
 
 @end
@@ -9,20 +9,59 @@
 
 NS_ASSUME_NONNULL_BEGIN
 
+// the timings of reading a model from disk
+@interface _LlamaLoadStats : NSObject
+
+// the bytes read from each part of the model file, and the time spent reading them in seconds
+@property (nonatomic, copy) NSArray<NSNumber *> *partSizes;
+@property (nonatomic, copy) NSArray<NSNumber *> *partLoadTimes;
+
+@property (nonatomic, assign) NSTimeInterval loadTime;
+@property (nonatomic, assign) double readThroughput; // in GB/s
+@property (nonatomic, assign) NSUInteger numberOfThreads;
+
+// the size of the model context in bytes, and the kind of memory it was allocated from (malloc, huge pages, ...)
+@property (nonatomic, assign) NSUInteger contextSize;
+@property (nonatomic, copy) NSString *bufferType;
+
+@end
+
+// the tokens a prediction generated and the time it took to generate them, from the first one sampled - and, with
+// a draft model, how many of the tokens it proposed were accepted
+@interface _LlamaGenerationStats : NSObject
+
+@property (nonatomic, assign) NSUInteger numberOfTokens;
+@property (nonatomic, assign) NSTimeInterval generationTime;
+@property (nonatomic, readonly) double tokensPerSecond;
+
+// the speculative rounds, the tokens the draft model proposed in them and those accepted, and the tokens the rounds
+// generated in all - each round gives one token of the model besides those it accepts
+@property (nonatomic, assign) NSUInteger numberOfSpeculativeRounds;
+@property (nonatomic, assign) NSUInteger numberOfDraftedTokens;
+@property (nonatomic, assign) NSUInteger numberOfAcceptedTokens;
+@property (nonatomic, assign) NSUInteger numberOfSpeculativeTokens;
+@property (nonatomic, readonly) double acceptanceRate;
+
+// the time the draft model took to propose its tokens, part of generationTime
+@property (nonatomic, assign) NSTimeInterval draftTime;
+
+@end
+
 @interface _LlamaEvent : NSObject
 
 + (instancetype)startedLoadingModel;
-+ (instancetype)finishedLoadingModel;
+// the stats are nil for a model that was already loaded by an earlier prediction, or for no draft model
++ (instancetype)finishedLoadingModelWithStats:(nullable _LlamaLoadStats *)stats draftStats:(nullable _LlamaLoadStats *)draftStats;
 + (instancetype)startedGeneratingOutput;
 + (instancetype)outputTokenWithToken:(nonnull NSString *)token;
-+ (instancetype)completed;
++ (instancetype)completedWithStats:(nonnull _LlamaGenerationStats *)stats;
 + (instancetype)failedWithError:(nonnull NSError *)error;
 
 - (void)matchWithStartedLoadingModel:(void (^)(void))startedLoadingModel
-                finishedLoadingModel:(void (^)(void))finishedLoadingModel
+                finishedLoadingModel:(void (^)(_LlamaLoadStats * _Nullable stats, _LlamaLoadStats * _Nullable draftStats))finishedLoadingModel
              startedGeneratingOutput:(void (^)(void))startedGeneratingOutput
                          outputToken:(void (^)(NSString *token))startedLoadingModel
-                           completed:(void (^)(void))startedLoadingModel
+                           completed:(void (^)(_LlamaGenerationStats *stats))startedLoadingModel
                               failed:(void (^)(NSError *error))startedLoadingModel;
 
 @end
@@ -13,6 +13,7 @@ NS_ASSUME_NONNULL_BEGIN
 
 @property (nonatomic, assign) NSUInteger numberOfThreads;
 @property (nonatomic, assign) NSUInteger numberOfTokens;
+@property (nonatomic, assign) NSUInteger contextSize;
 
 @property (nullable, copy) NSString *reversePrompt;
 
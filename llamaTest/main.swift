@@ -21,13 +21,16 @@ guard let url = URL(string: pathString), FileManager.default.fileExists(atPath:
 // Run Llama
 
 @Sendable func run() async {
+  // the runner keeps the model loaded between prompts
+  let runner = LlamaRunner(modelURL: url)
+
   while true {
     print("Enter prompt: ")
     guard let prompt = readLine()?.trimmingCharacters(in: .whitespacesAndNewlines), !prompt.isEmpty else {
       break
     }
 
-    let tokenStream = LlamaRunner(modelURL: url).run(
+    let tokenStream = runner.run(
       with: prompt,
       stateChangeHandler: { state in
         switch state {
@@ -35,6 +38,8 @@ guard let url = URL(string: pathString), FileManager.default.fileExists(atPath:
           break
         case .initializing:
           print("Initializing model... ", terminator: "")
+        case .loadedModel:
+          break
         case .generatingOutput:
           print("Done.")
           print("")
@@ -14,7 +14,7 @@
 # This can be disabled by adding the "use-f32" CLI argument.
 #
 # At the start of the ggml file we write the model parameters
-# and vocabulary.
+# and vocabulary, with the score of each token.
 #
 
 import sys
@@ -89,7 +89,8 @@ for p in range(n_parts):
 
     fout = open(fname_out, "wb")
 
-    fout.write(struct.pack("i", 0x67676d6c)) # magic: ggml in hex
+    fout.write(struct.pack("i", 0x67676d66)) # magic: ggmf in hex
+    fout.write(struct.pack("i", 1)) # file version
     fout.write(struct.pack("i", hparams["vocab_size"]))
     fout.write(struct.pack("i", hparams["dim"]))
     fout.write(struct.pack("i", hparams["multiple_of"]))
@@ -122,6 +123,8 @@ for p in range(n_parts):
             text = tokenizer.id_to_piece(i).replace("\u2581", " ").encode("utf-8")
             fout.write(struct.pack("i", len(text)))
             fout.write(text)
+        # score of the token for the merges of the tokenizer
+        fout.write(struct.pack("f", tokenizer.get_score(i)))
 
     for k, v in model.items():
         name = k